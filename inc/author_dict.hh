@@ -0,0 +1,207 @@
+/**
+ * @file author_dict.hh
+ * @author Selene
+ * @brief 作者字典: 给每个不同的作者名一个连续的 32 位 ID.
+ * @version 0.2
+ * @date 2021-04-20
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef INC_AUTHOR_DICT_HH_
+#define INC_AUTHOR_DICT_HH_
+
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "bptree.hh"
+#include "util.hh"
+
+namespace ndb {
+
+using author_id = uint32_t;
+
+/**
+ * @brief 作者字典的键, 即作者名的 Hash 值. Hash 相同时按 ID 排序,
+ * 这样用 ID 为 -1 的键查找时总能落在第一个 Hash 相同的键上,
+ * 不会因为相同的键分在两个叶子里而漏掉左边的.
+ *
+ */
+struct DictKey {
+  DictKey() {}
+  DictKey(size_t key, int64_t id) : key(key), id(id) {}
+
+  bool operator<(const DictKey &t) const {
+    return key < t.key || (key == t.key && id < t.id);
+  }
+  bool operator<=(const DictKey &t) const { return !(t < *this); }
+  bool operator==(const DictKey &t) const {
+    return key == t.key && id == t.id;
+  }
+
+  size_t key;
+  int64_t id = -1;
+};
+
+/**
+ * @brief 作者名, 按 ID 保存, 即从 ID 到作者名的反查表.
+ *
+ */
+struct AuthorName {
+  char name[64] = {};
+};
+
+/**
+ * @brief 作者字典. 作者名只在这里保存一份, TopK 和合作者等数据都用 ID.
+ * 作者名到 ID 的查找用 B+ 树, 键是 Hash 值, Hash 相同时再比较名字.
+ * 分成 shards 个分片时, 作者按名字的 Hash 值分到第 Hash % shards 个分片,
+ * 分片内的第 i 个作者的 ID 是 i * shards + 分片号, 和 TopK 的文件划分一致.
+ *
+ */
+class AuthorDict {
+ public:
+  /**
+   * @brief 初始化.
+   *
+   * @param dname 数据库名.
+   * @param new_file 是否新建文件.
+   * @param shards 分片数.
+   */
+  void init_dict(std::string dname, bool new_file, size_t shards = 1);
+
+  /**
+   * @brief 查找作者名, 没有就新加一个.
+   *
+   * @param name 作者名.
+   * @return author_id 作者的 ID.
+   */
+  auto intern(std::string_view name) -> author_id;
+
+  /**
+   * @brief 查找作者名.
+   *
+   * @param name 作者名.
+   * @return int64_t 作者的 ID, 找不到时返回 -1.
+   */
+  auto find(std::string_view name) -> int64_t;
+
+  /**
+   * @brief 根据 ID 得到作者名.
+   *
+   */
+  auto name(author_id id) -> std::string;
+
+  /**
+   * @brief 作者 ID 的上界. 只有一个分片时就是作者数.
+   *
+   */
+  auto size() const -> int64_t { return id; }
+
+  /**
+   * @brief 作者字典用到的所有 Pager.
+   *
+   */
+  auto pagers() -> std::vector<std::shared_ptr<Pager>>;
+
+ private:
+  struct Shard {
+    int64_t count = 0;  // 分片内的作者数
+    std::shared_ptr<ndb::Pager> page_manager;
+    std::shared_ptr<ndb::Pager> name_manager;
+    std::shared_ptr<ndb::BplusTree<DictKey, 64>> bt;
+  };
+
+  int64_t id = 0;
+  std::vector<Shard> shards;
+  std::hash<std::string_view> hash_fn;
+};
+
+#pragma region  // # AuthorDict Implementation
+
+void AuthorDict::init_dict(std::string dname, bool new_file, size_t shards) {
+  this->shards.clear();
+  id = 0;
+  for (size_t i = 0; i < shards; i++) {
+    auto suffix = i == 0 ? "" : fmt::format("_{}", i);
+    auto idx = fmt::format("database/{0}/{0}_dict_idx{1}.bin", dname, suffix);
+    auto names =
+        fmt::format("database/{0}/{0}_dict_name{1}.bin", dname, suffix);
+    Shard s;
+    s.page_manager = std::make_shared<ndb::Pager>(idx, new_file);
+    s.name_manager = std::make_shared<ndb::Pager>(names, new_file);
+    s.bt = std::make_shared<ndb::BplusTree<DictKey, 64>>(s.page_manager);
+    AuthorName n;
+    s.count = s.name_manager->get_id(&n);
+    if (s.count > 0) {
+      id = std::max<int64_t>(id, (s.count - 1) * shards + i + 1);
+    }
+    this->shards.push_back(s);
+  }
+}
+
+auto AuthorDict::find(std::string_view name) -> int64_t {
+  // 超过 63 字节的名字只保存了前 63 字节, Hash 和比较都只用这一部分.
+  name = name.substr(0, sizeof(AuthorName::name) - 1);
+  auto pphash = hash_fn(name);
+  auto i = pphash % shards.size();
+  auto &s = shards[i];
+  auto iter = s.bt->find_geq({pphash, -1});
+  while (iter->id >= 0 && iter->key == pphash) {
+    AuthorName n;
+    if (s.name_manager->recover(iter->id, &n) && name == n.name) {
+      return iter->id * static_cast<int64_t>(shards.size()) + i;
+    }
+    iter++;
+  }
+  return -1;
+}
+
+auto AuthorDict::intern(std::string_view name) -> author_id {
+  auto found = find(name);
+  if (found >= 0) {
+    return static_cast<author_id>(found);
+  }
+  name = name.substr(0, sizeof(AuthorName::name) - 1);
+  AuthorName n;
+  snprintf(n.name, sizeof(n.name), "%.*s", static_cast<int>(name.size()),
+           name.data());
+  auto pphash = hash_fn(name);
+  auto i = pphash % shards.size();
+  auto &s = shards[i];
+  s.bt->insert({pphash, s.count});
+  s.name_manager->save(s.count, &n);
+  auto ret = s.count++ * static_cast<int64_t>(shards.size()) + i;
+  id = std::max<int64_t>(id, ret + 1);
+  return static_cast<author_id>(ret);
+}
+
+auto AuthorDict::name(author_id id) -> std::string {
+  AuthorName n;
+  if (!shards[id % shards.size()].name_manager->recover(id / shards.size(),
+                                                        &n)) {
+    return "";
+  }
+  return n.name;
+}
+
+auto AuthorDict::pagers() -> std::vector<std::shared_ptr<Pager>> {
+  std::vector<std::shared_ptr<Pager>> ret;
+  for (auto &s : shards) {
+    ret.push_back(s.page_manager);
+    ret.push_back(s.name_manager);
+  }
+  return ret;
+}
+
+#pragma endregion
+
+};  // namespace ndb
+
+#endif  // INC_AUTHOR_DICT_HH_
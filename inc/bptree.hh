@@ -15,13 +15,26 @@
 
 #include <fmt/color.h>
 #include <fmt/core.h>
+#include <fcntl.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <condition_variable>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <numeric>
 #include <string>
+#include <thread>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
@@ -31,6 +44,7 @@ namespace ndb {
 
 /**
  * @brief B+ 树和硬盘读写的中间层, 借助此类来完成对磁盘上某条数据的增删查操作.
+ * 每次读写都持有 io 锁, 所以读者线程可以和写者同时使用同一个 Pager.
  *
  */
 class Pager : protected std::fstream {
@@ -70,19 +84,52 @@ class Pager : protected std::fstream {
    * @param reg 一条数据.
    */
   template <class Register>
-  inline void save(const int64_t& n, Register* reg);
+  inline void save(int64_t n, Register* reg);
+
+  /**
+   * @brief 只把一条数据中 [offset, offset + len) 的字节写进文件.
+   * 回滚日志仍然按整条数据记录.
+   *
+   * @tparam Register Pager 读写的类.
+   * @param n 在位置为 n 处保存.
+   * @param reg 一条数据, 必须已经在文件中.
+   * @param offset 改动的部分在 reg 中的偏移.
+   * @param len 改动的部分的长度.
+   */
+  template <class Register>
+  inline void save(int64_t n, Register* reg, size_t offset, size_t len);
 
   /**
    * @brief 从文件中读取一条数据.
    *
    * @tparam Register Pager 读写的类.
-   * @param n 在位置为 n 处获取.
+   * @param n 在位置为 n 处获取. 按值传入, 调用者常把 reg 中的字段 (比如叶子的
+   * right) 传进来, 读完之后它就变了.
    * @param reg 一条数据.
    * @return true 如果读取成功.
    * @return false 如果读取失败.
    */
   template <class Register>
-  inline bool recover(const int64_t& n, Register* reg);
+  inline bool recover(int64_t n, Register* reg);
+
+  /**
+   * @brief 提示系统在后台读入这些位置的数据, 不等它读完, 也不加 io 锁.
+   *
+   */
+  template <class Register>
+  void advise(const std::vector<int64_t>& ids);
+
+  /**
+   * @brief 一次读取多条数据. 按位置排序后读, 位置相连的数据只 seek 一次,
+   * 整批只加一次 io 锁.
+   *
+   * @tparam Register Pager 读写的类.
+   * @param ids 各条数据的位置.
+   * @param regs 与 ids 一一对应的读取结果.
+   */
+  template <class Register>
+  void recover(const std::vector<int64_t>& ids,
+               const std::vector<Register*>& regs);
 
   /**
    * @brief 从文件中删除一条数据. 其实是在 n 处打上文件已删除的标记.
@@ -91,7 +138,179 @@ class Pager : protected std::fstream {
    * @param n 在位置为 n 处删除.
    */
   template <class Register>
-  inline void erase(const int64_t& n);
+  inline void erase(int64_t n);
+
+  /**
+   * @brief 把缓冲区中的内容写回文件并落盘.
+   *
+   */
+  void sync();
+
+  /**
+   * @brief 开启回滚日志. 此后上一个检查点时已有的数据第一次被覆盖之前,
+   * 原来的内容会先写进日志, 崩溃后可以用 rollback 回到那个检查点.
+   * 覆盖先留在内存中, 写回之前日志才落盘, 所以每批覆盖只需要一次 fsync.
+   *
+   * @param seq 检查点的序号.
+   */
+  void begin_journal(int64_t seq);
+
+  /**
+   * @brief 到达一个新的检查点: 写回缓冲区, 数据文件落盘之后才清空日志.
+   *
+   * @param seq 新检查点的序号.
+   */
+  void checkpoint(int64_t seq);
+
+  /**
+   * @brief 关闭并删除回滚日志.
+   *
+   */
+  void end_journal();
+
+  /**
+   * @brief 如果文件的日志属于序号为 seq 的检查点, 就用它把文件恢复到
+   * 那个检查点. 必须在打开文件之前调用.
+   *
+   * @param file_name 数据文件名.
+   * @param seq 检查点的序号.
+   */
+  static void rollback(std::string file_name, int64_t seq);
+
+  /**
+   * @brief 让系统在后台把上次保存的热页读进页缓存, 不等它读完.
+   * 相邻的页合并成一段再提示. 不需要打开 Pager.
+   *
+   * @param file_name 数据文件名, 热页列表是数据文件名加上 .hot.
+   */
+  static void preload(std::string file_name);
+
+  static constexpr size_t HOT_PAGES = 256;           // 保存的热页数
+  static constexpr size_t HOT_TRACKED = 4096;        // 统计表的槽数
+  static constexpr uint64_t PRELOAD_GAP = 64 << 10;  // 间隔小于它的页合并
+  static constexpr uint64_t PRELOAD_RUN = 1 << 20;   // 一段最长这么多
+  static constexpr uint64_t HELD_LIMIT = 4 << 20;    // 留在内存中的覆盖上限
+
+ private:
+  struct JournalHeader {
+    int64_t seq = 0;
+    uint64_t size = 0;  // 检查点时数据文件的大小
+  };
+  struct JournalEntry {
+    uint64_t offset = 0;
+    uint64_t len = 0;
+  };
+  // 统计表的一个槽, hits 为 0 时是空槽.
+  struct HotSlot {
+    uint64_t offset = 0;
+    uint32_t len = 0;
+    uint32_t hits = 0;
+  };
+  // 热页列表 (.hot 文件) 中的一条.
+  struct HotRecord {
+    uint64_t offset = 0;
+    uint64_t len = 0;
+  };
+
+  /**
+   * @brief 要覆盖检查点时已有的 [offset, offset + len) 时调用, 返回它在内存中
+   * 的副本, 覆盖写在副本上. 第一次覆盖时把原来的内容写进日志, 但不落盘.
+   * 检查点之后新增的部分回滚时直接截掉, 不需要记录, 也不经过这里.
+   * 调用时必须持有 io 锁.
+   *
+   */
+  auto hold(uint64_t offset, uint64_t len) -> char*;
+
+  /**
+   * @brief 日志落盘, 然后把留在内存中的覆盖写回文件.
+   * 调用时必须持有 io 锁.
+   *
+   */
+  void release();
+
+  /**
+   * @brief 如果 [offset, offset + len) 有留在内存中的覆盖, 复制到 buf.
+   *
+   */
+  void overlay(uint64_t offset, char* buf, uint64_t len);
+
+  /**
+   * @brief 记一次对 [offset, offset + len) 的读. 统计表按页号直接映射,
+   * 冲突时原来的页计数减一, 减到 0 才让出槽, 所以只有很久没读的页会被挤掉.
+   * 每次只改一个槽, 不分配内存.
+   *
+   */
+  void touch(uint64_t offset, uint64_t len);
+
+  /**
+   * @brief 把读得最多的 HOT_PAGES 个页按位置顺序写进热页列表.
+   * 只在检查点和关闭时调用, 这次打开以来没有读过时保留原来的列表.
+   * 调用时必须持有 io 锁.
+   *
+   */
+  void save_hot_pages();
+
+  std::string file_name;
+  // fstream 的 flush 只把内容交给系统, 落盘要对同一个文件调用 fsync.
+  int data_fd = -1;
+  int journal_fd = -1;
+  std::unique_ptr<std::fstream> journal;
+  JournalHeader journal_header;
+  std::unordered_set<uint64_t> journaled;
+  std::map<uint64_t, std::vector<char>> held;  // 按位置排序, 写回时顺序写
+  uint64_t held_bytes = 0;
+  std::vector<HotSlot> hot;  // 第一次读时才分配
+  std::mutex io;
+};
+
+/**
+ * @brief 读者表, 用于写时复制的 B+ 树回收旧页.
+ * 读者开始时在一个空槽里登记当前的纪元, 之后才读取根.
+ * 写者每次提交后纪元加一, 被替换下来的页标上提交前的纪元,
+ * 只有当所有登记的纪元都大于这个标记时才能重用.
+ * 登记和注销都只用原子操作, 读者之间, 读者和写者之间都不需要加锁.
+ * 槽都被占满时在链表末尾接上新的一组槽, 接上的槽直到析构才释放.
+ * 需要等旧读者结束的写者用 wait 睡眠, 有写者在等时注销才加锁唤醒它.
+ *
+ */
+class ReaderTable {
+ public:
+  static constexpr size_t SLOTS = 128;
+
+  ReaderTable() = default;
+  ReaderTable(const ReaderTable&) = delete;
+  auto operator=(const ReaderTable&) -> ReaderTable& = delete;
+  ~ReaderTable();
+
+  /**
+   * @brief 登记一个读者, 返回的指针释放时注销.
+   *
+   * @param epoch 当前的纪元.
+   */
+  auto pin(const std::atomic<uint64_t>& epoch) -> std::shared_ptr<void>;
+
+  /**
+   * @brief 所有读者中最早的纪元, 没有读者时返回 uint64_t 的最大值.
+   *
+   */
+  auto oldest() const -> uint64_t;
+
+  /**
+   * @brief 等到所有读者的纪元都不小于 epoch.
+   *
+   */
+  void wait(uint64_t epoch);
+
+ private:
+  struct Block {
+    // 0 表示空槽, 否则是纪元加一.
+    std::array<std::atomic<uint64_t>, SLOTS> slots{};
+    std::atomic<Block*> next{nullptr};
+  };
+  Block head;
+  std::atomic<int> waiters{0};
+  std::mutex mutex;
+  std::condition_variable released;
 };
 
 /**
@@ -208,12 +427,45 @@ class Iterator {
   auto operator=(const Iterator& that) -> Iterator&;
   bool operator!=(const Iterator& that) const;
 
+  static constexpr int64_t READAHEAD_MAX = 16;  // 一次最多预读的叶子数
+
  protected:
   Property<int64_t> index{0};
   Property<std::shared_ptr<node>> current_pos;
 
  private:
+  /**
+   * @brief 写时复制的树中叶子的 right 可能指向旧页,
+   * 所以沿着 path 回到父结点, 再走到下一个叶子.
+   *
+   */
+  void next_leaf();
+
+  /**
+   * @brief 走到一个新的叶子之后调用. 跨过两个叶子之后才当作扫描,
+   * 让系统在后台把后面的叶子读进页缓存, 迭代器自己照常读.
+   * 写时复制的树从父结点取出右边兄弟的位置, 每次预读的个数翻倍,
+   * 直到 READAHEAD_MAX, 上一批快用完时才发下一批.
+   * 原地修改的树不读叶子就只知道 right 指向的下一个, 每走一步提示一个.
+   *
+   */
+  void read_ahead();
+
+  struct Readahead {
+    int64_t leaves = 0;  // 跨过的叶子数
+    int64_t left = 0;    // 已经预读但还没走到的叶子数
+    int64_t window = 2;  // 下一次预读的叶子数
+  };
+
   std::shared_ptr<Pager> pager;
+
+  // 预读的状态只属于这一个迭代器, 复制和赋值时都不带过去.
+  std::unique_ptr<Readahead> ahead;
+
+  // 写时复制的树才使用: 从根到当前叶子经过的结点和子结点的下标,
+  // 以及读者表中的登记, 保证这些页在迭代器存在期间不会被重用.
+  std::vector<std::pair<std::shared_ptr<node>, int64_t>> path;
+  std::shared_ptr<void> pin;
 };
 
 template <class T, int16_t ORDER = 3>
@@ -222,15 +474,6 @@ class BplusTree {
   using iterator = Iterator<T, ORDER>;
   using nodeptr = std::shared_ptr<node>;
 
-  /**
-   * @brief B+ 树子结点的状态.
-   *
-   */
-  enum class State {
-    BT_OVERFLOW,   // 元素数目过多
-    BT_UNDERFLOW,  // 元素数目过少
-    OK,            // OK
-  };
   enum class InNode {
     LEFT,
     RIGHT,
@@ -238,6 +481,7 @@ class BplusTree {
   struct Header {
     int64_t root_id = 1;
     int64_t count = 0;
+    int64_t copy_on_write = 0;  // 旧文件中这里是 0, 即原地修改
   };
 
  public:
@@ -245,8 +489,10 @@ class BplusTree {
    * @brief B+ 树的构造函数.
    *
    * @param pager
+   * @param copy_on_write 新建文件时是否使用写时复制. 打开已有的文件时
+   * 以文件中记录的为准.
    */
-  explicit BplusTree(std::shared_ptr<Pager> pager);
+  explicit BplusTree(std::shared_ptr<Pager> pager, bool copy_on_write = false);
 
   /**
    * @brief begin()
@@ -279,23 +525,83 @@ class BplusTree {
   auto end() -> iterator;
 
   /**
-   * @brief 在 B+ 树中插入一个值.
+   * @brief 在 B+ 树中插入一个值. 写时复制的树在没有打开写事务时
+   * 每次插入都单独提交.
    *
    * @param value 待插入的值.
    */
   void insert(const T& value);
 
+  /**
+   * @brief 打开一个写事务. 写时复制的树在提交之前, 读者看不到事务中的插入,
+   * 事务中已经复制过的页也不会再复制. 原地修改的树忽略事务.
+   * 同一时刻只能有一个写者.
+   *
+   */
+  void begin_write();
+
+  /**
+   * @brief 提交写事务: 把新的根写进文件头, 再原子地换给读者.
+   *
+   */
+  void commit();
+
   /**
    * @brief 打印 B+ 树. (应该只用于测试.)
    *
    */
   void print();
 
+  /**
+   * @brief 从根开始读一遍上面 levels 层的结点, 让之后的查询不用等磁盘.
+   *
+   * @param levels 层数, 包括根.
+   */
+  void warm_up(int levels);
+
  private:
   int16_t print_count = 1;
   std::shared_ptr<Pager> pager;
+
+  // 上一次插入从根到叶子经过的结点.
+  std::vector<nodeptr> insert_path;
   std::shared_ptr<Header> header = std::make_shared<Header>();
 
+  // 以下用于写时复制. header->root_id 是写者正在修改的根,
+  // root 是最近一次提交的根, 读者只用 root.
+  std::atomic<int64_t> root{1};
+  std::atomic<uint64_t> epoch{0};
+  ReaderTable readers;
+  bool in_txn = false;
+  std::unordered_set<int64_t> fresh;                // 这个事务中新写的页
+  std::vector<int64_t> retired;                     // 这个事务中替换掉的页
+  std::vector<std::pair<uint64_t, int64_t>> limbo;  // (纪元, 页) 等待回收
+  std::vector<int64_t> free_pages;                  // 可以重用的页
+  bool free_found = false;  // 是否已经找过上次打开时留下的空闲页
+
+  /**
+   * @brief 读者开始: 登记后读取已提交的根.
+   *
+   */
+  auto snapshot(iterator* it) -> nodeptr;
+
+  /**
+   * @brief 找出从已提交的根走不到的页, 放进 free_pages. limbo 和 free_pages
+   * 只在内存中, 上次打开时回收或者还没重用的页要在这里找回来.
+   * 这次打开后还没有提交过, 读者只会用到走得到的页, 所以这些页可以直接重用.
+   * 按层读内部结点, 最下面一层只读第一个叶子来判断是不是叶子.
+   *
+   */
+  void find_free_pages();
+
+  /**
+   * @brief 写者要修改一个结点之前调用. 结点在这个事务中还没有写过时,
+   * 换到一个新页上, 原来的页等所有读者都不再使用后回收.
+   *
+   */
+  void copy_node(nodeptr n);
+
+
   /**
    * @brief 把 B+ 树的一个结点写进 record.
    *
@@ -325,9 +631,10 @@ class BplusTree {
    *
    * @param value
    * @param root
+   * @param it 写时复制的树在 it 中记录经过的结点.
    * @return iterator
    */
-  auto find_helper(const T& value, nodeptr root) -> iterator;
+  auto find_helper(const T& value, nodeptr root, iterator it) -> iterator;
 
   /**
    * @brief
@@ -337,13 +644,21 @@ class BplusTree {
   void print_helper(nodeptr ptr);
 
   /**
-   * @brief
+   * @brief 插入时读取路径上的结点. 上一次插入经过的结点都留在内存中,
+   * 并且和文件中的一致 (只有写者会修改它们), 同一个页直接复用, 不用再读.
+   * 递增的键每次都走最右边的路径, 除了分裂出的新页之外不需要读盘.
    *
-   * @param n
-   * @param value
-   * @return State
+   * @param depth 结点的深度, 根为 0.
+   * @param id 页号.
    */
-  auto insert_helper(nodeptr n, const T& value) -> State;
+  auto read_for_insert(size_t depth, int64_t id) -> nodeptr;
+
+  /**
+   * @brief 把溢出的子结点 child 分成两半, 右半边放到新页上,
+   * 中间的键插入 parent 的 pos 处. 写 child 和新页, parent 由调用者写.
+   *
+   */
+  void split_child(nodeptr parent, int64_t pos, nodeptr child);
 
   /**
    * @brief
@@ -368,9 +683,10 @@ class BplusTree {
 
 #pragma region  // # Pager Implementation
 
-Pager::Pager(std::string file_name, bool create)
+inline Pager::Pager(std::string file_name, bool create)
     : std::fstream(file_name.data(),
-                   std::ios::in | std::ios::out | std::ios::binary) {
+                   std::ios::in | std::ios::out | std::ios::binary),
+      file_name(file_name) {
   if (!create && !is_open()) {
     throw ndb::database_not_exist(file_name);
   }
@@ -380,43 +696,384 @@ Pager::Pager(std::string file_name, bool create)
   empty = false;
   if (create) {
     empty = true;
+    // 文件已经存在时上面已经打开了它, 要先关掉才能截断.
+    if (is_open()) {
+      close();
+    }
     open(file_name.data(),
          std::ios::in | std::ios::out | std::ios::trunc | std::ios::binary);
+    remove((file_name + ".hot").c_str());
   }
+  data_fd = ::open(file_name.c_str(), O_RDWR);
 }
 
-Pager::~Pager() { close(); }
+inline Pager::~Pager() {
+  release();
+  save_hot_pages();
+  close();
+  if (journal_fd >= 0) {
+    ::close(journal_fd);
+  }
+  if (data_fd >= 0) {
+    ::close(data_fd);
+  }
+}
 
 template <class Register>
-auto Pager::get_id(Register* reg) -> int64_t {
+auto Pager::get_id(Register*) -> int64_t {
+  std::lock_guard<std::mutex> lock(io);
   seekg(0, std::ios::end);
   auto id = tellg() / sizeof(Register);
   return id;
 }
 
 template <class Register>
-void Pager::save(const int64_t& n, Register* reg) {
+void Pager::save(int64_t n, Register* reg) {
+  std::lock_guard<std::mutex> lock(io);
+  uint64_t offset = n * sizeof(Register);
+  if (journal != nullptr && offset < journal_header.size) {
+    memcpy(hold(offset, sizeof(Register)), reg, sizeof(Register));
+    if (held_bytes >= HELD_LIMIT) {
+      release();
+    }
+    return;
+  }
   clear();
   seekp(n * sizeof(Register), std::ios::beg);
   write(reinterpret_cast<char*>(reg), sizeof(*reg));
 }
 
 template <class Register>
-bool Pager::recover(const int64_t& n, Register* reg) {
+void Pager::save(int64_t n, Register* reg, size_t offset, size_t len) {
+  std::lock_guard<std::mutex> lock(io);
+  uint64_t pos = n * sizeof(Register);
+  if (journal != nullptr && pos < journal_header.size) {
+    memcpy(hold(pos, sizeof(Register)) + offset,
+           reinterpret_cast<char*>(reg) + offset, len);
+    if (held_bytes >= HELD_LIMIT) {
+      release();
+    }
+    return;
+  }
+  clear();
+  seekp(n * sizeof(Register) + offset, std::ios::beg);
+  write(reinterpret_cast<char*>(reg) + offset, len);
+}
+
+template <class Register>
+bool Pager::recover(int64_t n, Register* reg) {
+  std::lock_guard<std::mutex> lock(io);
   clear();
   seekg(n * sizeof(Register), std::ios::beg);
   read(reinterpret_cast<char*>(reg), sizeof(*reg));
-  return gcount() > 0;
+  auto got = gcount() > 0;
+  overlay(n * sizeof(Register), reinterpret_cast<char*>(reg), sizeof(*reg));
+  touch(n * sizeof(Register), sizeof(Register));
+  return got;
 }
 
 template <class Register>
-void Pager::erase(const int64_t& n) {
+void Pager::advise(const std::vector<int64_t>& ids) {
+  for (auto id : ids) {
+    posix_fadvise(data_fd, static_cast<off_t>(id * sizeof(Register)),
+                  sizeof(Register), POSIX_FADV_WILLNEED);
+  }
+}
+
+template <class Register>
+void Pager::recover(const std::vector<int64_t>& ids,
+                    const std::vector<Register*>& regs) {
+  std::vector<size_t> order(ids.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(),
+            [&ids](size_t a, size_t b) { return ids[a] < ids[b]; });
+  std::lock_guard<std::mutex> lock(io);
+  int64_t next = -1;
+  for (auto i : order) {
+    if (ids[i] != next) {
+      clear();
+      seekg(ids[i] * sizeof(Register), std::ios::beg);
+    }
+    read(reinterpret_cast<char*>(regs[i]), sizeof(Register));
+    next = gcount() > 0 ? ids[i] + 1 : -1;
+    overlay(ids[i] * sizeof(Register), reinterpret_cast<char*>(regs[i]),
+            sizeof(Register));
+    touch(ids[i] * sizeof(Register), sizeof(Register));
+  }
+}
+
+template <class Register>
+void Pager::erase(int64_t n) {
+  std::lock_guard<std::mutex> lock(io);
+  uint64_t offset = n * sizeof(Register);
+  if (journal != nullptr && offset < journal_header.size) {
+    *hold(offset, sizeof(Register)) = 'X';
+    if (held_bytes >= HELD_LIMIT) {
+      release();
+    }
+    return;
+  }
   clear();
   char mark = 'X';
   seekg(n * sizeof(Register), std::ios::beg);
   write(&mark, 1);
 }
 
+inline void Pager::sync() {
+  std::lock_guard<std::mutex> lock(io);
+  release();
+  clear();
+  flush();
+  fsync(data_fd);
+}
+
+inline void Pager::begin_journal(int64_t seq) {
+  journal = std::make_unique<std::fstream>();
+  if (journal_fd < 0) {
+    // 之后每次截断的都是同一个文件, 所以 fd 一直有效.
+    journal_fd = ::open((file_name + ".jnl").c_str(), O_RDWR | O_CREAT, 0644);
+  }
+  checkpoint(seq);
+}
+
+inline void Pager::checkpoint(int64_t seq) {
+  std::lock_guard<std::mutex> lock(io);
+  release();
+  clear();
+  flush();
+  seekp(0, std::ios::end);
+  journal_header.seq = seq;
+  journal_header.size = static_cast<uint64_t>(tellp());
+  save_hot_pages();
+  journaled.clear();
+  if (journal != nullptr) {
+    // 数据落盘之前日志还要用来回滚, 不能截断.
+    fsync(data_fd);
+    journal->close();
+    journal->open(file_name + ".jnl", std::ios::in | std::ios::out |
+                                          std::ios::trunc | std::ios::binary);
+    journal->write(reinterpret_cast<char*>(&journal_header),
+                   sizeof(journal_header));
+    journal->flush();
+    fsync(journal_fd);
+  }
+}
+
+inline void Pager::end_journal() {
+  sync();
+  if (journal != nullptr) {
+    fsync(data_fd);
+    journal->close();
+    journal = nullptr;
+    ::close(journal_fd);
+    journal_fd = -1;
+    remove((file_name + ".jnl").c_str());
+  }
+}
+
+inline void Pager::rollback(std::string file_name, int64_t seq) {
+  std::ifstream in(file_name + ".jnl", std::ios::binary);
+  JournalHeader h;
+  if (!in.read(reinterpret_cast<char*>(&h), sizeof(h)) || h.seq != seq) {
+    return;
+  }
+  std::fstream out(file_name, std::ios::in | std::ios::out | std::ios::binary);
+  JournalEntry e;
+  std::vector<char> buf;
+  // 最后一条可能没写完, 但那时对应的数据还没有被覆盖, 可以直接忽略.
+  while (in.read(reinterpret_cast<char*>(&e), sizeof(e))) {
+    buf.resize(e.len);
+    if (!in.read(buf.data(), e.len)) {
+      break;
+    }
+    out.seekp(e.offset, std::ios::beg);
+    out.write(buf.data(), e.len);
+  }
+  out.close();
+  truncate(file_name.c_str(), static_cast<off_t>(h.size));
+}
+
+inline auto Pager::hold(uint64_t offset, uint64_t len) -> char* {
+  auto it = held.find(offset);
+  if (it != held.end()) {
+    return it->second.data();
+  }
+  std::vector<char> buf(len);
+  clear();
+  seekg(offset, std::ios::beg);
+  read(buf.data(), len);
+  if (journaled.count(offset) == 0) {
+    JournalEntry e{offset, std::min(len, journal_header.size - offset)};
+    journal->write(reinterpret_cast<char*>(&e), sizeof(e));
+    journal->write(buf.data(), e.len);
+    journaled.insert(offset);
+  }
+  held_bytes += len;
+  return held.emplace(offset, std::move(buf)).first->second.data();
+}
+
+inline void Pager::release() {
+  if (held.empty()) {
+    return;
+  }
+  // 日志必须先于数据落盘, 否则崩溃时可能丢失原来的内容.
+  journal->flush();
+  fsync(journal_fd);
+  for (auto& [offset, buf] : held) {
+    clear();
+    seekp(offset, std::ios::beg);
+    write(buf.data(), buf.size());
+  }
+  held.clear();
+  held_bytes = 0;
+}
+
+inline void Pager::overlay(uint64_t offset, char* buf, uint64_t len) {
+  if (held.empty()) {
+    return;
+  }
+  auto it = held.find(offset);
+  if (it != held.end()) {
+    memcpy(buf, it->second.data(), std::min<uint64_t>(len, it->second.size()));
+  }
+}
+
+inline void Pager::touch(uint64_t offset, uint64_t len) {
+  if (hot.empty()) {
+    hot.resize(HOT_TRACKED);
+  }
+  auto& slot = hot[offset / len % HOT_TRACKED];
+  if (slot.hits > 0 && slot.offset != offset && --slot.hits > 0) {
+    return;
+  }
+  if (slot.hits == 0) {
+    slot.offset = offset;
+    slot.len = static_cast<uint32_t>(len);
+  }
+  slot.hits++;
+}
+
+inline void Pager::save_hot_pages() {
+  std::vector<HotSlot> pages;
+  std::copy_if(hot.begin(), hot.end(), std::back_inserter(pages),
+               [](const HotSlot& t) { return t.hits > 0; });
+  if (pages.empty()) {
+    return;
+  }
+  auto n = std::min(pages.size(), HOT_PAGES);
+  std::partial_sort(
+      pages.begin(), pages.begin() + n, pages.end(),
+      [](const auto& a, const auto& b) { return a.hits > b.hits; });
+  pages.resize(n);
+  std::sort(pages.begin(), pages.end(),
+            [](const auto& a, const auto& b) { return a.offset < b.offset; });
+  // 热页列表只是提示, 写不出来也不影响数据, 所以不报错.
+  auto fn = file_name + ".hot";
+  auto tmp = fn + ".tmp";
+  auto file = fopen(tmp.c_str(), "wb");
+  if (file == nullptr) {
+    return;
+  }
+  for (auto& page : pages) {
+    HotRecord r{page.offset, page.len};
+    fwrite(&r, sizeof(r), 1, file);
+  }
+  fclose(file);
+  rename(tmp.c_str(), fn.c_str());
+}
+
+inline void Pager::preload(std::string file_name) {
+  std::ifstream list(file_name + ".hot", std::ios::binary);
+  std::vector<HotRecord> pages;
+  HotRecord r;
+  while (list.read(reinterpret_cast<char*>(&r), sizeof(r))) {
+    pages.push_back(r);
+  }
+  std::sort(pages.begin(), pages.end(),
+            [](const auto& a, const auto& b) { return a.offset < b.offset; });
+  auto fd = ::open(file_name.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+  for (size_t i = 0; i < pages.size();) {
+    // 把相邻的页合并成一段 [begin, end), 一次提示.
+    auto begin = pages[i].offset;
+    auto end = begin + pages[i].len;
+    for (i++; i < pages.size() && pages[i].offset <= end + PRELOAD_GAP &&
+              pages[i].offset + pages[i].len - begin <= PRELOAD_RUN;
+         i++) {
+      end = std::max(end, pages[i].offset + pages[i].len);
+    }
+    posix_fadvise(fd, static_cast<off_t>(begin),
+                  static_cast<off_t>(end - begin), POSIX_FADV_WILLNEED);
+  }
+  ::close(fd);
+}
+
+#pragma endregion
+
+#pragma region  // # ReaderTable Implementation
+
+inline ReaderTable::~ReaderTable() {
+  auto b = head.next.load();
+  while (b != nullptr) {
+    auto next = b->next.load();
+    delete b;
+    b = next;
+  }
+}
+
+inline auto ReaderTable::pin(const std::atomic<uint64_t>& epoch)
+    -> std::shared_ptr<void> {
+  for (auto b = &head;;) {
+    for (auto& slot : b->slots) {
+      uint64_t expected = 0;
+      if (slot.load(std::memory_order_relaxed) == 0 &&
+          slot.compare_exchange_strong(expected, epoch.load() + 1)) {
+        return std::shared_ptr<void>(&slot, [this](void* p) {
+          static_cast<std::atomic<uint64_t>*>(p)->store(0);
+          // 先清槽再看有没有写者在等, 和 wait 的顺序相反, 不会漏掉唤醒.
+          if (waiters.load() > 0) {
+            std::lock_guard<std::mutex> lock(mutex);
+            released.notify_all();
+          }
+        });
+      }
+    }
+    auto next = b->next.load();
+    if (next == nullptr) {
+      // 这一组槽满了, 接上新的一组. 别的读者抢先接上时用它接上的.
+      auto fresh = new Block;
+      if (b->next.compare_exchange_strong(next, fresh)) {
+        next = fresh;
+      } else {
+        delete fresh;
+      }
+    }
+    b = next;
+  }
+}
+
+inline auto ReaderTable::oldest() const -> uint64_t {
+  auto ret = std::numeric_limits<uint64_t>::max();
+  for (auto b = &head; b != nullptr; b = b->next.load()) {
+    for (auto& slot : b->slots) {
+      auto v = slot.load();
+      if (v != 0) {
+        ret = std::min(ret, v - 1);
+      }
+    }
+  }
+  return ret;
+}
+
+inline void ReaderTable::wait(uint64_t epoch) {
+  std::unique_lock<std::mutex> lock(mutex);
+  waiters++;
+  released.wait(lock, [&] { return oldest() >= epoch; });
+  waiters--;
+}
+
 #pragma endregion
 
 #pragma region  // # Node Implementation
@@ -454,7 +1111,7 @@ void Node<T, ORDER>::delete_in_node(int64_t pos) {
     data[i] = data[i + 1];
     children[i + 1] = children[i + 2];
   }
-  count--;
+  count = count() - 1;
 }
 
 template <class T, int16_t ORDER>
@@ -484,6 +1141,8 @@ Iterator<T, ORDER>::Iterator(const Iterator& that) {
   this->current_pos = that.current_pos();
   this->index = that.index();
   this->pager = that.pager;
+  this->path = that.path;
+  this->pin = that.pin;
 }
 
 template <class T, int16_t ORDER>
@@ -506,10 +1165,13 @@ auto Iterator<T, ORDER>::operator++() -> Iterator& {
   } else {
     index = 0;
     auto that = std::make_shared<node>(-1);
-    if (current_pos()->right() == 0) {
+    if (pin != nullptr) {
+      next_leaf();
+    } else if (current_pos()->right() == 0) {
       current_pos = that;
     } else {
       this->pager->recover(current_pos()->right(), current_pos.itself().get());
+      read_ahead();
     }
   }
   return *this;
@@ -527,6 +1189,9 @@ auto Iterator<T, ORDER>::operator=(const Iterator& that) -> Iterator& {
   this->current_pos = that.current_pos();
   this->index = that.index();
   this->pager = that.pager;
+  this->path = that.path;
+  this->pin = that.pin;
+  this->ahead = nullptr;
   return *this;
 }
 
@@ -540,14 +1205,77 @@ bool Iterator<T, ORDER>::operator!=(const Iterator& that) const {
   return true;
 }
 
+template <class T, int16_t ORDER>
+void Iterator<T, ORDER>::next_leaf() {
+  while (!path.empty()) {
+    auto& [parent, pos] = path.back();
+    if (pos < parent->count()) {
+      pos++;
+      auto child = std::make_shared<node>(-1);
+      pager->recover(parent->children()[pos], child.get());
+      while (!child->is_leaf()) {
+        path.push_back({child, 0});
+        auto next = std::make_shared<node>(-1);
+        pager->recover(child->children()[0], next.get());
+        child = next;
+      }
+      current_pos = child;
+      read_ahead();
+      return;
+    }
+    path.pop_back();
+  }
+  current_pos = std::make_shared<node>(-1);
+}
+
+template <class T, int16_t ORDER>
+void Iterator<T, ORDER>::read_ahead() {
+  if (ahead == nullptr) {
+    ahead = std::make_unique<Readahead>();
+  }
+  ahead->leaves++;
+  ahead->left = std::max<int64_t>(ahead->left - 1, 0);
+  // 点查和短的范围查询不预读.
+  if (ahead->leaves < 2) {
+    return;
+  }
+  if (pin == nullptr) {
+    auto id = current_pos()->right();
+    if (id != 0) {
+      pager->advise<node>({id});
+    }
+    return;
+  }
+  // 预读好的叶子还够走一阵时先不发下一批.
+  // path 的最后一个是当前叶子的父结点, 它右边的子结点都是叶子.
+  if (ahead->left * 2 > ahead->window || path.empty()) {
+    return;
+  }
+  auto n = ahead->window;
+  auto& [parent, pos] = path.back();
+  std::vector<int64_t> ids;
+  for (auto i = pos + 1 + ahead->left;
+       i <= parent->count() && i <= pos + ahead->left + n; i++) {
+    ids.push_back(parent->children()[i]);
+  }
+  if (ids.empty()) {
+    return;
+  }
+  pager->advise<node>(ids);
+  ahead->left += static_cast<int64_t>(ids.size());
+  ahead->window = std::min(n * 2, READAHEAD_MAX);
+}
+
 #pragma endregion
 
 #pragma region  // # BplusTree Implementation
 
 template <class T, int16_t ORDER>
-BplusTree<T, ORDER>::BplusTree(std::shared_ptr<Pager> pager) {
+BplusTree<T, ORDER>::BplusTree(std::shared_ptr<Pager> pager,
+                               bool copy_on_write) {
   this->pager = pager;
   if (pager->empty()) {
+    header->copy_on_write = copy_on_write;
     node root(header->root_id);
     pager->save(root.page_id(), &root);
     header->count++;
@@ -555,32 +1283,37 @@ BplusTree<T, ORDER>::BplusTree(std::shared_ptr<Pager> pager) {
   } else {
     pager->recover(0, header.get());
   }
+  root = header->root_id;
 }
 
 template <class T, int16_t ORDER>
 auto BplusTree<T, ORDER>::begin() -> iterator {
-  auto root = read_node(header->root_id);
+  iterator it(pager);
+  auto root = snapshot(&it);
   while (!root->is_leaf()) {
+    if (it.pin != nullptr) {
+      it.path.push_back({root, 0});
+    }
     auto id = root->children()[0];
     root = read_node(id);
   }
-  iterator it(pager);
   it.current_pos = root;
   return it;
 }
 
 template <class T, int16_t ORDER>
 auto BplusTree<T, ORDER>::find(const T& value) -> iterator {
-  auto root = read_node(header->root_id);
-  auto it = find_helper(value, root);
+  iterator it(pager);
+  auto root = snapshot(&it);
+  it = find_helper(value, root, it);
   return *it == value ? it : end();
 }
 
 template <class T, int16_t ORDER>
 auto BplusTree<T, ORDER>::find_geq(const T& value) -> iterator {
-  auto root = read_node(header->root_id);
-  auto it = find_helper(value, root);
-  return it;
+  iterator it(pager);
+  auto root = snapshot(&it);
+  return find_helper(value, root, it);
 }
 
 template <class T, int16_t ORDER>
@@ -593,10 +1326,51 @@ auto BplusTree<T, ORDER>::end() -> iterator {
 
 template <class T, int16_t ORDER>
 void BplusTree<T, ORDER>::insert(const T& value) {
-  auto root = read_node(header->root_id);
-  auto state = insert_helper(root, value);
-  if (state == State::BT_OVERFLOW) {
-    auto overflow = read_node(header->root_id);
+  auto auto_commit = header->copy_on_write && !in_txn;
+  if (auto_commit) {
+    begin_write();
+  }
+  // 从根走到叶子, 把经过的结点和子结点的下标记在 path 中.
+  std::vector<std::pair<nodeptr, int64_t>> path;
+  auto n = read_for_insert(0, header->root_id);
+  if (header->copy_on_write) {
+    copy_node(n);
+    header->root_id = n->page_id();
+  }
+  while (true) {
+    auto pos = 0;
+    while (pos < n->count() && n->data()[pos] < value) {
+      pos++;
+    }
+    path.push_back({n, pos});
+    if (n->children()[pos] == 0) {
+      break;
+    }
+    auto child = read_for_insert(path.size(), n->children()[pos]);
+    if (header->copy_on_write) {
+      // 路径上的每个结点都复制到新页, 父结点也要指向新页.
+      copy_node(child);
+      n->children.set(pos, child->page_id());
+    }
+    n = child;
+  }
+  insert_path.clear();
+  for (auto& p : path) {
+    insert_path.push_back(p.first);
+  }
+  n->insert_in_node(path.back().second, value);
+  path.pop_back();
+  // 沿着 path 向上分裂, 直到某个结点不再溢出. 每个改过的页只写一次.
+  while (n->is_overflow() && !path.empty()) {
+    auto [parent, pos] = path.back();
+    path.pop_back();
+    split_child(parent, pos, n);
+    n = parent;
+  }
+  if (!n->is_overflow()) {
+    write_node(n->page_id(), n);
+  } else {
+    auto overflow = n;
     auto left_child = new_node();
     auto right_child = new_node();
     int64_t iter = 0;
@@ -610,12 +1384,138 @@ void BplusTree<T, ORDER>::insert(const T& value) {
     overflow->count = 1;
     write_these_nodes(overflow, left_child, right_child, 0);
   }
+  // 写时复制的树中, 剩下的祖先结点都换了子结点的页号, 也要写.
+  if (header->copy_on_write) {
+    for (auto& p : path) {
+      write_node(p.first->page_id(), p.first);
+    }
+  }
+  if (auto_commit) {
+    commit();
+  }
+}
+
+template <class T, int16_t ORDER>
+void BplusTree<T, ORDER>::begin_write() {
+  in_txn = true;
+  if (header->copy_on_write && !free_found) {
+    find_free_pages();
+    free_found = true;
+  }
+}
+
+template <class T, int16_t ORDER>
+void BplusTree<T, ORDER>::commit() {
+  in_txn = false;
+  if (!header->copy_on_write) {
+    return;
+  }
+  pager->save(0, header.get());
+  root = header->root_id;
+  // 先换根再增加纪元, 此后登记的读者一定读到新的根.
+  auto e = epoch.load();
+  for (auto id : retired) {
+    limbo.push_back({e, id});
+  }
+  retired.clear();
+  fresh.clear();
+  epoch = e + 1;
+  auto oldest = readers.oldest();
+  auto reusable =
+      std::partition(limbo.begin(), limbo.end(),
+                     [oldest](const auto& x) { return x.first >= oldest; });
+  for (auto it = reusable; it != limbo.end(); it++) {
+    free_pages.push_back(it->second);
+  }
+  limbo.erase(reusable, limbo.end());
+}
+
+template <class T, int16_t ORDER>
+void BplusTree<T, ORDER>::find_free_pages() {
+  std::vector<bool> used(header->count + 1, false);
+  used[0] = true;  // 文件头
+  std::vector<int64_t> ids = {header->root_id};
+  // 所有叶子在同一层, 一层的第一个结点是叶子时整层都是.
+  while (!ids.empty()) {
+    for (auto id : ids) {
+      used[id] = true;
+    }
+    if (read_node(ids[0])->is_leaf()) {
+      break;
+    }
+    std::vector<nodeptr> level;
+    std::vector<node*> regs;
+    for (size_t j = 0; j < ids.size(); j++) {
+      level.push_back(std::make_shared<node>(-1));
+      regs.push_back(level.back().get());
+    }
+    pager->recover(ids, regs);
+    ids.clear();
+    for (auto& n : level) {
+      for (int64_t j = 0; j <= n->count(); j++) {
+        ids.push_back(n->children()[j]);
+      }
+    }
+  }
+  // 倒序放入, new_node 从页号小的开始重用.
+  for (auto id = header->count; id > 0; id--) {
+    if (!used[id]) {
+      free_pages.push_back(id);
+    }
+  }
+}
+
+template <class T, int16_t ORDER>
+void BplusTree<T, ORDER>::warm_up(int levels) {
+  iterator it(pager);
+  std::vector<nodeptr> level = {snapshot(&it)};
+  for (int i = 1; i < levels && !level.empty(); i++) {
+    // 整层的子结点一起按页号顺序读.
+    std::vector<int64_t> ids;
+    for (auto& n : level) {
+      if (n->is_leaf()) {
+        continue;
+      }
+      // 原地修改的树可能正在被写, 读到的 count 不可信, 限制在 ORDER 以内.
+      auto cnt = std::min<int64_t>(n->count(), ORDER);
+      for (int64_t j = 0; j <= cnt; j++) {
+        ids.push_back(n->children()[j]);
+      }
+    }
+    std::vector<nodeptr> next;
+    std::vector<node*> regs;
+    for (size_t j = 0; j < ids.size(); j++) {
+      next.push_back(std::make_shared<node>(-1));
+      regs.push_back(next.back().get());
+    }
+    pager->recover(ids, regs);
+    level = std::move(next);
+  }
+}
+
+template <class T, int16_t ORDER>
+auto BplusTree<T, ORDER>::snapshot(iterator* it) -> nodeptr {
+  if (!header->copy_on_write) {
+    return read_node(header->root_id);
+  }
+  it->pin = readers.pin(epoch);
+  return read_node(root);
+}
+
+template <class T, int16_t ORDER>
+void BplusTree<T, ORDER>::copy_node(nodeptr n) {
+  if (fresh.count(n->page_id()) > 0) {
+    return;
+  }
+  retired.push_back(n->page_id());
+  n->page_id = new_node()->page_id();
 }
 
 template <class T, int16_t ORDER>
 void BplusTree<T, ORDER>::print() {
   print_count = 1;
-  auto root = read_node(header->root_id);
+  iterator it(pager);
+  auto root = snapshot(&it);
   if (print_count > 64) {
     return;
   }
@@ -636,6 +1536,18 @@ auto BplusTree<T, ORDER>::read_node(int64_t id) -> nodeptr {
 
 template <class T, int16_t ORDER>
 auto BplusTree<T, ORDER>::new_node() -> nodeptr {
+  if (header->copy_on_write) {
+    // 文件头在提交时才写, 读者看到的总是已提交的根.
+    int64_t id;
+    if (!free_pages.empty()) {
+      id = free_pages.back();
+      free_pages.pop_back();
+    } else {
+      id = ++header->count;
+    }
+    fresh.insert(id);
+    return std::make_shared<node>(id);
+  }
   header->count++;
   auto ret = std::make_shared<node>(header->count);
   pager->save(0, header.get());
@@ -643,20 +1555,24 @@ auto BplusTree<T, ORDER>::new_node() -> nodeptr {
 }
 
 template <class T, int16_t ORDER>
-auto BplusTree<T, ORDER>::find_helper(const T& value, nodeptr root)
-    -> iterator {
+auto BplusTree<T, ORDER>::find_helper(const T& value, nodeptr root,
+                                      iterator it) -> iterator {
   auto pos = 0;
   if (!root->is_leaf()) {
-    while (pos < root->count() && root->data()[pos] <= value) {
+    // 插入时等于分隔键的值进左边, 所以相等的值可能在分隔键左右两边,
+    // 要从最左边的开始找.
+    while (pos < root->count() && root->data()[pos] < value) {
       pos++;
     }
+    if (it.pin != nullptr) {
+      it.path.push_back({root, pos});
+    }
     auto child = read_node(root->children()[pos]);
-    return find_helper(value, child);
+    return find_helper(value, child, it);
   } else {
     while (pos < root->count() && root->data()[pos] < value) {
       pos++;
     }
-    iterator it(pager);
     it.current_pos = root;
     it.index = pos;
     if (pos == root->count()) {
@@ -696,38 +1612,36 @@ void BplusTree<T, ORDER>::print_helper(nodeptr ptr) {
 }
 
 template <class T, int16_t ORDER>
-auto BplusTree<T, ORDER>::insert_helper(nodeptr n, const T& value) -> State {
-  auto pos = 0;
-  while (pos < n->count() && n->data()[pos] < value) {
-    pos++;
-  }
-  if (n->children()[pos] != 0) {
-    auto id = n->children()[pos];
-    auto child = read_node(id);
-    auto state = insert_helper(child, value);
-    if (state == State::BT_OVERFLOW) {
-      auto overflow = read_node(n->children()[pos]);
-      auto left_child = overflow;
-      left_child->count = 0;
-      auto right_child = new_node();
-      int64_t iter = 0;
-      reset_children(overflow, left_child, InNode::LEFT, &iter);
-      n->insert_in_node(pos, overflow->data()[iter]);
-      if (!overflow->is_leaf()) {
-        iter++;
-      } else {
-        right_child->right = left_child->right();
-        left_child->right = right_child->page_id();
-        n->children.set(pos + 1, right_child->page_id());
-      }
-      reset_children(overflow, right_child, InNode::RIGHT, &iter);
-      write_these_nodes(n, left_child, right_child, pos);
-    }
+auto BplusTree<T, ORDER>::read_for_insert(size_t depth, int64_t id)
+    -> nodeptr {
+  if (depth < insert_path.size() && insert_path[depth]->page_id() == id) {
+    return insert_path[depth];
+  }
+  return read_node(id);
+}
+
+template <class T, int16_t ORDER>
+void BplusTree<T, ORDER>::split_child(nodeptr parent, int64_t pos,
+                                      nodeptr child) {
+  // 左半边留在 child 原来的页上.
+  auto overflow = child;
+  auto left_child = child;
+  left_child->count = 0;
+  auto right_child = new_node();
+  int64_t iter = 0;
+  reset_children(overflow, left_child, InNode::LEFT, &iter);
+  parent->insert_in_node(pos, overflow->data()[iter]);
+  if (!overflow->is_leaf()) {
+    iter++;
   } else {
-    n->insert_in_node(pos, value);
-    write_node(n->page_id(), n);
+    right_child->right = left_child->right();
+    left_child->right = right_child->page_id();
   }
-  return n->is_overflow() ? State::BT_OVERFLOW : State::OK;
+  reset_children(overflow, right_child, InNode::RIGHT, &iter);
+  parent->children.set(pos, left_child->page_id());
+  parent->children.set(pos + 1, right_child->page_id());
+  write_node(left_child->page_id(), left_child);
+  write_node(right_child->page_id(), right_child);
 }
 
 template <class T, int16_t ORDER>
@@ -0,0 +1,182 @@
+/**
+ * @file catalog.hh
+ * @author Selene
+ * @brief 打开的数据库的目录. 可以同时打开多个数据库, 用 use 选择在哪些上查询.
+ * @version 0.2
+ * @date 2021-04-26
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef INC_CATALOG_HH_
+#define INC_CATALOG_HH_
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "database.hh"
+#include "util.hh"
+
+namespace ndb {
+
+/**
+ * @brief 所有打开的数据库. 每个数据库有自己的一套文件和管理器,
+ * 不同数据库上的查询互不影响, 可以同时进行.
+ * 查询命令作用在选中的数据库上, 最近打开的数据库会被单独选中.
+ *
+ */
+class Catalog {
+ public:
+  /**
+   * @brief 打开一个数据库并选中它.
+   *
+   * @param name 数据库名.
+   * @param new_file 是否新建文件.
+   * @param engine 同 Database::db_open.
+   * @param shards 同 Database::db_open.
+   * @param compress 同 Database::db_open.
+   */
+  auto open(std::string name, bool new_file, Engine engine = Engine::BTREE,
+            size_t shards = 1, bool compress = false)
+      -> std::shared_ptr<Database>;
+
+  /**
+   * @brief 关闭一个数据库. 没有选中的数据库时选中剩下的第一个.
+   *
+   */
+  void close(std::string name);
+
+  void close_all();
+
+  /**
+   * @brief 选中若干个已经打开的数据库.
+   *
+   */
+  void use(const std::vector<std::string> &names);
+
+  /**
+   * @brief 选中的第一个数据库, read 等修改数据库的命令只作用在它上面.
+   *
+   */
+  auto current() -> std::shared_ptr<Database>;
+
+  /**
+   * @brief 所有选中的数据库, 按选中的顺序.
+   *
+   */
+  auto selected() -> std::vector<std::shared_ptr<Database>>;
+
+  /**
+   * @brief 所有打开的数据库的名字.
+   *
+   */
+  auto names() -> std::vector<std::string>;
+
+  bool is_open(std::string name);
+
+ private:
+  std::mutex mutex;
+  std::map<std::string, std::shared_ptr<Database>> databases;
+  std::vector<std::string> in_use;
+};
+
+Catalog catalog;
+
+#pragma region  // # Catalog Implementation
+
+auto Catalog::open(std::string name, bool new_file, Engine engine,
+                   size_t shards, bool compress) -> std::shared_ptr<Database> {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (databases.count(name) != 0) {
+    throw another_database_opening(name);
+  }
+  // 打开失败时抛出异常, 不会留在目录里.
+  auto db = std::make_shared<Database>();
+  db->db_open(name, new_file, engine, shards, compress);
+  databases[name] = db;
+  in_use = {name};
+  return db;
+}
+
+void Catalog::close(std::string name) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto iter = databases.find(name);
+  if (iter == databases.end()) {
+    throw database_closed(name);
+  }
+  iter->second->db_close();
+  databases.erase(iter);
+  in_use.erase(std::remove(in_use.begin(), in_use.end(), name), in_use.end());
+  if (in_use.empty() && !databases.empty()) {
+    in_use = {databases.begin()->first};
+  }
+}
+
+void Catalog::close_all() {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto &[name, db] : databases) {
+    db->db_close();
+  }
+  databases.clear();
+  in_use.clear();
+}
+
+void Catalog::use(const std::vector<std::string> &names) {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto &name : names) {
+    if (databases.count(name) == 0) {
+      throw database_closed(name);
+    }
+  }
+  in_use.clear();
+  for (auto &name : names) {
+    if (std::find(in_use.begin(), in_use.end(), name) == in_use.end()) {
+      in_use.push_back(name);
+    }
+  }
+}
+
+auto Catalog::current() -> std::shared_ptr<Database> {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (in_use.empty()) {
+    throw database_not_open();
+  }
+  return databases[in_use.front()];
+}
+
+auto Catalog::selected() -> std::vector<std::shared_ptr<Database>> {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (in_use.empty()) {
+    throw database_not_open();
+  }
+  std::vector<std::shared_ptr<Database>> ret;
+  for (auto &name : in_use) {
+    ret.push_back(databases[name]);
+  }
+  return ret;
+}
+
+auto Catalog::names() -> std::vector<std::string> {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::vector<std::string> ret;
+  for (auto &[name, db] : databases) {
+    ret.push_back(name);
+  }
+  return ret;
+}
+
+bool Catalog::is_open(std::string name) {
+  std::lock_guard<std::mutex> lock(mutex);
+  return databases.count(name) != 0;
+}
+
+#pragma endregion
+
+};  // namespace ndb
+
+#endif  // INC_CATALOG_HH_
@@ -17,6 +17,9 @@
 #include <fmt/ostream.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <functional>
+#include <future>
 #include <iostream>
 #include <map>
 #include <numeric>
@@ -25,6 +28,7 @@
 #include <vector>
 
 #include "bptree.hh"
+#include "catalog.hh"
 #include "database.hh"
 #include "read_xml.hh"
 #include "util.hh"
@@ -45,6 +49,12 @@ class CommandLine {
     UNKNOWN,
     SEARCH,
     TOPK,
+    COAUTHORS,
+    COLLAB,
+    DISTANCE,
+    LATEST,
+    USE,
+    CHECK,
     HELP,
   };
   enum class ExecuteState {
@@ -58,6 +68,12 @@ class CommandLine {
       {"whoami", Statement::WHOAMI}, {"close", Statement::CLOSE},
       {"create", Statement::CREATE}, {"search", Statement::SEARCH},
       {"top", Statement::TOPK},      {"help", Statement::HELP},
+      {"coauthors", Statement::COAUTHORS},
+      {"collab", Statement::COLLAB},
+      {"distance", Statement::DISTANCE},
+      {"latest", Statement::LATEST},
+      {"use", Statement::USE},
+      {"check", Statement::CHECK},
   };
   std::map<Statement, std::function<void(void)>> execute_map = {
       {Statement::CREATE, [&]() { execute_create(); }},
@@ -72,6 +88,12 @@ class CommandLine {
       {Statement::SEARCH, [&]() { execute_search(); }},
       {Statement::HELP, [&]() { execute_help(); }},
       {Statement::TOPK, [&]() { execute_topk(); }},
+      {Statement::COAUTHORS, [&]() { execute_coauthors(); }},
+      {Statement::COLLAB, [&]() { execute_collab(); }},
+      {Statement::DISTANCE, [&]() { execute_distance(); }},
+      {Statement::LATEST, [&]() { execute_latest(); }},
+      {Statement::USE, [&]() { execute_use(); }},
+      {Statement::CHECK, [&]() { execute_check(); }},
       {Statement::UNKNOWN, [&]() { execute_unknown(); }},
   };
 
@@ -101,6 +123,18 @@ class CommandLine {
 
   void execute_topk();
 
+  void execute_coauthors();
+
+  void execute_collab();
+
+  void execute_distance();
+
+  void execute_latest();
+
+  void execute_use();
+
+  void execute_check();
+
   void execute_close();
 
   void execute_exit();
@@ -111,6 +145,21 @@ class CommandLine {
 
   auto tokenizer(std::string input) -> std::vector<std::string>;
 
+  /**
+   * @brief 依次在每个选中的数据库上执行 f. 选中多个时先打印数据库名.
+   *
+   */
+  void for_each_selected(const std::function<void(Database &)> &f);
+
+  /**
+   * @brief 在所有选中的数据库上同时查找, 再按选中的顺序依次打印结果.
+   *
+   * @param lookup 在一个数据库上查找, 不打印.
+   */
+  void find_in_selected(
+      const std::function<std::vector<std::pair<Record, std::string>>(
+          Database &)> &lookup);
+
   ExecuteState now;
   std::string command;
   std::vector<std::string> args;
@@ -134,17 +183,36 @@ void CommandLine::execute() {
 
 void CommandLine::execute_create() {
   try {
-    if (ndb::db.is_open()) {
-      throw ndb::another_database_opening(ndb::db.name());
+    auto engine = ndb::Engine::BTREE;
+    size_t shards = 1;
+    bool compress = false;
+    for (size_t i = 1; i < args.size(); i++) {
+      if (args[i] == "--engine" && i + 1 < args.size()) {
+        auto &e = args[++i];
+        if (e != "btree" && e != "lsm") {
+          throw ndb::unknown_engine(e);
+        }
+        engine = e == "lsm" ? ndb::Engine::LSM : ndb::Engine::BTREE;
+      } else if (args[i] == "--shards" && i + 1 < args.size()) {
+        shards = ndb::parse_number(args[++i], 1, ndb::Checkpoint::MAX_SHARDS);
+      } else if (args[i] == "--compress") {
+        compress = true;
+      } else {
+        throw ndb::invalid_arguments_num(
+            1, args.size(),
+            "create [name] [--engine btree|lsm] [--shards N] [--compress]");
+      }
     }
-    if (args.size() != 1) {
-      throw ndb::invalid_arguments_num(1, args.size(), "create [name]");
+    if (args.empty()) {
+      throw ndb::invalid_arguments_num(
+          1, args.size(),
+          "create [name] [--engine btree|lsm] [--shards N] [--compress]");
     }
     auto name = args[0];
     if (access(fmt::format("database/{}", name).c_str(), 0) == 0) {
       throw ndb::database_exists(name);
     }
-    ndb::db.db_open(name, true);
+    ndb::catalog.open(name, true, engine, shards, compress);
     fmt::print(fg(fmt::terminal_color::bright_green), "Database {} is open.\n",
                name);
   } catch (ndb::another_database_opening &e) {
@@ -159,35 +227,96 @@ void CommandLine::execute_create() {
     fmt::print(fg(fmt::terminal_color::bright_red), "{}\n", e.msg());
     fmt::print("{}\n", e.how());
     return;
+  } catch (ndb::unknown_engine &e) {
+    fmt::print(fg(fmt::terminal_color::bright_red), "{}\n", e.msg());
+    fmt::print(fg(fmt::terminal_color::bright_cyan), "{}\n", e.how());
+    return;
+  } catch (ndb::invalid_number &e) {
+    fmt::print(fg(fmt::terminal_color::bright_red), "{}\n", e.msg());
+    fmt::print(fg(fmt::terminal_color::bright_cyan), "{}\n", e.how());
+    return;
+  } catch (ndb::file_opening_error &e) {
+    fmt::print(fg(fmt::terminal_color::bright_red), "{}\n", e.msg());
+    fmt::print("{}\n", e.how());
+    return;
+  } catch (ndb::file_io_error &e) {
+    fmt::print(fg(fmt::terminal_color::bright_red), "{}\n", e.msg());
+    fmt::print("{}\n", e.how());
+    return;
   }
 }
 
 void CommandLine::execute_read() {
   try {
-    if (!ndb::db.is_open()) {
-      throw ndb::database_not_open();
+    auto db = ndb::catalog.current();
+    ndb::ReadOptions opt;
+    for (size_t i = 0; i < args.size(); i++) {
+      if (args[i] == "-j" && i + 1 < args.size()) {
+        opt.jobs = ndb::parse_number(args[++i], 1, ndb::ReadOptions::MAX_JOBS);
+      } else if (args[i] == "--scanner" && i + 1 < args.size() &&
+                 (args[i + 1] == "libxml" || args[i + 1] == "simd")) {
+        opt.scanner = args[++i] == "simd" ? ndb::Scanner::SIMD
+                                          : ndb::Scanner::LIBXML;
+      } else if (args[i] == "--ingest-mem" && i + 1 < args.size()) {
+        opt.ingest_mem = uint64_t(ndb::parse_number(
+                             args[++i], 1, ndb::ReadOptions::MAX_INGEST_MEM_MIB))
+                         << 20;
+      } else if (args[i] == "--resume") {
+        opt.resume = true;
+      } else {
+        throw ndb::invalid_arguments_num(
+            0, args.size(),
+            "read [-j jobs] [--scanner libxml|simd] [--ingest-mem MiB] "
+            "[--resume]");
+      }
+    }
+    ndb::read_xmlfile(*db, opt);
+    db->topk_manager->make_topk(1024);  // todo:!!!
+    if (db->last_checkpoint().delta) {
+      auto &st = ndb::ingest_stats;
+      fmt::print("{} added, {} changed, {} unchanged, {} removed.\n", st.added,
+                 st.changed, st.unchanged, st.removed);
     }
-    ndb::read_xmlfile("xml/small.xml");
-    topk_manager.make_topk(1024);  // todo:!!!
     fmt::print("READ OK");
     fmt::print("\n");
   } catch (ndb::database_not_open &e) {
     fmt::print(fg(fmt::terminal_color::bright_red), "{}\n", e.what());
     fmt::print("Please open a database first.\n");
+  } catch (ndb::invalid_arguments_num &e) {
+    fmt::print(fg(fmt::terminal_color::bright_red), "{}\n", e.msg());
+    fmt::print(fg(fmt::terminal_color::bright_cyan), "{}\n", e.how());
+  } catch (ndb::file_opening_error &e) {
+    fmt::print(fg(fmt::terminal_color::bright_red), "{}\n", e.msg());
+    fmt::print("{}\n", e.how());
+  } catch (ndb::unfinished_read &e) {
+    fmt::print(fg(fmt::terminal_color::bright_red), "{}\n", e.msg());
+    fmt::print("{}\n", e.how());
+  } catch (ndb::cannot_resume &e) {
+    fmt::print(fg(fmt::terminal_color::bright_red), "{}\n", e.msg());
+    fmt::print("{}\n", e.how());
+  } catch (ndb::xml_parsing_error &e) {
+    fmt::print(fg(fmt::terminal_color::bright_red), "{}\n", e.msg());
+    fmt::print("{}\n", e.how());
+  } catch (ndb::invalid_number &e) {
+    fmt::print(fg(fmt::terminal_color::bright_red), "{}\n", e.msg());
+    fmt::print(fg(fmt::terminal_color::bright_cyan), "{}\n", e.how());
+  } catch (ndb::file_io_error &e) {
+    fmt::print(fg(fmt::terminal_color::bright_red), "{}\n", e.msg());
+    fmt::print("{}\n", e.how());
   }
 }
 
 void CommandLine::execute_open() {
   try {
-    if (ndb::db.is_open()) {
-      throw ndb::another_database_opening(ndb::db.name());
-    }
-    if (args.size() != 1) {
-      throw ndb::invalid_arguments_num(1, args.size(), "open [name]");
+    if (args.size() != 1 && (args.size() != 2 || args[1] != "--warm")) {
+      throw ndb::invalid_arguments_num(1, args.size(), "open [name] [--warm]");
       return;
     }
     auto name = args[0];
-    ndb::db.db_open(name, false);
+    auto db = ndb::catalog.open(name, false);
+    if (args.size() == 2) {
+      db->warm_up();
+    }
     fmt::print(fg(fmt::terminal_color::bright_green), "Database {} is open.\n",
                name);
   } catch (ndb::invalid_arguments_num &e) {
@@ -198,21 +327,27 @@ void CommandLine::execute_open() {
     fmt::print(fg(fmt::terminal_color::bright_red), "{}\n", e.msg());
     fmt::print("{}\n", e.how());
     return;
+  } catch (ndb::unsupported_format &e) {
+    fmt::print(fg(fmt::terminal_color::bright_red), "{}\n", e.msg());
+    fmt::print(fg(fmt::terminal_color::bright_cyan), "{}\n", e.how());
+    return;
+  } catch (ndb::file_opening_error &e) {
+    fmt::print(fg(fmt::terminal_color::bright_red), "{}\n", e.msg());
+    fmt::print("{}\n", e.how());
+    return;
   } catch (ndb::database_not_exist &e) {  // FIXME:
-    ndb::db.db_close();
     auto fn = e.file_name;
     fmt::print(fg(fmt::terminal_color::bright_cyan), "{}\n", e.what());
     fmt::print("Create it now? (y/n) ");
     std::string str;
     getline(std::cin, str);
     if (str == "y") {
-      ndb::db.db_open(args[0], true);
+      ndb::catalog.open(args[0], true);
       fmt::print(fg(fmt::terminal_color::bright_green),
                  "Database {} is open.\n", args[0]);
     }
     return;
   } catch (ndb::database_opening_error &e) {  // FIXME:
-    ndb::db.db_close();
     fmt::print(fg(fmt::terminal_color::bright_red), "File corrupted.\n");
     fmt::print("Remove it now? (y/n) ");
     std::string str;
@@ -233,9 +368,7 @@ void CommandLine::execute_open() {
 
 void CommandLine::execute_insert() {
   try {
-    if (!ndb::db.is_open()) {
-      throw ndb::database_not_open();
-    }
+    ndb::catalog.current();
     fmt::print(fg(fmt::terminal_color::bright_magenta),
                "`insert` is only allowed when testing.\n");
     fmt::print("Use `read` instead.\n");
@@ -247,10 +380,7 @@ void CommandLine::execute_insert() {
 
 void CommandLine::execute_insert_test() {
   try {
-    if (!ndb::db.is_open()) {
-      throw ndb::database_not_open();
-    }
-    ndb::db.insert({1, 0}, "key", DatabaseState::AUTHOR);
+    ndb::catalog.current()->insert({1, 0}, "key", DatabaseState::AUTHOR);
     fmt::print("INSERT OK");
     fmt::print("\n");
   } catch (ndb::database_not_open &e) {
@@ -261,10 +391,9 @@ void CommandLine::execute_insert_test() {
 
 void CommandLine::execute_select() {
   try {
-    if (!ndb::db.is_open()) {
-      throw ndb::database_not_open();
-    }
-    ndb::db.select(DatabaseState::AUTHOR);  // todo:!!!
+    for_each_selected([](Database &db) {
+      db.select(DatabaseState::AUTHOR);  // todo:!!!
+    });
     fmt::print("SELECT OK");
     fmt::print("\n");
   } catch (ndb::database_not_open &e) {
@@ -275,9 +404,7 @@ void CommandLine::execute_select() {
 
 void CommandLine::execute_find() {
   try {
-    if (!ndb::db.is_open()) {
-      throw ndb::database_not_open();
-    }
+    ndb::catalog.current();
     if (args.size() > 2) {
       throw ndb::invalid_arguments_num(2, args.size(), "find [what] [name]");
     }
@@ -293,7 +420,8 @@ void CommandLine::execute_find() {
       assert(0);
     }
     clk.tick();
-    ndb::db.find(args[1], s);
+    auto value = args[1];
+    find_in_selected([&value, s](Database &db) { return db.find(value, s); });
     clk.tock();
     fmt::print("FIND OK");
     fmt::print(" ({}ms)\n", clk.time_cost());
@@ -317,11 +445,13 @@ void CommandLine::execute_find() {
 
 void CommandLine::execute_search() {
   try {
-    if (!ndb::db.is_open()) {
-      throw ndb::database_not_open();
-    }
+    ndb::catalog.current();
     clk.tick();
-    ndb::db.search(args);
+    fmt::print("Search for ");
+    fmt::print(fg(fmt::terminal_color::bright_green), "{}",
+               fmt::join(args, " + "));
+    fmt::print(":\n");
+    find_in_selected([this](Database &db) { return db.search(args); });
     clk.tock();
     fmt::print("SEARCH OK");
     fmt::print(" ({}ms)\n", clk.time_cost());
@@ -337,12 +467,17 @@ void CommandLine::execute_search() {
 
 void CommandLine::execute_whoami() {
   try {
-    if (!ndb::db.is_open()) {
-      throw ndb::database_not_open();
+    auto dbs = ndb::catalog.selected();
+    std::vector<std::string> names;
+    for (auto &db : dbs) {
+      names.push_back(db->name());
     }
     fmt::print("Who am I? ");
     fmt::print(fg(fmt::terminal_color::bright_blue), "Database {}!\n",
-               ndb::db.name());
+               fmt::join(names, ", "));
+    for (auto &db : dbs) {
+      db->print_storage();
+    }
   } catch (ndb::database_not_open &e) {
     fmt::print(fg(fmt::terminal_color::bright_red), "{}\n", e.msg());
     return;
@@ -356,22 +491,259 @@ void CommandLine::execute_topk() {
       return;
     }
     auto k = stoi(args[0]);
-    ndb::db.topk(k);
+    for_each_selected([k](Database &db) { db.topk(k); });
   } catch (ndb::invalid_arguments_num &e) {
     fmt::print(fg(fmt::terminal_color::bright_red), "{}\n", e.msg());
     fmt::print(fg(fmt::terminal_color::bright_cyan), "{}\n", e.how());
     return;
+  } catch (ndb::database_not_open &e) {
+    fmt::print(fg(fmt::terminal_color::bright_red), "{}\n", e.msg());
+    return;
+  }
+}
+
+void CommandLine::execute_coauthors() {
+  try {
+    ndb::catalog.current();
+    if (args.size() != 1) {
+      throw ndb::invalid_arguments_num(1, args.size(),
+                                       "coauthors \"[author]\"");
+    }
+    clk.tick();
+    for_each_selected([this](Database &db) { db.coauthors(args[0], 0); });
+    clk.tock();
+    fmt::print("COAUTHORS OK");
+    fmt::print(" ({}ms)\n", clk.time_cost());
+  } catch (ndb::database_not_open &e) {
+    fmt::print(fg(fmt::terminal_color::bright_red), "{}\n", e.msg());
+    fmt::print("Please open a database first.\n");
+  } catch (ndb::invalid_arguments_num &e) {
+    fmt::print(fg(fmt::terminal_color::bright_red), "{}\n", e.msg());
+    fmt::print(fg(fmt::terminal_color::bright_cyan), "{}\n", e.how());
+  } catch (ndb::author_not_found &e) {
+    fmt::print(fg(fmt::terminal_color::bright_red), "{}\n", e.msg());
+    fmt::print("{}\n", e.how());
+  }
+}
+
+void CommandLine::execute_collab() {
+  try {
+    ndb::catalog.current();
+    if (args.size() != 2) {
+      throw ndb::invalid_arguments_num(2, args.size(),
+                                       "collab \"[author]\" [number]");
+    }
+    clk.tick();
+    auto k = ndb::parse_number(args[1], 1, INT32_MAX);
+    for_each_selected([this, k](Database &db) { db.coauthors(args[0], k); });
+    clk.tock();
+    fmt::print("COLLAB OK");
+    fmt::print(" ({}ms)\n", clk.time_cost());
+  } catch (ndb::database_not_open &e) {
+    fmt::print(fg(fmt::terminal_color::bright_red), "{}\n", e.msg());
+    fmt::print("Please open a database first.\n");
+  } catch (ndb::invalid_arguments_num &e) {
+    fmt::print(fg(fmt::terminal_color::bright_red), "{}\n", e.msg());
+    fmt::print(fg(fmt::terminal_color::bright_cyan), "{}\n", e.how());
+  } catch (ndb::invalid_number &e) {
+    fmt::print(fg(fmt::terminal_color::bright_red), "{}\n", e.msg());
+    fmt::print(fg(fmt::terminal_color::bright_cyan), "{}\n", e.how());
+  } catch (ndb::author_not_found &e) {
+    fmt::print(fg(fmt::terminal_color::bright_red), "{}\n", e.msg());
+    fmt::print("{}\n", e.how());
+  }
+}
+
+void CommandLine::execute_distance() {
+  try {
+    ndb::catalog.current();
+    if (args.size() != 2) {
+      throw ndb::invalid_arguments_num(2, args.size(),
+                                       "distance \"[author]\" \"[author]\"");
+    }
+    clk.tick();
+    for_each_selected(
+        [this](Database &db) { db.distance(args[0], args[1]); });
+    clk.tock();
+    fmt::print("DISTANCE OK");
+    fmt::print(" ({}ms)\n", clk.time_cost());
+  } catch (ndb::database_not_open &e) {
+    fmt::print(fg(fmt::terminal_color::bright_red), "{}\n", e.msg());
+    fmt::print("Please open a database first.\n");
+  } catch (ndb::invalid_arguments_num &e) {
+    fmt::print(fg(fmt::terminal_color::bright_red), "{}\n", e.msg());
+    fmt::print(fg(fmt::terminal_color::bright_cyan), "{}\n", e.how());
+  } catch (ndb::author_not_found &e) {
+    fmt::print(fg(fmt::terminal_color::bright_red), "{}\n", e.msg());
+    fmt::print("{}\n", e.how());
+  }
+}
+
+void CommandLine::execute_latest() {
+  try {
+    ndb::catalog.current();
+    if (args.size() != 1 && args.size() != 2) {
+      throw ndb::invalid_arguments_num(2, args.size(),
+                                       "latest \"[author]\" [number]");
+    }
+    size_t k =
+        args.size() == 2 ? ndb::parse_number(args[1], 1, INT32_MAX) : 10;
+    clk.tick();
+    for_each_selected([this, k](Database &db) { db.latest(args[0], k); });
+    clk.tock();
+    fmt::print("LATEST OK");
+    fmt::print(" ({}ms)\n", clk.time_cost());
+  } catch (ndb::database_not_open &e) {
+    fmt::print(fg(fmt::terminal_color::bright_red), "{}\n", e.msg());
+    fmt::print("Please open a database first.\n");
+  } catch (ndb::invalid_arguments_num &e) {
+    fmt::print(fg(fmt::terminal_color::bright_red), "{}\n", e.msg());
+    fmt::print(fg(fmt::terminal_color::bright_cyan), "{}\n", e.how());
+  } catch (ndb::invalid_number &e) {
+    fmt::print(fg(fmt::terminal_color::bright_red), "{}\n", e.msg());
+    fmt::print(fg(fmt::terminal_color::bright_cyan), "{}\n", e.how());
+  }
+}
+
+void CommandLine::execute_use() {
+  try {
+    if (args.empty()) {
+      throw ndb::invalid_arguments_num(1, args.size(), "use [name] [name...]");
+    }
+    ndb::catalog.use(args);
+    fmt::print(fg(fmt::terminal_color::bright_green), "Using {}.\n",
+               fmt::join(args, ", "));
+  } catch (ndb::invalid_arguments_num &e) {
+    fmt::print(fg(fmt::terminal_color::bright_red), "{}\n", e.msg());
+    fmt::print(fg(fmt::terminal_color::bright_cyan), "{}\n", e.how());
+  } catch (ndb::database_closed &e) {
+    fmt::print(fg(fmt::terminal_color::bright_red), "{}\n", e.msg());
+    fmt::print("{}\n", e.how());
+  }
+}
+
+void CommandLine::execute_check() {
+  try {
+    if (args.size() != 1 ||
+        (args[0] != "scanner" && args[0] != "keys" && args[0] != "journal" &&
+         args[0] != "hot" && args[0] != "engines")) {
+      throw ndb::invalid_arguments_num(
+          1, args.size(), "check scanner|keys|journal|hot|engines");
+    }
+    if (args[0] == "engines") {
+      constexpr int64_t ELEMENTS = 100000;
+      constexpr int64_t KEYS = 500;
+      clk.tick();
+      auto bad = ndb::check_engines(ELEMENTS, KEYS);
+      clk.tock();
+      if (bad > 0) {
+        fmt::print(fg(fmt::terminal_color::bright_red),
+                   "{} of {} keys scan differently in btree and lsm.\n", bad,
+                   KEYS);
+      } else {
+        fmt::print("{} keys, both engines agree.\n", KEYS);
+      }
+      fmt::print("CHECK OK");
+      fmt::print(" ({}ms)\n", clk.time_cost());
+      return;
+    }
+    if (args[0] == "hot") {
+      constexpr int64_t PAGES = 200;
+      clk.tick();
+      auto bad = ndb::check_hot_pages(PAGES);
+      clk.tock();
+      if (bad > 0) {
+        fmt::print(fg(fmt::terminal_color::bright_red),
+                   "{} pages of the hot list differ from the {} pages read.\n",
+                   bad, PAGES);
+      } else {
+        fmt::print("{} pages, hot list agrees.\n", PAGES);
+      }
+      fmt::print("CHECK OK");
+      fmt::print(" ({}ms)\n", clk.time_cost());
+      return;
+    }
+    if (args[0] == "journal") {
+      constexpr int64_t KEYS = 20000;
+      clk.tick();
+      auto bad = ndb::check_journal(KEYS);
+      clk.tock();
+      if (bad > 0) {
+        fmt::print(fg(fmt::terminal_color::bright_red),
+                   "{} of {} keys are read wrong while journaling.\n", bad,
+                   KEYS * 2);
+      } else {
+        fmt::print("{} keys, journaled reads agree.\n", KEYS * 2);
+      }
+      fmt::print("CHECK OK");
+      fmt::print(" ({}ms)\n", clk.time_cost());
+      return;
+    }
+    if (args[0] == "keys") {
+      constexpr size_t PAIRS = 2000000;
+      clk.tick();
+      auto bad = ndb::check_keys(PAIRS);
+      clk.tock();
+      if (bad > 0) {
+        fmt::print(fg(fmt::terminal_color::bright_red),
+                   "{} of {} key pairs compare differently from strcmp.\n",
+                   bad, PAIRS);
+      } else {
+        fmt::print("{} key pairs, comparisons agree.\n", PAIRS);
+      }
+      fmt::print("CHECK OK");
+      fmt::print(" ({}ms)\n", clk.time_cost());
+      return;
+    }
+    ndb::ReadOptions opt;
+    int64_t records = 0;
+    clk.tick();
+    auto diff = ndb::compare_scanners(opt.file_name.c_str(), opt.chunk_size,
+                                      &records);
+    clk.tock();
+    if (diff >= 0) {
+      fmt::print(fg(fmt::terminal_color::bright_red),
+                 "Scanners differ at the record after byte {}.\n", diff);
+    } else {
+      fmt::print("{} records, scanners agree.\n", records);
+    }
+    fmt::print("CHECK OK");
+    fmt::print(" ({}ms)\n", clk.time_cost());
+  } catch (ndb::invalid_arguments_num &e) {
+    fmt::print(fg(fmt::terminal_color::bright_red), "{}\n", e.msg());
+    fmt::print(fg(fmt::terminal_color::bright_cyan), "{}\n", e.how());
+  } catch (ndb::file_opening_error &e) {
+    fmt::print(fg(fmt::terminal_color::bright_red), "{}\n", e.msg());
+    fmt::print("{}\n", e.how());
+  } catch (ndb::xml_parsing_error &e) {
+    fmt::print(fg(fmt::terminal_color::bright_red), "{}\n", e.msg());
+    fmt::print("{}\n", e.how());
   }
 }
 
 void CommandLine::execute_close() {
-  ndb::db.db_close();
-  fmt::print(fg(fmt::terminal_color::bright_magenta),
-             "Database {} is closed.\n", db.name());
+  try {
+    // 不指定名字时关闭所有选中的数据库.
+    auto names = args;
+    if (names.empty()) {
+      for (auto &db : ndb::catalog.selected()) {
+        names.push_back(db->name());
+      }
+    }
+    for (auto &name : names) {
+      ndb::catalog.close(name);
+      fmt::print(fg(fmt::terminal_color::bright_magenta),
+                 "Database {} is closed.\n", name);
+    }
+  } catch (ndb::database_not_open &e) {
+    fmt::print(fg(fmt::terminal_color::bright_red), "{}\n", e.msg());
+  } catch (ndb::database_closed &e) {
+    fmt::print(fg(fmt::terminal_color::bright_red), "{}\n", e.msg());
+  }
 }
 
 void CommandLine::execute_exit() {
-  ndb::db.db_close();
+  ndb::catalog.close_all();
   fmt::print("So long...\n");
   exit(EXIT_SUCCESS);
 }
@@ -383,11 +755,16 @@ void CommandLine::execute_unknown() {
 
 void CommandLine::execute_help() {
   fmt::print("create a database: ");
-  fmt::print(fg(fmt::terminal_color::bright_green), "create [database_name]\n");
+  fmt::print(fg(fmt::terminal_color::bright_green),
+             "create [database_name] [--engine btree|lsm] [--shards N] "
+             "[--compress]\n");
   fmt::print("open a database: ");
-  fmt::print(fg(fmt::terminal_color::bright_green), "open [database_name]\n");
+  fmt::print(fg(fmt::terminal_color::bright_green),
+             "open [database_name] [--warm]\n");
   fmt::print("read from xml file: ");
-  fmt::print(fg(fmt::terminal_color::bright_green), "read\n");
+  fmt::print(fg(fmt::terminal_color::bright_green),
+             "read [-j jobs] [--scanner libxml|simd] [--ingest-mem MiB] "
+             "[--resume]\n");
   fmt::print("select from table: ");
   fmt::print(fg(fmt::terminal_color::bright_green), "select [title|author]\n");
   fmt::print("find (prefix) in table: ");
@@ -397,14 +774,68 @@ void CommandLine::execute_help() {
   fmt::print(fg(fmt::terminal_color::bright_green), "search [keyword]\n");
   fmt::print("get authors with top article counts: ");
   fmt::print(fg(fmt::terminal_color::bright_green), "top [number]\n");
-  fmt::print("get the name of current opening database: ");
+  fmt::print("list the co-authors of an author: ");
+  fmt::print(fg(fmt::terminal_color::bright_green), "coauthors \"[author]\"\n");
+  fmt::print("get the top collaborators of an author: ");
+  fmt::print(fg(fmt::terminal_color::bright_green),
+             "collab \"[author]\" [number]\n");
+  fmt::print("list the latest papers of an author: ");
+  fmt::print(fg(fmt::terminal_color::bright_green),
+             "latest \"[author]\" [number]\n");
+  fmt::print("get the collaboration distance of two authors: ");
+  fmt::print(fg(fmt::terminal_color::bright_green),
+             "distance \"[author]\" \"[author]\"\n");
+  fmt::print("query several open databases at once: ");
+  fmt::print(fg(fmt::terminal_color::bright_green), "use [name] [name...]\n");
+  fmt::print("check that both xml scanners agree: ");
+  fmt::print(fg(fmt::terminal_color::bright_green), "check scanner\n");
+  fmt::print("check that key comparison matches strcmp: ");
+  fmt::print(fg(fmt::terminal_color::bright_green), "check keys\n");
+  fmt::print("check reads of a tree while its journal is open: ");
+  fmt::print(fg(fmt::terminal_color::bright_green), "check journal\n");
+  fmt::print("check that the hot page list holds the pages read: ");
+  fmt::print(fg(fmt::terminal_color::bright_green), "check hot\n");
+  fmt::print("check that btree and lsm scan duplicate keys alike: ");
+  fmt::print(fg(fmt::terminal_color::bright_green), "check engines\n");
+  fmt::print("get the names of the databases in use: ");
   fmt::print(fg(fmt::terminal_color::bright_green), "whoami\n");
   fmt::print("close a database: ");
-  fmt::print(fg(fmt::terminal_color::bright_green), "close\n");
+  fmt::print(fg(fmt::terminal_color::bright_green), "close [name]\n");
   fmt::print("end the program: ");
   fmt::print(fg(fmt::terminal_color::bright_green), "exit\n");
 }
 
+void CommandLine::for_each_selected(const std::function<void(Database &)> &f) {
+  auto dbs = ndb::catalog.selected();
+  for (auto &db : dbs) {
+    if (dbs.size() > 1) {
+      fmt::print(fg(fmt::terminal_color::bright_cyan), "Database {}:\n",
+                 db->name());
+    }
+    f(*db);
+  }
+}
+
+void CommandLine::find_in_selected(
+    const std::function<std::vector<std::pair<Record, std::string>>(
+        Database &)> &lookup) {
+  auto dbs = ndb::catalog.selected();
+  // 每个数据库有自己的文件和管理器, 查找可以同时进行. 打印要按顺序.
+  std::vector<std::future<std::vector<std::pair<Record, std::string>>>> parts;
+  for (auto &db : dbs) {
+    parts.push_back(std::async(std::launch::async,
+                               [&lookup, db] { return lookup(*db); }));
+  }
+  for (size_t i = 0; i < dbs.size(); i++) {
+    auto results = parts[i].get();
+    if (dbs.size() > 1) {
+      fmt::print(fg(fmt::terminal_color::bright_cyan), "Database {}:\n",
+                 dbs[i]->name());
+    }
+    dbs[i]->select_in(results);
+  }
+}
+
 auto CommandLine::tokenizer(std::string input) -> std::vector<std::string> {
   enum class State {
     STRING_ARG,
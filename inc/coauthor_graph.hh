@@ -0,0 +1,386 @@
+/**
+ * @file coauthor_graph.hh
+ * @author Selene
+ * @brief 合作者图, 以 CSR (压缩稀疏行) 格式保存, 可以直接 mmap 使用.
+ * @version 0.2
+ * @date 2021-04-21
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef INC_COAUTHOR_GRAPH_HH_
+#define INC_COAUTHOR_GRAPH_HH_
+
+#include <fmt/core.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "author_dict.hh"
+#include "doc_table.hh"
+#include "external_sort.hh"
+#include "util.hh"
+
+namespace ndb {
+
+/**
+ * @brief 图中的一条边, 权重是两位作者合作的文章数.
+ *
+ */
+struct CoauthorEdge {
+  author_id dst = 0;
+  uint32_t weight = 0;
+};
+
+/**
+ * @brief 合作者图. 文件开头是 Header, 然后是 nodes + 1 个 uint64_t 的
+ * 偏移量, 最后是按起点排好的边. 作者 a 的边是 [offsets[a], offsets[a + 1]).
+ * read 期间每加入或删除一篇文档, 就把它的作者两两之间的边的变化记下来,
+ * read 结束时把排好序的变化和上一次的图归并一遍, 得到新的图.
+ * 上一次的图对不上时 (比如续读), 再用文档表重建整个图.
+ *
+ */
+class CoauthorGraph {
+ public:
+  struct Header {
+    uint64_t nodes = 0;
+    uint64_t edges = 0;
+    int64_t generation = -1;  // 生成这个图时数据库是第几次 read
+  };
+
+  /**
+   * @brief 初始化, 打开已有的图.
+   *
+   * @param gname 数据库名.
+   */
+  void init_graph(std::string gname);
+
+  /**
+   * @brief 用文档表重新生成图.
+   *
+   * @param docs 同一个数据库的文档表.
+   * @param dict 同一个数据库的作者字典.
+   * @param generation 数据库当前是第几次 read.
+   * @param memory_budget 排序时使用的内存.
+   */
+  void build(DocTable &docs, AuthorDict &dict, int64_t generation,
+             uint64_t memory_budget);
+
+  /**
+   * @brief 开始记录边的变化.
+   *
+   * @param base 作为基础的图是第几次 read 之后生成的, -1 表示从空图开始.
+   * @param memory_budget 排序变化时使用的内存.
+   */
+  void begin_update(int64_t base, uint64_t memory_budget);
+
+  /**
+   * @brief 放弃记录的变化, 下一次 finish_update 时重建整个图.
+   *
+   */
+  void cancel_update() { delta = nullptr; }
+
+  /**
+   * @brief 记下一篇文档带来的边. 没有在记录变化时什么也不做.
+   *
+   * @param authors 文档的作者.
+   * @param sign 1 表示加入这篇文档, -1 表示删除.
+   */
+  void add_paper(std::vector<author_id> authors, int32_t sign);
+
+  /**
+   * @brief 把记录的变化合并进基础的图. 基础的图不存在或者没有在记录变化时
+   * 用 build 重建.
+   *
+   * @param docs 同一个数据库的文档表.
+   * @param dict 同一个数据库的作者字典.
+   * @param generation 数据库当前是第几次 read.
+   * @param memory_budget 重建时排序使用的内存.
+   */
+  void finish_update(DocTable &docs, AuthorDict &dict, int64_t generation,
+                     uint64_t memory_budget);
+
+  /**
+   * @brief 图是否存在并且是第 generation 次 read 之后生成的.
+   *
+   */
+  bool ready(int64_t generation) const {
+    return file != nullptr && header.generation == generation;
+  }
+
+  /**
+   * @brief 作者 a 的所有合作者, 按作者 ID 排列.
+   *
+   */
+  auto neighbors(author_id a) const
+      -> std::pair<const CoauthorEdge *, const CoauthorEdge *>;
+
+  /**
+   * @brief 与作者 a 合作最多的 k 位作者.
+   *
+   */
+  auto top_collaborators(author_id a, size_t k) const
+      -> std::vector<CoauthorEdge>;
+
+  /**
+   * @brief 两位作者之间的合作距离, 即最短路径的边数.
+   *
+   * @return int64_t 距离, 不连通时返回 -1.
+   */
+  auto distance(author_id a, author_id b) const -> int64_t;
+
+ private:
+  // 一条边的权重变化.
+  struct Delta {
+    author_id src;
+    author_id dst;
+    int32_t sign;
+  };
+  struct DeltaOrder {
+    bool operator()(const Delta &a, const Delta &b) const {
+      return a.src < b.src || (a.src == b.src && a.dst < b.dst);
+    }
+  };
+
+  /**
+   * @brief 按 (起点, 终点) 的顺序归并基础的图和排好序的变化, 写出新的图
+   * 并替换原来的文件.
+   *
+   */
+  void merge(uint64_t nodes, int64_t generation);
+
+  auto offsets() const -> const uint64_t * {
+    return reinterpret_cast<const uint64_t *>(file->data() + sizeof(Header));
+  }
+  auto edges() const -> const CoauthorEdge * {
+    return reinterpret_cast<const CoauthorEdge *>(offsets() + header.nodes +
+                                                  1);
+  }
+
+  std::string name;
+  std::unique_ptr<MappedFile> file;
+  Header header;
+  std::unique_ptr<ExternalSorter<Delta, DeltaOrder>> delta;
+  int64_t base = -1;
+};
+
+#pragma region  // # CoauthorGraph Implementation
+
+void CoauthorGraph::init_graph(std::string gname) {
+  name = gname;
+  file = nullptr;
+  header = Header();
+  auto fn = fmt::format("database/{0}/{0}_coauthor.bin", name);
+  if (access(fn.c_str(), 0) != 0) {
+    return;
+  }
+  file = std::make_unique<MappedFile>(fn);
+  if (file->size() < sizeof(Header)) {
+    file = nullptr;
+    return;
+  }
+  memcpy(&header, file->data(), sizeof(Header));
+}
+
+void CoauthorGraph::build(DocTable &docs, AuthorDict &dict,
+                          int64_t generation, uint64_t memory_budget) {
+  begin_update(-1, memory_budget);
+  DocRecord d;
+  for (int64_t i = 0; i < docs.size(); i++) {
+    if (docs.recover(i, &d) && !d.removed) {
+      add_paper(docs.authors(d), 1);
+    }
+  }
+  merge(dict.size(), generation);
+}
+
+void CoauthorGraph::begin_update(int64_t base, uint64_t memory_budget) {
+  this->base = base;
+  delta = std::make_unique<ExternalSorter<Delta, DeltaOrder>>(
+      fmt::format("database/{0}/{0}_coauthor", name), memory_budget);
+}
+
+void CoauthorGraph::add_paper(std::vector<author_id> authors, int32_t sign) {
+  if (delta == nullptr) {
+    return;
+  }
+  std::sort(authors.begin(), authors.end());
+  authors.erase(std::unique(authors.begin(), authors.end()), authors.end());
+  for (size_t x = 0; x < authors.size(); x++) {
+    for (size_t y = x + 1; y < authors.size(); y++) {
+      delta->push({authors[x], authors[y], sign});
+      delta->push({authors[y], authors[x], sign});
+    }
+  }
+}
+
+void CoauthorGraph::finish_update(DocTable &docs, AuthorDict &dict,
+                                  int64_t generation, uint64_t memory_budget) {
+  if (delta == nullptr || (base >= 0 && !ready(base))) {
+    build(docs, dict, generation, memory_budget);
+  } else {
+    merge(dict.size(), generation);
+  }
+}
+
+void CoauthorGraph::merge(uint64_t nodes, int64_t generation) {
+  auto fn = fmt::format("database/{0}/{0}_coauthor.bin", name);
+  auto tmp = fn + ".tmp";
+  auto out = fopen(tmp.c_str(), "wb");
+  if (out == nullptr) {
+    throw file_opening_error(tmp);
+  }
+  Header h;
+  h.nodes = nodes;
+  h.generation = generation;
+  std::vector<uint64_t> offs(h.nodes + 1, 0);
+  auto ok = fwrite(&h, sizeof(h), 1, out) == 1 &&
+            fwrite(offs.data(), sizeof(uint64_t), offs.size(), out) ==
+                offs.size();
+  auto emit = [&](uint64_t src, author_id dst, int64_t weight) {
+    if (weight > 0) {
+      CoauthorEdge e{dst, static_cast<uint32_t>(weight)};
+      ok = fwrite(&e, sizeof(e), 1, out) == 1 && ok;
+      offs[src + 1]++;
+      h.edges++;
+    }
+  };
+
+  // 基础的图中的边, 按 (bsrc, edges()[bi].dst) 的顺序前进.
+  auto use_base = base >= 0 && file != nullptr;
+  auto base_nodes = use_base ? header.nodes : 0;
+  auto base_edges = use_base ? header.edges : 0;
+  uint64_t bsrc = 0;
+  uint64_t bi = 0;
+  auto skip = [&] {
+    while (bsrc < base_nodes && bi >= offsets()[bsrc + 1]) {
+      bsrc++;
+    }
+  };
+  // 把基础的图中排在 (src, dst) 之前的边原样写出.
+  auto copy_until = [&](uint64_t src, author_id dst) {
+    for (skip(); bi < base_edges; skip()) {
+      auto &e = edges()[bi];
+      if (bsrc > src || (bsrc == src && e.dst >= dst)) {
+        break;
+      }
+      emit(bsrc, e.dst, e.weight);
+      bi++;
+    }
+  };
+  // 相同的 (src, dst) 排在一起, 加起来就是权重的变化.
+  Delta last{0, 0, 0};
+  int64_t sum = 0;
+  auto flush = [&] {
+    if (last.sign == 0) {
+      return;
+    }
+    copy_until(last.src, last.dst);
+    auto weight = sum;
+    if (bi < base_edges && bsrc == last.src && edges()[bi].dst == last.dst) {
+      weight += edges()[bi].weight;
+      bi++;
+    }
+    emit(last.src, last.dst, weight);
+  };
+  delta->finish([&](const Delta &d) {
+    if (last.sign != 0 && d.src == last.src && d.dst == last.dst) {
+      sum += d.sign;
+      return;
+    }
+    flush();
+    last = d;
+    sum = d.sign;
+  });
+  flush();
+  copy_until(h.nodes, 0);
+  delta = nullptr;
+
+  for (size_t i = 1; i < offs.size(); i++) {
+    offs[i] += offs[i - 1];
+  }
+  ok = fseeko(out, 0, SEEK_SET) == 0 && fwrite(&h, sizeof(h), 1, out) == 1 &&
+       fwrite(offs.data(), sizeof(uint64_t), offs.size(), out) ==
+           offs.size() &&
+       ok;
+  if (fclose(out) != 0 || !ok) {
+    remove(tmp.c_str());
+    throw file_io_error(tmp);
+  }
+  file = nullptr;
+  auto renamed = rename(tmp.c_str(), fn.c_str()) == 0;
+  init_graph(name);
+  if (!renamed) {
+    throw file_io_error(fn);
+  }
+}
+
+auto CoauthorGraph::neighbors(author_id a) const
+    -> std::pair<const CoauthorEdge *, const CoauthorEdge *> {
+  if (file == nullptr || a >= header.nodes) {
+    return {nullptr, nullptr};
+  }
+  return {edges() + offsets()[a], edges() + offsets()[a + 1]};
+}
+
+auto CoauthorGraph::top_collaborators(author_id a, size_t k) const
+    -> std::vector<CoauthorEdge> {
+  auto [first, last] = neighbors(a);
+  std::vector<CoauthorEdge> ret(first, last);
+  auto heavier = [](const CoauthorEdge &x, const CoauthorEdge &y) {
+    return x.weight > y.weight || (x.weight == y.weight && x.dst < y.dst);
+  };
+  k = std::min(k, ret.size());
+  std::partial_sort(ret.begin(), ret.begin() + k, ret.end(), heavier);
+  ret.resize(k);
+  return ret;
+}
+
+auto CoauthorGraph::distance(author_id a, author_id b) const -> int64_t {
+  if (a == b) {
+    return 0;
+  }
+  // 双向 BFS, 每次扩展较小的一侧.
+  std::unordered_map<author_id, int64_t> seen[2];
+  std::vector<author_id> frontier[2] = {{a}, {b}};
+  seen[0][a] = 0;
+  seen[1][b] = 0;
+  while (!frontier[0].empty() && !frontier[1].empty()) {
+    auto side = frontier[0].size() <= frontier[1].size() ? 0 : 1;
+    std::vector<author_id> next;
+    int64_t best = -1;
+    for (auto u : frontier[side]) {
+      auto [first, last] = neighbors(u);
+      for (auto e = first; e != last; e++) {
+        if (seen[side].count(e->dst) > 0) {
+          continue;
+        }
+        seen[side][e->dst] = seen[side][u] + 1;
+        auto other = seen[1 - side].find(e->dst);
+        if (other != seen[1 - side].end()) {
+          auto d = seen[side][e->dst] + other->second;
+          best = best < 0 ? d : std::min(best, d);
+        }
+        next.push_back(e->dst);
+      }
+    }
+    if (best >= 0) {
+      return best;
+    }
+    frontier[side] = std::move(next);
+  }
+  return -1;
+}
+
+#pragma endregion
+
+};  // namespace ndb
+
+#endif  // INC_COAUTHOR_GRAPH_HH_
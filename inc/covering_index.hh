@@ -0,0 +1,265 @@
+/**
+ * @file covering_index.hh
+ * @author Selene
+ * @brief 复合键加包含列的覆盖索引, 常用的查询只读索引就能回答.
+ * @version 0.2
+ * @date 2021-04-27
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef INC_COVERING_INDEX_HH_
+#define INC_COVERING_INDEX_HH_
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "bptree.hh"
+#include "key_codec.hh"
+#include "util.hh"
+
+namespace ndb {
+
+/**
+ * @brief 覆盖索引中的一个元素.
+ * key 是 KeyEncoder 编码的复合键, 补 0 到 N 个字节. 截断会把后面的列
+ * 切掉, 顺序就错了, 所以超过 N 个字节的键抛出 key_too_long.
+ * id 是元素在表中的 ID, 作为最后一列让键唯一, 删除时也用它.
+ * payload 是包含列, 不参与比较, 查询时直接从叶子中读出.
+ *
+ * @tparam N 编码后的键最多的字节数.
+ * @tparam Payload 包含列.
+ */
+template <size_t N, class Payload>
+struct CoveringKey {
+  CoveringKey() {}
+  CoveringKey(std::string_view bytes, int64_t id, const Payload &payload)
+      : id(id), payload(payload) {
+    if (bytes.size() > N) {
+      throw key_too_long(bytes.size(), N);
+    }
+    memcpy(key, bytes.data(), bytes.size());
+  }
+
+  auto compare(const CoveringKey &t) const -> int {
+    auto c = key_compare({key, N}, {t.key, N});
+    if (c != 0) {
+      return c;
+    }
+    return id == t.id ? 0 : (id < t.id ? -1 : 1);
+  }
+  bool operator<(const CoveringKey &t) const { return compare(t) < 0; }
+  bool operator<=(const CoveringKey &t) const { return compare(t) <= 0; }
+  bool operator==(const CoveringKey &t) const { return compare(t) == 0; }
+
+  char key[N] = {};
+  int64_t id = -1;
+  Payload payload{};
+};
+
+/**
+ * @brief 覆盖索引. 用写时复制的 B+ 树保存 CoveringKey, 查询期间可以写入.
+ * B+ 树不能删除, 所以删除的 ID 范围另外追加到一个文件里, 扫描时跳过.
+ * 内存中的删除范围排好序并合并相邻的, 扫描时二分查找; 打开时把文件
+ * 压缩成合并后的范围. 两个文件都通过 Pager 读写, 会记录回滚日志.
+ *
+ */
+template <size_t N, class Payload>
+class CoveringIndex {
+ public:
+  using entry = CoveringKey<N, Payload>;
+  using visitor = std::function<bool(const entry &)>;
+
+  /**
+   * @brief 打开或新建覆盖索引. 旧的数据库中没有这个索引时新建一个空的.
+   *
+   * @param file_prefix 文件名前缀, 索引为 file_prefix.bin,
+   * 删除的范围为 file_prefix_dead.bin.
+   * @param new_file 是否新建文件.
+   */
+  void init_index(std::string file_prefix, bool new_file);
+
+  /**
+   * @brief 插入一个元素. 在 commit 之前查询看不到.
+   *
+   */
+  void insert(const entry &e);
+
+  /**
+   * @brief 删除 ID 在 [first, last) 中的元素.
+   *
+   */
+  void erase(int64_t first, int64_t last);
+
+  /**
+   * @brief 按顺序访问编码后的键以 prefix 开头的元素, 跳过已删除的.
+   * 扫描开始时的删除范围在扫描期间不变, 不会被 erase 影响.
+   *
+   * @param prefix KeyEncoder 编码的前几列.
+   * @param visit 返回 false 时停止.
+   */
+  void scan(std::string_view prefix, const visitor &visit);
+
+  void begin_write() { bt->begin_write(); }
+  void commit() { bt->commit(); }
+
+  /**
+   * @brief 覆盖索引用到的所有 Pager.
+   *
+   */
+  auto pagers() -> std::vector<std::shared_ptr<Pager>> {
+    return {tree_manager, dead_manager};
+  }
+
+ private:
+  struct DeadRange {
+    int64_t first = 0;
+    int64_t last = 0;
+  };
+  using DeadList = std::vector<DeadRange>;
+
+  /**
+   * @brief 把 r 合并进按 first 排好序, 两两不相交也不相邻的 list.
+   *
+   */
+  static auto merge(const DeadList &list, DeadRange r) -> DeadList;
+
+  /**
+   * @brief id 是否在某个删除范围中.
+   *
+   */
+  static bool contains(const DeadList &list, int64_t id);
+
+  std::shared_ptr<ndb::Pager> tree_manager;
+  std::shared_ptr<ndb::Pager> dead_manager;
+  std::shared_ptr<ndb::BplusTree<entry, 64>> bt;
+  // 只整个替换, 不原地修改, 扫描时取一份引用就够了.
+  std::shared_ptr<const DeadList> dead = std::make_shared<DeadList>();
+  int64_t dead_count = 0;  // 文件中的范围数
+  std::mutex mutex;
+};
+
+#pragma region  // # CoveringIndex Implementation
+
+template <size_t N, class Payload>
+void CoveringIndex<N, Payload>::init_index(std::string file_prefix,
+                                           bool new_file) {
+  auto tree = file_prefix + ".bin";
+  auto dead_file = file_prefix + "_dead.bin";
+  new_file = new_file || !std::filesystem::exists(tree);
+  tree_manager = std::make_shared<ndb::Pager>(tree, new_file);
+  bt = std::make_shared<ndb::BplusTree<entry, 64>>(tree_manager, true);
+  DeadList list;
+  if (!new_file) {
+    Pager old(dead_file, false);
+    DeadRange r;
+    auto n = old.get_id(&r);
+    for (int64_t i = 0; i < n; i++) {
+      old.recover(i, &r);
+      list = merge(list, r);
+    }
+    if (static_cast<int64_t>(list.size()) < n) {
+      // 先写到临时文件再改名, 中途崩溃时原来的文件还在.
+      auto tmp = dead_file + ".tmp";
+      auto file = fopen(tmp.c_str(), "wb");
+      if (file == nullptr ||
+          fwrite(list.data(), sizeof(DeadRange), list.size(), file) !=
+              list.size() ||
+          fflush(file) != 0 || fsync(fileno(file)) != 0) {
+        if (file != nullptr) {
+          fclose(file);
+        }
+        throw file_io_error(tmp);
+      }
+      fclose(file);
+      std::filesystem::rename(tmp, dead_file);
+    }
+  }
+  dead_manager = std::make_shared<ndb::Pager>(dead_file, new_file);
+  dead_count = static_cast<int64_t>(list.size());
+  dead = std::make_shared<DeadList>(std::move(list));
+}
+
+template <size_t N, class Payload>
+void CoveringIndex<N, Payload>::insert(const entry &e) {
+  bt->insert(e);
+}
+
+template <size_t N, class Payload>
+void CoveringIndex<N, Payload>::erase(int64_t first, int64_t last) {
+  if (first >= last) {
+    return;
+  }
+  DeadRange r{first, last};
+  std::lock_guard<std::mutex> lock(mutex);
+  dead_manager->save(dead_count++, &r);
+  dead = std::make_shared<DeadList>(merge(*dead, r));
+}
+
+template <size_t N, class Payload>
+void CoveringIndex<N, Payload>::scan(std::string_view prefix,
+                                     const visitor &visit) {
+  std::shared_ptr<const DeadList> removed;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    removed = dead;
+  }
+  entry probe(prefix, -1, Payload());
+  for (auto iter = bt->find_geq(probe);
+       iter->id >= 0 && memcmp(iter->key, prefix.data(), prefix.size()) == 0;
+       iter++) {
+    if (!contains(*removed, iter->id) && !visit(*iter)) {
+      return;
+    }
+  }
+}
+
+template <size_t N, class Payload>
+auto CoveringIndex<N, Payload>::merge(const DeadList &list, DeadRange r)
+    -> DeadList {
+  if (r.first >= r.last) {
+    return list;
+  }
+  DeadList ret;
+  ret.reserve(list.size() + 1);
+  // 在 r 之前且不相邻的原样保留, 与 r 相交或相邻的并进 r.
+  auto it = list.begin();
+  for (; it != list.end() && it->last < r.first; it++) {
+    ret.push_back(*it);
+  }
+  for (; it != list.end() && it->first <= r.last; it++) {
+    r.first = std::min(r.first, it->first);
+    r.last = std::max(r.last, it->last);
+  }
+  ret.push_back(r);
+  ret.insert(ret.end(), it, list.end());
+  return ret;
+}
+
+template <size_t N, class Payload>
+bool CoveringIndex<N, Payload>::contains(const DeadList &list, int64_t id) {
+  // 第一个 first 大于 id 的范围的前一个.
+  auto it = std::upper_bound(
+      list.begin(), list.end(), id,
+      [](int64_t v, const DeadRange &r) { return v < r.first; });
+  return it != list.begin() && id < std::prev(it)->last;
+}
+
+#pragma endregion
+
+};  // namespace ndb
+
+#endif  // INC_COVERING_INDEX_HH_
@@ -20,17 +20,40 @@
 #include <libxml/tree.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <future>
 #include <iostream>
 #include <map>
 #include <memory>
 #include <numeric>
+#include <random>
+#include <set>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
 #include <utility>
 #include <vector>
 
+#include "author_dict.hh"
 #include "bptree.hh"
+#include "coauthor_graph.hh"
+#include "covering_index.hh"
+#include "doc_table.hh"
 #include "inverted_index.hh"
+#include "key_codec.hh"
+#include "lsm.hh"
+#include "record_file.hh"
+#include "shard.hh"
+#include "snapshot.hh"
+#include "storage_engine.hh"
 #include "topk.hh"
 #include "util.hh"
 
@@ -49,24 +72,290 @@ struct Key {
   Key() {}
   explicit Key(int64_t id) : id(id) {}
 
-  bool operator<(const Key &t) const { return strcmp(key, t.key) < 0; }
-  bool operator<=(const Key &t) const { return strcmp(key, t.key) <= 0; }
-  bool operator==(const Key &t) const { return strcmp(key, t.key) == 0; }
+  // 整个数组按 memcmp 比较, 先比较前 8 个字节. key 必须是规范后的文本.
+  bool operator<(const Key &t) const { return compare(t) < 0; }
+  bool operator<=(const Key &t) const { return compare(t) <= 0; }
+  bool operator==(const Key &t) const { return compare(t) == 0; }
   std::ostream &operator<<(std::ostream &out) {
     out << key;
     return out;
   }
 
-  char key[64];
+  /**
+   * @brief 把标题或作者名规范成键的内容, 写入和查询之前都要调用.
+   * title 和 author 索引区分大小写.
+   *
+   */
+  static auto normalize(std::string_view text) -> std::string {
+    return normalize_key(text, sizeof(key) - 1, FOLD_CASE);
+  }
+
+  static constexpr bool FOLD_CASE = false;
+
+  // '\0' 之后全是 0, 所以 memcmp 的结果与 strcmp 相同.
+  char key[64] = {};
   int64_t id = -1;
+
+ private:
+  auto compare(const Key &t) const -> int {
+    return key_compare({key, sizeof(key)}, {t.key, sizeof(t.key)});
+  }
+};
+
+/**
+ * @brief 检查 Key 的比较: 随机生成 n 对文本 (含首尾空白, 大小写和 '\0'
+ * 之后的杂质), 规范后写进 Key, 比较的结果要与规范后的文本用 strcmp
+ * 比较的结果相同.
+ * @param n 检查的对数.
+ * @return 结果不同的对数.
+ */
+inline auto check_keys(size_t n, uint64_t seed = 24601) -> size_t {
+  std::mt19937_64 rng(seed);
+  const std::string alphabet = " \tAaBbZz09-.\xc3\xa9\xff";
+  auto text = [&] {
+    // 长度会超过 63, 也会有 '\0' 和它之后的字节, 前缀常常相同.
+    std::string ret(rng() % 80, 'a');
+    for (auto &c : ret) {
+      auto r = rng() % 64;
+      c = r == 0 ? '\0' : alphabet[r % alphabet.size()];
+    }
+    return ret;
+  };
+  auto sign = [](int c) { return (c > 0) - (c < 0); };
+  size_t bad = 0;
+  for (size_t i = 0; i < n; i++) {
+    auto a = text();
+    auto b = rng() % 4 == 0 ? a.substr(0, rng() % (a.size() + 1)) + text()
+                            : text();
+    auto na = Key::normalize(a);
+    auto nb = Key::normalize(b);
+    Key x, y;
+    memcpy(x.key, na.data(), na.size());
+    memcpy(y.key, nb.data(), nb.size());
+    auto expected = sign(strcmp(na.c_str(), nb.c_str()));
+    auto got = x < y ? -1 : (x == y ? 0 : 1);
+    if (got != expected || (x <= y) != (expected <= 0)) {
+      bad++;
+    }
+  }
+  return bad;
+}
+
+/**
+ * @brief 检查回滚日志打开时的读写: 先建一棵有很多叶子的原地修改的树,
+ * 开启日志后再插入同样多的键, 已有的叶子都被覆盖, 新内容留在内存中.
+ * 然后从头扫描一遍, 再逐个用 find_geq 查找. 这两种读法都要跨过叶子,
+ * 读到的必须是每个叶子自己的新内容.
+ * @param n 开启日志前后各插入的键数.
+ * @return 扫描或查找结果不对的键数.
+ */
+inline auto check_journal(int64_t n) -> int64_t {
+  auto fn = (std::filesystem::temp_directory_path() / "ndb_check_journal.bin")
+                .string();
+  auto key = [](int64_t i) {
+    Key k(i);
+    auto text = fmt::format("{:012}", i);
+    memcpy(k.key, text.data(), text.size());
+    return k;
+  };
+  int64_t bad = 0;
+  {
+    auto pager = std::make_shared<Pager>(fn, true);
+    BplusTree<Key, 64> bt(pager);
+    for (int64_t i = 0; i < n * 2; i += 2) {
+      bt.insert(key(i));
+    }
+    pager->sync();
+    pager->begin_journal(1);
+    for (int64_t i = 1; i < n * 2; i += 2) {
+      bt.insert(key(i));
+    }
+    int64_t next = 0;
+    for (auto iter = bt.begin(); iter->id >= 0; iter++) {
+      if (iter->id != next) {
+        bad++;
+      }
+      next = iter->id + 1;
+    }
+    bad += std::abs(n * 2 - next);
+    for (int64_t i = 0; i < n * 2; i++) {
+      if (bt.find_geq(key(i))->id != i) {
+        bad++;
+      }
+    }
+    pager->end_journal();
+  }
+  for (auto ext : {"", ".jnl", ".hot"}) {
+    std::filesystem::remove(fn + ext);
+  }
+  return bad;
+}
+
+/**
+ * @brief 检查热页列表: 像迭代器那样沿着 right 指针读 n 个页, 每次都读进
+ * 同一个缓冲区, 关闭后热页列表中必须正好是读过的这些页.
+ * @param n 读的页数, 不超过 Pager::HOT_PAGES.
+ * @return 列表中多出或者缺少的页数.
+ */
+inline auto check_hot_pages(int64_t n) -> int64_t {
+  struct Page {
+    int64_t right = 0;
+    char body[1016] = {};
+  };
+  auto fn = (std::filesystem::temp_directory_path() / "ndb_check_hot.bin")
+                .string();
+  {
+    // 第 i 页的 right 指向第 i - 1 页, 第 0 页不读.
+    Pager pager(fn, true);
+    Page page;
+    for (int64_t i = 0; i <= n; i++) {
+      page.right = i - 1;
+      pager.save(i, &page);
+    }
+  }
+  {
+    Pager pager(fn, false);
+    Page page;
+    page.right = n;
+    while (page.right > 0) {
+      pager.recover(page.right, &page);
+    }
+  }
+  std::set<uint64_t> expected;
+  for (int64_t i = 1; i <= n; i++) {
+    expected.insert(i * sizeof(Page));
+  }
+  std::ifstream list(fn + ".hot", std::ios::binary);
+  std::array<uint64_t, 2> r;  // 与 Pager::HotRecord 相同: 偏移和长度
+  int64_t bad = 0;
+  while (list.read(reinterpret_cast<char *>(r.data()), sizeof(r))) {
+    bad += expected.erase(r[0]) == 0 ? 1 : 0;
+  }
+  bad += static_cast<int64_t>(expected.size());
+  list.close();
+  for (auto ext : {"", ".hot"}) {
+    std::filesystem::remove(fn + ext);
+  }
+  return bad;
+}
+
+/**
+ * @brief 检查两种存储引擎: 把同一批 key 有大量重复的元素分几次提交给
+ * B+ 树和 LSM 树, 每个 key 扫描到的 id 集合必须相同.
+ * @param n 元素个数.
+ * @param keys 不同 key 的个数.
+ * @return 结果不同的 key 的个数.
+ */
+inline auto check_engines(int64_t n, int64_t keys) -> int64_t {
+  auto dir = std::filesystem::temp_directory_path() / "ndb_check_engines";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  int64_t bad = 0;
+  {
+    BtreeEngine<Key> bt((dir / "bt.bin").string(), true);
+    LsmEngine<Key> lsm((dir / "lsm").string(), true, INT64_MAX);
+    std::vector<int64_t> order(n);
+    std::iota(order.begin(), order.end(), 0);
+    std::shuffle(order.begin(), order.end(), std::mt19937_64(24601));
+    auto name = [](int64_t i) { return fmt::format("key {:04}", i); };
+    for (int64_t i = 0; i < n; i++) {
+      if (i % 1000 == 0) {
+        bt.begin_write();
+        lsm.begin_write();
+      }
+      Key k(order[i]);
+      auto text = name(order[i] % keys);
+      memcpy(k.key, text.data(), text.size());
+      bt.insert(k);
+      lsm.insert(k);
+      if (i % 1000 == 999 || i == n - 1) {
+        bt.commit();
+        lsm.commit();
+      }
+    }
+    for (int64_t i = 0; i < keys; i++) {
+      auto ids = [&](StorageEngine<Key> &engine) {
+        std::vector<int64_t> ret;
+        engine.scan(name(i), [&ret](const Key &k) {
+          ret.push_back(k.id);
+          return true;
+        });
+        std::sort(ret.begin(), ret.end());
+        return ret;
+      };
+      bad += ids(bt) != ids(lsm) ? 1 : 0;
+    }
+  }
+  std::filesystem::remove_all(dir);
+  return bad;
+}
+
+/**
+ * @brief 作者-文章覆盖索引的包含列. 列出作者的文章时不用再读 Record 和源文件.
+ *
+ */
+struct PaperInfo {
+  int64_t title_id = -1;  // 文章第一个标题在 title 表中的 ID, 没有标题时为 -1
+  int32_t year = 0;  // 没有年份或不是数字时为 0
+  char title[64] = {};  // 只用于显示, 过长的标题截断, 不影响顺序
+};
+
+// 键为 (作者, 年份降序), 元素的 ID 是作者在 author 表中的 ID.
+// 作者名和 Key 一样规范成最多 63 个字节, 编码时加上 2 个字节的结尾,
+// 再加 8 个字节的年份, 所以键一定放得下, 不会截掉年份.
+using PaperIndex = CoveringIndex<sizeof(Key::key) + 16, PaperInfo>;
+
+/**
+ * @brief read 的检查点. 保存检查点时所有文件都已经写回, 崩溃后先用各个文件的
+ * 回滚日志回到这个状态, 再从 offset 处继续读取.
+ *
+ */
+struct Checkpoint {
+  // 数据库文件格式的版本. 任何一个文件的格式有变化都要加一,
+  // 版本不同的数据库打开时报错, 不会把旧文件当成新格式读.
+  static constexpr uint32_t MAGIC = 0x42444e4d;  // "MNDB"
+  static constexpr uint32_t VERSION = 6;
+  static constexpr size_t MAX_SHARDS = 64;
+
+  /**
+   * @brief 各个表的下一个 ID, 用于检查文件是否一致.
+   *
+   */
+  struct Ids {
+    // 每个分片中 title, author 和倒排索引的下一个 ID (分片内的 ID).
+    std::array<std::array<int64_t, 3>, MAX_SHARDS> tables{};
+    // TopK, 文档表和作者字典的下一个 ID.
+    std::array<int64_t, 3> others{};
+
+    bool operator!=(const Ids &t) const {
+      return tables != t.tables || others != t.others;
+    }
+  };
+
+  uint32_t magic = MAGIC;
+  uint32_t version = VERSION;
+  int64_t seq = 0;
+  bool done = true;     // read 是否已经结束
+  uint64_t offset = 0;  // 下一条数据在源文件中的开始, 即上一条数据的结尾
+  int64_t records = 0;  // 已经读入的数据条数
+
+  Ids ids;
+
+  // 第几次 read, 以及这次 read 是否是在已有数据上的增量读取.
+  int64_t generation = 0;
+  bool delta = false;
+  uint64_t source_size = 0;
+  char source[256] = {};
 };
 
 class Database {
   friend class CommandLine;
 
  public:
+  ~Database();
+
   /**
-   * @brief 前缀匹配搜索
+   * @brief 前缀匹配搜索. 只查找不打印, 可以和其他数据库上的查询同时进行.
    * @param value 待搜索的字符串.
    * @return 搜索结果序列.
    *
@@ -86,9 +375,51 @@ class Database {
    * @brief 简单地插入一条 key-value 对
    * @param r 值.
    * @param key 键.
+   * @param shard 写入哪个分片, 见 shard_of.
+   * @return 这条数据在表中的 ID, 由分片号和分片内的 ID 拼成, 见 global_id.
    * todo: 可读性需要增强.
    */
-  void insert(Record r, std::string key, DatabaseState state);
+  auto insert(Record r, std::string_view key, DatabaseState state,
+              size_t shard = 0) -> int64_t;
+
+  /**
+   * @brief 一篇文章应该写入的分片. 文章的 Record, 索引中的键和倒排索引
+   * 都在这个分片中. 不按 docid 分片: 增量读取时改动过的文章会重新插入,
+   * 得到新的 docid, 而 key 不变, 按 key 分片才能回到原来的分片.
+   * Hash 的结果决定了文件中数据的位置, 所以用 fnv1a 而不是 std::hash.
+   *
+   * @param doc_key 文章的 key 属性, 没有 key 属性的文章是内容的 Hash.
+   */
+  auto shard_of(std::string_view doc_key) const -> size_t;
+
+  /**
+   * @brief 分片中 title, author 和倒排索引的下一个 ID, 顺序与 IdRange 相同.
+   *
+   */
+  auto next_ids(size_t shard) -> std::array<int64_t, 3>;
+
+  /**
+   * @brief 删除 ID 在 [first, last) 中的数据. B+ 树中的键不删除,
+   * 查询时跳过已删除的 Record. first 和 last 在同一个分片中.
+   *
+   */
+  void erase(DatabaseState state, int64_t first, int64_t last);
+
+  /**
+   * @brief 从所有表中删除一篇文章. 下一个检查点之前查询仍然能看到它,
+   * 之后才真正删除.
+   * @param r 文章在各个表中的 ID 范围.
+   */
+  void remove(const IdRange &r);
+
+  /**
+   * @brief 把一篇文章在各个表中的 Record 都指向新的位置, publish 之后才可见.
+   *
+   * @param r 文章在各个表中的 ID 范围.
+   * @param k 新的位置.
+   * @return false 如果有 Record 放不进原来的块, 此时这个表没有改写任何一条.
+   */
+  bool update(const IdRange &r, Record k);
 
   /**
    * @brief 选择所有数据并打印, 打印上限为 64 条.
@@ -99,20 +430,61 @@ class Database {
   /**
    * @brief 模糊搜索.
    * @param value_list 一个字符串序列, 即待搜索的内容.
-   * @return 搜索结果序列.
-   * todo: 需要加入返回值.
+   * @return 搜索结果序列. 同 find, 只查找不打印.
    */
-  void search(std::vector<std::string> value_list);
+  auto search(std::vector<std::string> value_list)
+      -> std::vector<std::pair<Record, std::string>>;
 
   void topk(int16_t k);
 
+  /**
+   * @brief 打印与作者合作最多的 k 位作者, 以及合作的文章数.
+   * @param name 作者名.
+   * @param k 为 0 时打印所有合作者.
+   */
+  void coauthors(std::string name, size_t k);
+
+  /**
+   * @brief 打印两位作者之间的合作距离.
+   *
+   */
+  void distance(std::string a, std::string b);
+
+  /**
+   * @brief 在覆盖索引中记下作者的一篇文章.
+   * @param author 作者名.
+   * @param id 这一条在 author 表中的 ID.
+   * @param info 包含列.
+   */
+  void insert_paper(std::string_view author, int64_t id, const PaperInfo &info);
+
+  /**
+   * @brief 按年份从新到旧打印作者的文章, 只读覆盖索引.
+   * @param name 作者名.
+   * @param k 最多打印的篇数.
+   */
+  void latest(std::string name, size_t k);
+
   /**
    * @brief 打开一个数据库.
    * @param name 数据库名.
    * @param new_file 是否新建文件.
+   * @param engine 新建时 title 和 author 索引使用的存储引擎,
+   * 打开已有的数据库时使用建立时选择的引擎.
+   * @param shards 新建时的分片数, 文章按 shard_of 分到各个分片,
+   * 作者字典和 TopK 按作者分片. 打开已有的数据库时同 engine.
+   * @param compress 新建时 Record 文件是否使用压缩格式. 打开已有的数据库时
+   * 同 engine.
    * todo: 感觉用子数据库的逻辑有问题, 待修改.
    */
-  void db_open(std::string name, bool new_file);
+  void db_open(std::string name, bool new_file, Engine engine = Engine::BTREE,
+               size_t shards = 1, bool compress = false);
+
+  /**
+   * @brief 打印 Record 文件在磁盘上的大小和解码页缓存占用的内存.
+   *
+   */
+  void print_storage();
 
   /**
    * @brief 关闭一个数据库.
@@ -120,9 +492,68 @@ class Database {
    */
   void db_close();
 
+  /**
+   * @brief 设置 read 和生成合作者图时使用的内存.
+   *
+   */
+  void set_ingest_memory(uint64_t bytes);
+
+  /**
+   * @brief 开始一次 read. 此后所有文件都会记录回滚日志.
+   * 如果文档表不为空, 这次 read 就是增量读取.
+   * @param source 源文件名.
+   * @param source_size 源文件大小.
+   * @param records 已经读入的数据条数.
+   * @param resume 是否是从检查点继续读取, 是则沿用检查点中的各项.
+   */
+  void begin_ingest(std::string source, uint64_t source_size, int64_t records,
+                    bool resume);
+
+  /**
+   * @brief 保存一个检查点. 只能在两条数据之间调用.
+   * @param offset 下一条数据在源文件中的开始.
+   * @param records 已经读入的数据条数.
+   */
+  void checkpoint(uint64_t offset, int64_t records);
+
+  /**
+   * @brief 结束一次 read, 删除回滚日志.
+   * @param records 已经读入的数据条数.
+   */
+  void end_ingest(int64_t records);
+
+  /**
+   * @brief 取得可以继续读取的检查点.
+   * @param source 源文件名.
+   * @param source_size 源文件大小.
+   * @return 上一次没有读完的 read 的检查点.
+   */
+  auto resume_point(std::string source, uint64_t source_size) -> Checkpoint;
+
+  /**
+   * @brief 最近一次保存的检查点.
+   *
+   */
+  auto last_checkpoint() const -> const Checkpoint & { return ckpt; }
+
   ndb::Property<bool> is_open{false};
   ndb::Property<std::string> name{"24601"};
 
+  /**
+   * @brief 在后台打开所有文件, 并把索引的上面几层读进缓存.
+   * 不调用时各个文件在第一次用到时才打开.
+   */
+  void warm_up();
+
+  // 每个数据库各自的倒排索引 (每个分片一个), 作者字典, TopK, 文档表和
+  // 合作者图, 第一次用到时才打开.
+  std::vector<Lazy<InvertedIndex>> invidx_managers;
+  Lazy<AuthorDict> dict_manager;
+  Lazy<TopK> topk_manager;
+  Lazy<DocTable> doc_manager;
+  Lazy<CoauthorGraph> graph_manager;
+  Lazy<PaperIndex> paper_manager;
+
  private:
   /**
    * 打印 DOM 树中的某一结点.
@@ -137,62 +568,169 @@ class Database {
    * @param pos XML 文件中的位置, 作为开始.
    * @param len XML 文件从起始位置开始的长度.
    */
-  void print_dom_tree(const char *file_name, int pos, int len);
+  void print_dom_tree(const char *file_name, uint64_t pos, uint32_t len);
+
+  /**
+   * @brief 报告后台 warm_up 的错误. 没打开的文件在查询用到时会再试一次.
+   * @param msg 错误信息.
+   */
+  void warm_up_failed(const std::string &msg);
 
+  // 每个分片一个 Record 文件, 索引的第 i 个分片中只有第 i 个文件中的 Record.
   struct SubDatabase {
-    int id = 0;
-    std::shared_ptr<ndb::Pager> page_manager;
-    std::shared_ptr<ndb::Pager> record_manager;
-    std::shared_ptr<ndb::BplusTree<Key, 64>> bt;
+    std::vector<std::shared_ptr<ndb::RecordFile>> record_managers;
+    std::shared_ptr<ndb::ShardedIndex<Key>> index;
   };
-  std::shared_ptr<SubDatabase> title = std::make_shared<SubDatabase>();
-  std::shared_ptr<SubDatabase> author = std::make_shared<SubDatabase>();
+  Lazy<SubDatabase> title;
+  Lazy<SubDatabase> author;
+
+  /**
+   * @brief 根据 state 得到对应的子数据库.
+   *
+   */
+  auto sub_database(DatabaseState state) -> SubDatabase *;
+
+  /**
+   * @brief 数据库用到的所有 Pager.
+   *
+   */
+  auto pagers() -> std::vector<std::shared_ptr<Pager>>;
+
+  /**
+   * @brief 各个表当前的下一个 ID, 顺序与 Checkpoint::ids 相同.
+   *
+   */
+  auto id_counters() -> Checkpoint::Ids;
+
+  /**
+   * @brief 提交到目前为止的插入和删除, 此后的查询可以看到它们.
+   * 必须在索引 commit 之后调用, 保证快照中可见的键都在索引里.
+   */
+  void publish();
+
+  /**
+   * @brief 先写临时文件再改名, 保证检查点文件总是完整的.
+   *
+   */
+  void save_checkpoint();
+
+  /**
+   * @brief 读取检查点, 并用回滚日志把所有文件恢复到检查点时的状态.
+   * 必须在打开各个文件之前调用. 恢复之后各个文件的大小和检查点中记的一致,
+   * 所以打开数据库时只看检查点, 不用打开各个文件.
+   * 没有检查点或者格式版本不同时抛出 unsupported_format.
+   */
+  void recover_checkpoint();
+
+  /**
+   * @brief 打开所有还没有打开的文件.
+   *
+   */
+  void open_all();
+
+  /**
+   * @brief 让系统预读数据库中每个文件上次保存的热页, 不打开任何 Pager.
+   * 打开已有的数据库时在后台调用, 避免刚启动时查询都要等磁盘.
+   * @param name 数据库名.
+   */
+  static void preload_hot_pages(std::string name);
+
+  /**
+   * @brief 打开 title 或 author 每个分片的索引和 Record 文件.
+   * @param table 表名, 即 title 或 author.
+   */
+  auto open_sub_database(std::string table, bool new_file, Engine engine,
+                         size_t shards) -> SubDatabase;
+
+  /**
+   * @brief 在作者字典中查找作者.
+   *
+   */
+  auto author_of(std::string name) -> author_id;
+
+  /**
+   * @brief 合作者图不是最近一次 read 之后生成的就重新生成.
+   *
+   */
+  void ensure_graph();
+
+  Checkpoint ckpt;
+  VersionSet versions;
+  size_t shards = 1;
+  bool compress = false;  // Record 文件是否使用压缩格式
+  uint64_t ingest_mem = 64 << 20;  // 与 ReadOptions::ingest_mem 的默认值相同
+  std::thread warmer;
+  std::thread preloader;
 };
 
 #pragma region  // # Database Implementation
 
 auto Database::find(std::string value, DatabaseState state)
     -> std::vector<std::pair<Record, std::string>> {
-  std::shared_ptr<SubDatabase> here;
+  SubDatabase *here = nullptr;
   switch (state) {
     case DatabaseState::AUTHOR: {
-      here = author;
+      here = &author.get();
       break;
     }
     case DatabaseState::TITLE: {
-      here = title;
+      here = &title.get();
       break;
     }
     default: {
       break;
     }
   }
-  Key k(-1);
-  snprintf(k.key, sizeof(k.key), "%s", value.c_str());
-  auto iter = here->bt->find_geq(k);
+  // 先取快照再查索引, 索引中至少有快照里可见的所有键.
+  auto snap = versions.snapshot();
+  auto table = state == DatabaseState::TITLE ? 0 : 1;
   std::vector<std::pair<Record, std::string>> results;
-  while (true) {
-    if (std::string(iter->key).find(value) == 0) {
-      Record s;
-      here->record_manager->recover(iter->id, &s);
-      results.push_back({s, iter->key});
-      //// fmt::print("({}, {})\n", s.pos, s.len);
-      //// print_dom_tree("xml/small.xml", s.pos, s.len + 1);
-      iter++;
-      continue;
-    }
-    break;
-  }
-  select_in(results);
+  here->index->scan(Key::normalize(value), [&](const Key &k) {
+    Record s;
+    if (snap.visible(table, k.id) &&
+        here->record_managers[shard_of_id(k.id)]->recover(local_id(k.id), &s,
+                                                          snap.csn)) {
+      results.push_back({s, k.key});
+    }
+    //// fmt::print("({}, {})\n", s.pos, s.len);
+    //// print_dom_tree("xml/small.xml", s.pos, s.len + 1);
+    return true;
+  });
+  // 同一个键的 ID 按分片排列. 分片时按位置重排, 和不分片时一样后读入的在前.
+  if (here->record_managers.size() > 1) {
+    std::stable_sort(results.begin(), results.end(),
+                     [](const auto &a, const auto &b) {
+                       return std::tie(a.second, b.first.pos) <
+                              std::tie(b.second, a.first.pos);
+                     });
+  }
   //// fmt::print("{} record(s) found.\n", cnt);
   return results;
 }
 
-void Database::search(std::vector<std::string> value_list) {
-  // todo: 需要改进?
-  std::vector<std::pair<Record, std::string>> v =
-      invidx_manager.find(value_list);
-  select_in(v);
+auto Database::search(std::vector<std::string> value_list)
+    -> std::vector<std::pair<Record, std::string>> {
+  auto snap = versions.snapshot();
+  if (invidx_managers.size() == 1) {
+    return invidx_managers[0]->find(value_list, snap);
+  }
+  // 每个分片并行查询, 结果按位置合并, 和不分片时的顺序相同.
+  std::vector<std::future<std::vector<std::pair<Record, std::string>>>> parts;
+  for (auto &ii : invidx_managers) {
+    parts.push_back(std::async(std::launch::async, [&ii, &value_list, &snap] {
+      return ii->find(value_list, snap);
+    }));
+  }
+  std::vector<std::pair<Record, std::string>> results;
+  for (auto &p : parts) {
+    auto part = p.get();
+    results.insert(results.end(), part.begin(), part.end());
+  }
+  std::sort(results.begin(), results.end(), [](const auto &a, const auto &b) {
+    return std::make_pair(a.first.pos, a.first.len) <
+           std::make_pair(b.first.pos, b.first.len);
+  });
+  return results;
 }
 
 void Database::select_in(std::vector<std::pair<Record, std::string>> results) {
@@ -202,80 +740,607 @@ void Database::select_in(std::vector<std::pair<Record, std::string>> results) {
     auto dd = fmt::format("{:-^55}", "");
     fmt::print(fg(fmt::terminal_color::bright_blue), "{}\n", dd);
     auto r = results[i].first;
-    print_dom_tree("xml/small.xml", r.pos, r.len + 1);
+    // 记录的位置是相对于最近一次 read 的源文件的.
+    print_dom_tree(ckpt.source[0] != '\0' ? ckpt.source : "xml/small.xml",
+                   r.pos, r.len + 1);
     auto div = fmt::format("{:-^60}", "");
     fmt::print(fg(fmt::terminal_color::bright_blue), "{}\n", div);
   }
 }
 
-void Database::insert(Record r, std::string key, DatabaseState state) {
-  std::shared_ptr<SubDatabase> here;
+auto Database::insert(Record r, std::string_view key, DatabaseState state,
+                      size_t shard) -> int64_t {
+  SubDatabase *here = nullptr;
   switch (state) {
     case DatabaseState::AUTHOR: {
-      here = author;
+      here = &author.get();
       break;
     }
     case DatabaseState::TITLE: {
-      here = title;
+      here = &title.get();
       break;
     }
     default: {
       break;
     }
   }
-  here->record_manager->save(here->id, &r);
-  Key k(here->id);
-  snprintf(k.key, sizeof(k.key), "%s", key.c_str());
-  here->bt->insert(k);
-  here->id++;
+  Key k(global_id(shard, here->record_managers[shard]->append(r)));
+  auto text = Key::normalize(key);
+  memcpy(k.key, text.data(), text.size());
+  here->index->insert(shard, k);
+  return k.id;
+}
+
+auto Database::shard_of(std::string_view doc_key) const -> size_t {
+  if (shards == 1) {
+    return 0;
+  }
+  return fnv1a(doc_key) % shards;
+}
+
+auto Database::next_ids(size_t shard) -> std::array<int64_t, 3> {
+  return {global_id(shard, title->record_managers[shard]->size()),
+          global_id(shard, author->record_managers[shard]->size()),
+          global_id(shard, invidx_managers[shard]->size())};
+}
+
+void Database::erase(DatabaseState state, int64_t first, int64_t last) {
+  auto &records = sub_database(state)->record_managers[shard_of_id(first)];
+  for (auto i = local_id(first); i < local_id(last); i++) {
+    records->erase(i);
+  }
+}
+
+void Database::remove(const IdRange &r) { versions.remove(r); }
+
+bool Database::update(const IdRange &r, Record k) {
+  auto shard = shard_of_id(r.first[0]);
+  return title->record_managers[shard]->update(local_id(r.first[0]),
+                                               local_id(r.last[0]), k) &&
+         author->record_managers[shard]->update(local_id(r.first[1]),
+                                                local_id(r.last[1]), k) &&
+         invidx_managers[shard]->update(local_id(r.first[2]),
+                                        local_id(r.last[2]), k);
+}
+
+auto Database::sub_database(DatabaseState state) -> SubDatabase * {
+  switch (state) {
+    case DatabaseState::AUTHOR: {
+      return &author.get();
+    }
+    case DatabaseState::TITLE: {
+      return &title.get();
+    }
+    default: {
+      return nullptr;
+    }
+  }
 }
 
 void Database::select(DatabaseState state) {
-  std::shared_ptr<SubDatabase> here;
+  SubDatabase *here = nullptr;
   switch (state) {
     case DatabaseState::AUTHOR: {
-      here = author;
+      here = &author.get();
       break;
     }
     case DatabaseState::TITLE: {
-      here = title;
+      here = &title.get();
       break;
     }
     default: {
       break;
     }
   }
-  here->bt->print();
+  here->index->print();
 }
 
-void Database::topk(int16_t k) { topk_manager.print(k); }
+void Database::topk(int16_t k) { topk_manager->print(k, dict_manager.get()); }
 
-void Database::db_open(std::string name, bool new_file) {
+void Database::coauthors(std::string name, size_t k) {
+  auto a = author_of(name);
+  ensure_graph();
+  auto [first, last] = graph_manager->neighbors(a);
+  auto list = graph_manager->top_collaborators(a, k > 0 ? k : last - first);
+  for (size_t i = 0; i < list.size(); i++) {
+    auto num = fmt::format("[{}] ", i + 1);
+    fmt::print(fg(fmt::terminal_color::bright_blue), "{:>5}", num);
+    fmt::print("{} ({})\n", dict_manager->name(list[i].dst), list[i].weight);
+  }
+  fmt::print("{} has {} co-author(s).\n", name, last - first);
+}
+
+void Database::distance(std::string a, std::string b) {
+  auto x = author_of(a);
+  auto y = author_of(b);
+  ensure_graph();
+  auto d = graph_manager->distance(x, y);
+  if (d < 0) {
+    fmt::print("{} and {} are not connected.\n", a, b);
+  } else {
+    fmt::print("Collaboration distance between {} and {}: {}\n", a, b, d);
+  }
+}
+
+void Database::insert_paper(std::string_view author, int64_t id,
+                            const PaperInfo &info) {
+  KeyEncoder enc;
+  enc.str(Key::normalize(author)).i64(info.year, true);
+  paper_manager->insert(PaperIndex::entry(enc.bytes(), id, info));
+}
+
+void Database::latest(std::string name, size_t k) {
+  // 先取快照再查索引, 同 find.
+  auto snap = versions.snapshot();
+  KeyEncoder enc;
+  enc.str(Key::normalize(name));
+  size_t cnt = 0;
+  paper_manager->scan(enc.bytes(), [&](const PaperIndex::entry &e) {
+    if (!snap.visible(1, e.id)) {
+      return true;
+    }
+    cnt++;
+    auto num = fmt::format("[{}] ", cnt);
+    fmt::print(fg(fmt::terminal_color::bright_blue), "{:>5}", num);
+    fmt::print("{} {}\n", e.payload.year, e.payload.title);
+    return cnt < k;
+  });
+  fmt::print("{} paper(s) of {} listed.\n", cnt, name);
+}
+
+auto Database::author_of(std::string name) -> author_id {
+  auto a = dict_manager->find(name);
+  if (a < 0) {
+    throw author_not_found(name);
+  }
+  return static_cast<author_id>(a);
+}
+
+void Database::print_storage() {
+  uint64_t stored = 0;
+  uint64_t cached = 0;
+  auto add = [&](RecordFile &f) {
+    stored += f.stored_bytes();
+    cached += f.cached_bytes();
+  };
+  for (size_t i = 0; i < shards; i++) {
+    add(*title->record_managers[i]);
+    add(*author->record_managers[i]);
+    add(invidx_managers[i]->records());
+  }
+  fmt::print("{}: records {:.1f} MiB on disk ({}), {:.1f} MiB cached.\n",
+             name(), stored / double(1 << 20),
+             compress ? "compressed" : "uncompressed", cached / double(1 << 20));
+}
+
+void Database::ensure_graph() {
+  if (!graph_manager->ready(ckpt.generation)) {
+    graph_manager->build(doc_manager.get(), dict_manager.get(), ckpt.generation,
+                         ingest_mem);
+  }
+}
+
+void Database::set_ingest_memory(uint64_t bytes) {
+  ingest_mem = bytes;
+  // 每个分片的倒排索引各有一张内存中的 Hash 表, 平分预算.
+  for (auto &ii : invidx_managers) {
+    ii->set_memory_budget(bytes / invidx_managers.size());
+  }
+}
+
+void Database::db_open(std::string name, bool new_file, Engine engine,
+                       size_t shards, bool compress) {
   this->name = name;
-  is_open = true;
+  ckpt = Checkpoint();
+  if (!new_file) {
+    // 格式不认识时不打开, 免得把旧文件当成新格式读.
+    recover_checkpoint();
+  }
+  // 存储引擎, 分片数和是否压缩在建立时选定, 记在 _engine.bin 中.
+  // 没有这个文件的是只有一个分片, 不压缩的 B+ 树. 文件不全或者内容不认识时
+  // 不打开, 免得按错误的布局读.
+  auto engine_file = fmt::format("database/{0}/{0}_engine.bin", name);
   if (new_file) {
     system(fmt::format("{} database/{}", ndb::MKDIR, name).c_str());
+    auto file = fopen(engine_file.c_str(), "wb");
+    if (file == nullptr) {
+      throw file_opening_error(engine_file);
+    }
+    uint32_t n = shards;
+    uint32_t packed = compress ? 1 : 0;
+    auto ok = fwrite(&engine, sizeof(engine), 1, file) == 1 &&
+              fwrite(&n, sizeof(n), 1, file) == 1 &&
+              fwrite(&packed, sizeof(packed), 1, file) == 1;
+    if (!close_synced(file) || !ok) {
+      throw file_io_error(engine_file);
+    }
+    sync_parent_dir(engine_file);
+    sync_parent_dir(fmt::format("database/{}", name));
+  }
+  if (!new_file) {
+    engine = Engine::BTREE;
+    uint32_t n = 1;
+    uint32_t packed = 0;
+    if (auto file = fopen(engine_file.c_str(), "rb")) {
+      auto ok = fread(&engine, sizeof(engine), 1, file) == 1 &&
+                fread(&n, sizeof(n), 1, file) == 1 &&
+                fread(&packed, sizeof(packed), 1, file) == 1 &&
+                fgetc(file) == EOF;
+      fclose(file);
+      if (!ok || (engine != Engine::BTREE && engine != Engine::LSM) || n < 1 ||
+          n > Checkpoint::MAX_SHARDS || packed > 1) {
+        throw unsupported_format(engine_file);
+      }
+    } else if (errno != ENOENT) {
+      throw file_opening_error(engine_file);
+    }
+    shards = n;
+    compress = packed != 0;
+    for (size_t i = 0; i < shards; i++) {
+      auto suffix = i == 0 ? "" : fmt::format("_{}", i);
+      auto ii = i == 0 ? "ii" : fmt::format("ii{}", i);
+      RecordFile::check(
+          fmt::format("database/{0}/{0}_rec_title{1}.bin", name, suffix));
+      RecordFile::check(
+          fmt::format("database/{0}/{0}_rec_author{1}.bin", name, suffix));
+      RecordFile::check(fmt::format("database/{0}/{0}_{1}_rec.bin", name, ii));
+    }
+  }
+  is_open = true;
+  this->shards = shards;
+  this->compress = compress;
+  invidx_managers = std::vector<Lazy<InvertedIndex>>(shards);
+  for (size_t i = 0; i < shards; i++) {
+    invidx_managers[i].reset([name, new_file, i, compress](InvertedIndex &ii) {
+      ii.init_ii(name, new_file, i, compress);
+    });
+  }
+  dict_manager.reset([name, new_file, shards](AuthorDict &d) {
+    d.init_dict(name, new_file, shards);
+  });
+  topk_manager.reset([name, new_file, shards](TopK &t) {
+    t.init_topk(name, new_file, shards);
+  });
+  doc_manager.reset(
+      [name, new_file](DocTable &d) { d.init_docs(name, new_file); });
+  graph_manager.reset([name](CoauthorGraph &g) { g.init_graph(name); });
+  paper_manager.reset([name, new_file](PaperIndex &p) {
+    p.init_index(fmt::format("database/{0}/{0}_idx_papers", name), new_file);
+  });
+  title.reset([this, new_file, engine, shards](SubDatabase &s) {
+    s = open_sub_database("title", new_file, engine, shards);
+  });
+  author.reset([this, new_file, engine, shards](SubDatabase &s) {
+    s = open_sub_database("author", new_file, engine, shards);
+  });
+  if (new_file) {
+    // 新建的文件要马上建出来, 下次打开时才找得到.
+    open_all();
+    save_checkpoint();
+  }
+  if (!new_file) {
+    preloader = std::thread([name] { preload_hot_pages(name); });
+  }
+  versions.reset(std::vector<std::array<int64_t, 3>>(
+      ckpt.ids.tables.begin(), ckpt.ids.tables.begin() + shards));
+}
+
+void Database::open_all() {
+  for (auto &ii : invidx_managers) {
+    ii.get();
+  }
+  dict_manager.get();
+  topk_manager.get();
+  doc_manager.get();
+  graph_manager.get();
+  paper_manager.get();
+  title.get();
+  author.get();
+}
+
+void Database::warm_up() {
+  if (warmer.joinable()) {
+    return;
+  }
+  warmer = std::thread([this] {
+    try {
+      open_all();
+      title->index->warm_up();
+      author->index->warm_up();
+    } catch (const file_opening_error &e) {
+      warm_up_failed(e.msg());
+    } catch (const file_io_error &e) {
+      warm_up_failed(e.msg());
+    } catch (const unsupported_format &e) {
+      warm_up_failed(e.msg());
+    } catch (const std::exception &e) {
+      warm_up_failed(e.what());
+    }
+  });
+}
+
+void Database::warm_up_failed(const std::string &msg) {
+  fmt::print(stderr, fg(fmt::terminal_color::bright_red),
+             "Warm-up of database {} stopped: {}\n", name(), msg);
+  fmt::print(stderr, fg(fmt::terminal_color::bright_cyan),
+             "Queries will open the remaining files on demand.\n");
+}
+
+void Database::preload_hot_pages(std::string name) {
+  // 预读只是为了快一点, 目录读不了时查询照样可以从磁盘读.
+  std::error_code ec;
+  std::filesystem::directory_iterator end;
+  for (std::filesystem::directory_iterator it(fmt::format("database/{}", name),
+                                              ec);
+       !ec && it != end; it.increment(ec)) {
+    auto path = it->path();
+    if (path.extension() == ".hot") {
+      Pager::preload(path.replace_extension().string());
+    }
+  }
+}
+
+auto Database::open_sub_database(std::string table, bool new_file,
+                                 Engine engine, size_t shards) -> SubDatabase {
+  SubDatabase ret;
+  // 第 0 个分片沿用不分片时的文件名.
+  std::vector<std::shared_ptr<ndb::StorageEngine<Key>>> engines;
+  for (size_t i = 0; i < shards; i++) {
+    auto suffix = i == 0 ? "" : fmt::format("_{}", i);
+    auto rec =
+        fmt::format("database/{0}/{0}_rec_{1}{2}.bin", name(), table, suffix);
+    ret.record_managers.push_back(
+        std::make_shared<ndb::RecordFile>(rec, new_file, compress));
+    auto idx =
+        fmt::format("database/{0}/{0}_idx_{1}{2}", name(), table, suffix);
+    // 两种引擎的写入都在 commit 时才对查询可见, read 的同时也可以查询.
+    if (engine == Engine::LSM) {
+      engines.push_back(std::make_shared<ndb::LsmEngine<Key>>(
+          idx, new_file, global_id(i, ret.record_managers[i]->size())));
+    } else {
+      engines.push_back(
+          std::make_shared<ndb::BtreeEngine<Key>>(idx + ".bin", new_file));
+    }
+  }
+  ret.index = std::make_shared<ndb::ShardedIndex<Key>>(std::move(engines));
+  return ret;
+}
+
+Database::~Database() {
+  if (warmer.joinable()) {
+    warmer.join();
+  }
+  if (preloader.joinable()) {
+    preloader.join();
+  }
+}
+
+void Database::db_close() {
+  if (warmer.joinable()) {
+    warmer.join();
+  }
+  if (preloader.joinable()) {
+    preloader.join();
+  }
+  is_open = false;
+}
+
+void Database::begin_ingest(std::string source, uint64_t source_size,
+                            int64_t records, bool resume) {
+  for (auto &ii : invidx_managers) {
+    ii->flush();
+    ii->begin_build();
+  }
+  // 两个检查点之间的插入放在一个写事务中, 路径上的页只复制一次.
+  title->index->begin_write();
+  author->index->begin_write();
+  paper_manager->begin_write();
+  for (auto &p : pagers()) {
+    p->sync();
+  }
+  if (!resume) {
+    ckpt.generation++;
+    ckpt.delta = doc_manager->size() > 0;
+    ckpt.offset = 0;
+    ckpt.records = records;
+  }
+  ckpt.seq++;
+  ckpt.done = false;
+  ckpt.ids = id_counters();
+  ckpt.source_size = source_size;
+  snprintf(ckpt.source, sizeof(ckpt.source), "%s", source.c_str());
+  save_checkpoint();
+  for (auto &p : pagers()) {
+    p->begin_journal(ckpt.seq);
+  }
+}
+
+void Database::checkpoint(uint64_t offset, int64_t records) {
+  // 先把所有文件写回, 再保存检查点, 最后才清空日志. 在任何一步崩溃,
+  // 日志的序号和检查点的序号要么一致 (回滚到上一个检查点),
+  // 要么不一致 (文件已经是新检查点的状态).
+  // 倒排索引的段不走日志, 检查点之前写出的段在打开时按 ID 截断.
+  for (auto &ii : invidx_managers) {
+    ii->flush();
+  }
+  title->index->commit();
+  author->index->commit();
+  paper_manager->commit();
+  publish();
+  for (auto &p : pagers()) {
+    p->sync();
+  }
+  ckpt.seq++;
+  ckpt.offset = offset;
+  ckpt.records = records;
+  ckpt.ids = id_counters();
+  save_checkpoint();
+  for (auto &p : pagers()) {
+    p->checkpoint(ckpt.seq);
+  }
+  title->index->begin_write();
+  author->index->begin_write();
+  paper_manager->begin_write();
+}
+
+void Database::end_ingest(int64_t records) {
+  for (auto &ii : invidx_managers) {
+    ii->flush();
+  }
+  title->index->commit();
+  author->index->commit();
+  paper_manager->commit();
+  publish();
+  for (auto &p : pagers()) {
+    p->sync();
+  }
+  ckpt.seq++;
+  ckpt.done = true;
+  ckpt.records = records;
+  ckpt.ids = id_counters();
+  save_checkpoint();
+  for (auto &p : pagers()) {
+    p->end_journal();
   }
-  invidx_manager.init_ii(name, new_file);
-  topk_manager.init_topk(name, new_file);
-  auto idx_title = fmt::format("database/{0}/{0}_idx_title.bin", name);
-  auto rec_title = fmt::format("database/{0}/{0}_rec_title.bin", name);
-  title->page_manager = std::make_shared<ndb::Pager>(idx_title, new_file);
-  title->record_manager = std::make_shared<ndb::Pager>(rec_title, new_file);
-  title->bt = std::make_shared<ndb::BplusTree<Key, 64>>(title->page_manager);
+  // 归并这次 read 写出的段. 段的列表是整体替换的, 这一步崩溃也不要紧.
+  for (auto &ii : invidx_managers) {
+    ii->compact();
+  }
+}
 
-  auto idx_author = fmt::format("database/{0}/{0}_idx_author.bin", name);
-  auto rec_author = fmt::format("database/{0}/{0}_rec_author.bin", name);
-  author->page_manager = std::make_shared<ndb::Pager>(idx_author, new_file);
-  author->record_manager = std::make_shared<ndb::Pager>(rec_author, new_file);
-  author->bt = std::make_shared<ndb::BplusTree<Key, 64>>(author->page_manager);
+auto Database::resume_point(std::string source, uint64_t source_size)
+    -> Checkpoint {
+  if (ckpt.done) {
+    throw cannot_resume("there is no unfinished read");
+  }
+  if (source != ckpt.source || source_size != ckpt.source_size) {
+    throw cannot_resume(fmt::format("{} has changed", source));
+  }
+  if (id_counters() != ckpt.ids) {
+    throw cannot_resume("the index files do not match the checkpoint");
+  }
+  return ckpt;
+}
 
-  Record s;
-  title->id = title->record_manager->get_id(&s);
-  author->id = author->record_manager->get_id(&s);
+auto Database::pagers() -> std::vector<std::shared_ptr<Pager>> {
+  std::vector<std::shared_ptr<Pager>> ret;
+  for (auto &r : title->record_managers) {
+    ret.push_back(r->get_pager());
+  }
+  for (auto &r : author->record_managers) {
+    ret.push_back(r->get_pager());
+  }
+  for (auto &p : title->index->pagers()) {
+    ret.push_back(p);
+  }
+  for (auto &p : author->index->pagers()) {
+    ret.push_back(p);
+  }
+  for (auto &ii : invidx_managers) {
+    for (auto &p : ii->pagers()) {
+      ret.push_back(p);
+    }
+  }
+  for (auto &p : topk_manager->pagers()) {
+    ret.push_back(p);
+  }
+  for (auto &p : doc_manager->pagers()) {
+    ret.push_back(p);
+  }
+  for (auto &p : dict_manager->pagers()) {
+    ret.push_back(p);
+  }
+  for (auto &p : paper_manager->pagers()) {
+    ret.push_back(p);
+  }
+  return ret;
 }
 
-void Database::db_close() { is_open = false; }
+auto Database::id_counters() -> Checkpoint::Ids {
+  Checkpoint::Ids ret;
+  for (size_t i = 0; i < shards; i++) {
+    ret.tables[i] = {title->record_managers[i]->size(),
+                     author->record_managers[i]->size(),
+                     invidx_managers[i]->size()};
+  }
+  ret.others = {topk_manager->size(), doc_manager->size(),
+                dict_manager->size()};
+  return ret;
+}
+
+void Database::publish() {
+  topk_manager->publish();
+  // 改写的 Record 和这次提交一起可见, 要在读者取得新的提交序号之前发布.
+  auto csn = versions.csn() + 1;
+  std::vector<std::array<int64_t, 3>> limits;
+  for (size_t i = 0; i < shards; i++) {
+    title->record_managers[i]->publish(csn);
+    author->record_managers[i]->publish(csn);
+    invidx_managers[i]->publish(csn);
+    limits.push_back({title->record_managers[i]->size(),
+                      author->record_managers[i]->size(),
+                      invidx_managers[i]->size()});
+  }
+  auto removed = versions.publish(limits);
+  for (size_t i = 0; i < shards; i++) {
+    title->record_managers[i]->retire();
+    author->record_managers[i]->retire();
+    invidx_managers[i]->retire();
+  }
+  for (auto &r : removed) {
+    erase(DatabaseState::TITLE, r.first[0], r.last[0]);
+    erase(DatabaseState::AUTHOR, r.first[1], r.last[1]);
+    invidx_managers[shard_of_id(r.first[2])]->erase(local_id(r.first[2]),
+                                                   local_id(r.last[2]));
+    paper_manager->erase(r.first[1], r.last[1]);
+  }
+  versions.retire();
+}
+
+void Database::save_checkpoint() {
+  auto fn = fmt::format("database/{0}/{0}_ckpt.bin", name());
+  auto tmp = fn + ".tmp";
+  auto file = fopen(tmp.c_str(), "wb");
+  if (file == nullptr) {
+    throw file_opening_error(tmp);
+  }
+  auto written = fwrite(&ckpt, sizeof(ckpt), 1, file);
+  if (!close_synced(file) || written != 1 ||
+      rename(tmp.c_str(), fn.c_str()) != 0) {
+    throw file_io_error(fn);
+  }
+  sync_parent_dir(fn);
+}
+
+void Database::recover_checkpoint() {
+  auto fn = fmt::format("database/{0}/{0}_ckpt.bin", name());
+  auto file = fopen(fn.c_str(), "rb");
+  if (file == nullptr) {
+    if (access(fmt::format("database/{}", name()).c_str(), 0) != 0) {
+      throw database_not_exist(fn);
+    }
+    // 新建数据库时就会写检查点, 没有检查点的是旧版本建的.
+    throw unsupported_format(fn);
+  }
+  auto got = fread(&ckpt, sizeof(ckpt), 1, file);
+  auto rest = fgetc(file);
+  fclose(file);
+  if (got != 1 || rest != EOF || ckpt.magic != Checkpoint::MAGIC ||
+      ckpt.version != Checkpoint::VERSION) {
+    ckpt = Checkpoint();
+    throw unsupported_format(fn);
+  }
+  // 回滚日志的文件名是数据文件名加上 .jnl.
+  for (auto &entry :
+       std::filesystem::directory_iterator(fmt::format("database/{}", name()))) {
+    auto path = entry.path();
+    if (path.extension() == ".jnl") {
+      auto data = path;
+      Pager::rollback(data.replace_extension().string(), ckpt.seq);
+      std::filesystem::remove(path);
+    }
+  }
+}
 
 void Database::print_nodes(xmlDocPtr doc, xmlNodePtr cur) {
   std::string last;
@@ -315,36 +1380,43 @@ void Database::print_nodes(xmlDocPtr doc, xmlNodePtr cur) {
   }
 }
 
-void Database::print_dom_tree(const char *file_name, int pos, int len) {
-  auto str = new char[len];
-  auto p = str;
+void Database::print_dom_tree(const char *file_name, uint64_t pos,
+                              uint32_t len) {
+  auto buf = new char[len];
   auto file = fopen(file_name, "r");
-  fseek(file, pos, 0);
-
-  // 一个字符一个字符地读取内容, 所幸单条数据的量不是很大.
-  for (int i = 0; i < len; i++) {
-    *p++ = fgetc(file);
-  }
-  *--p = '\0';
+  // 源文件可能超过 4 GiB, 所以用 fseeko 而不是 fseek.
+  fseeko(file, static_cast<off_t>(pos), SEEK_SET);
+  auto got = fread(buf, 1, len - 1, file);
+  buf[got] = '\0';
   fclose(file);
 
+  // pos 是上一条数据的结尾, 中间可能隔着换行, 所以要先跳过空白.
+  auto str = buf;
+  while (*str != '\0' && isspace(static_cast<unsigned char>(*str))) {
+    str++;
+  }
   // 我对 Libxml 的理解不够透彻, 所以经常出现文件指针错位的情况.
   if (*str != '<') {
+    delete[] buf;
     return;
   }
 
-  auto doc = xmlParseMemory(str, len);
+  auto doc = xmlParseMemory(str, static_cast<int>(strlen(str)));
   auto cur = xmlDocGetRootElement(doc);
+  if (cur == nullptr) {
+    xmlFreeDoc(doc);
+    delete[] buf;
+    return;
+  }
 
   // 这是建立在确信生成的 DOM 树不超过两层的基础上的. 也最多打印两层.
   // fixme: 本来想直接遍历树的, 但是疑似有点问题.
   print_nodes(doc, cur);
   print_nodes(doc, cur->children);
-  delete[] str;
+  xmlFreeDoc(doc);
+  delete[] buf;
 }
 
-Database db;
-
 #pragma endregion
 
 };  // namespace ndb
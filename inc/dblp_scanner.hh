@@ -0,0 +1,436 @@
+/**
+ * @file dblp_scanner.hh
+ * @author Selene
+ * @brief 专门用于 DBLP 的 XML 扫描器, 用 SIMD 找出结构字符, 代替 LibXml 的 SAX.
+ * @version 0.2
+ * @date 2021-04-14
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef INC_DBLP_SCANNER_HH_
+#define INC_DBLP_SCANNER_HH_
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace ndb {
+
+/**
+ * @brief 一个 64 字节块中各种结构字符的位图, 第 i 位对应块中第 i 个字节.
+ *
+ */
+struct StructuralMasks {
+  uint64_t lt = 0;
+  uint64_t gt = 0;
+  uint64_t amp = 0;
+  uint64_t quote = 0;
+  uint64_t high = 0;
+};
+
+/**
+ * @brief 对 64 个字节分类, 找出 '<', '>', '&', '"' 以及最高位为 1 的字节.
+ * 有 AVX2 或 SSE2 时用向量比较, 否则逐字节比较.
+ *
+ * @param p 至少 64 个可读字节.
+ * @return 分类的结果.
+ */
+inline auto classify_block(const char *p) -> StructuralMasks {
+  StructuralMasks m;
+#if defined(__AVX2__)
+  for (int i = 0; i < 64; i += 32) {
+    auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i));
+    auto bits = [&](char c) -> uint64_t {
+      auto eq = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c));
+      return static_cast<uint32_t>(_mm256_movemask_epi8(eq));
+    };
+    m.lt |= bits('<') << i;
+    m.gt |= bits('>') << i;
+    m.amp |= bits('&') << i;
+    m.quote |= bits('"') << i;
+    m.high |= uint64_t(static_cast<uint32_t>(_mm256_movemask_epi8(v))) << i;
+  }
+#elif defined(__SSE2__)
+  for (int i = 0; i < 64; i += 16) {
+    auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+    auto bits = [&](char c) -> uint64_t {
+      auto eq = _mm_cmpeq_epi8(v, _mm_set1_epi8(c));
+      return static_cast<uint16_t>(_mm_movemask_epi8(eq));
+    };
+    m.lt |= bits('<') << i;
+    m.gt |= bits('>') << i;
+    m.amp |= bits('&') << i;
+    m.quote |= bits('"') << i;
+    m.high |= uint64_t(static_cast<uint16_t>(_mm_movemask_epi8(v))) << i;
+  }
+#else
+  for (int i = 0; i < 64; i++) {
+    auto bit = uint64_t(1) << i;
+    m.lt |= p[i] == '<' ? bit : 0;
+    m.gt |= p[i] == '>' ? bit : 0;
+    m.amp |= p[i] == '&' ? bit : 0;
+    m.quote |= p[i] == '"' ? bit : 0;
+    m.high |= (p[i] & 0x80) ? bit : 0;
+  }
+#endif
+  return m;
+}
+
+/**
+ * @brief 判断 XML 声明中的编码是否为 ISO-8859-1.
+ *
+ * @param prolog <dblp> 之前的内容.
+ */
+inline bool is_latin1(std::string_view prolog) {
+  auto p = prolog.find("encoding=");
+  if (p == prolog.npos || p + 10 > prolog.size()) {
+    return false;
+  }
+  auto q = prolog[p + 9];
+  auto e = prolog.find(q, p + 10);
+  if (e == prolog.npos) {
+    return false;
+  }
+  std::string enc(prolog.substr(p + 10, e - p - 10));
+  std::transform(enc.begin(), enc.end(), enc.begin(), ::tolower);
+  return enc == "iso-8859-1" || enc == "latin1" || enc == "iso_8859-1";
+}
+
+/**
+ * @brief 一个只认识 DBLP 子集的 XML 扫描器.
+ * 第一步用 classify_block 找出所有结构字符的位置, 第二步只沿着这些位置走,
+ * 只把配置好的字段 (比如 author 和 title) 的内容交出去.
+ * 字段里没有实体, 嵌套标签和需要转码的字节时, 直接返回指向源文件的
+ * string_view, 否则才解码到内部的缓冲区里.
+ *
+ */
+class DblpScanner {
+ public:
+  /**
+   * @brief DblpScanner 的构造函数.
+   *
+   * @param fields 需要提取的字段名.
+   * @param attrs 需要提取的顶层元素属性名, 比如 key.
+   * @param latin1 源文件是否为 ISO-8859-1 编码, 是则要转成 UTF-8.
+   */
+  DblpScanner(std::vector<std::string> fields, std::vector<std::string> attrs,
+              bool latin1)
+      : fields(std::move(fields)), attrs(std::move(attrs)), latin1(latin1) {}
+
+  /**
+   * @brief 扫描源文件中的一段, 这一段必须由若干条完整的顶层元素组成.
+   *
+   * @param data 源文件内容.
+   * @param begin 这一段的开始.
+   * @param end 这一段的结尾.
+   * @param on_field 每读完一个字段调用一次, 参数为字段序号和内容.
+   * 内容只在这次调用中有效. 属性也通过它交出, 序号接在字段后面,
+   * 即第 i 个属性的序号为 fields.size() + i.
+   * @param on_record 每读完一条顶层元素调用一次, 参数为它结尾的偏移.
+   * 自闭合的顶层元素 (<www key="..."/>) 也算一条.
+   */
+  template <class FieldFn, class RecordFn>
+  void scan(const char *data, uint64_t begin, uint64_t end, FieldFn &&on_field,
+            RecordFn &&on_record);
+
+ private:
+  /**
+   * @brief 找出一段中所有结构字符的位置 (相对于这一段的开始).
+   *
+   */
+  void build_index(const char *p, uint64_t len);
+
+  /**
+   * @brief [begin, end) 中的字节是否全部为 ASCII. 直接查第一步留下的位图.
+   *
+   */
+  bool is_ascii(uint64_t begin, uint64_t end) const;
+
+  /**
+   * @brief 去掉嵌套标签, 解码实体, 必要时从 ISO-8859-1 转为 UTF-8.
+   *
+   */
+  auto decode(std::string_view raw) -> std::string_view;
+
+  /**
+   * @brief 解码一个实体, 结果追加到 buffer. 只认识字符引用和 XML 预定义的
+   * 五个实体. 其他实体 (比如 dblp.dtd 里的 &auml;) 直接丢弃, 与 LibXml
+   * 不加载 DTD 时的行为相同.
+   *
+   */
+  void decode_entity(std::string_view name);
+
+  /**
+   * @brief 以 UTF-8 编码追加一个字符.
+   *
+   */
+  void append_utf8(uint32_t c);
+
+  std::vector<std::string> fields;
+  std::vector<std::string> attrs;
+  bool latin1;
+  std::vector<uint32_t> index;
+  std::vector<uint64_t> high;
+  std::string buffer;
+};
+
+#pragma region  // # DblpScanner Implementation
+
+template <class FieldFn, class RecordFn>
+void DblpScanner::scan(const char *data, uint64_t begin, uint64_t end,
+                       FieldFn &&on_field, RecordFn &&on_record) {
+  auto p = data + begin;
+  auto len = end - begin;
+  build_index(p, len);
+
+  // 找到从 k 开始的第一个 '>', 跳过引号中的内容.
+  auto tag_end = [&](size_t *k) -> uint64_t {
+    bool quoted = false;
+    for (; *k < index.size(); (*k)++) {
+      auto c = p[index[*k]];
+      if (c == '"') {
+        quoted = !quoted;
+      } else if (c == '>' && !quoted) {
+        return index[*k];
+      }
+    }
+    return len;
+  };
+
+  // 扫描开始时 <dblp> 已经打开, 所以层数从 1 开始.
+  int depth = 1;
+  int field = -1;
+  int field_depth = 0;
+  bool dirty = false;
+  uint64_t field_begin = 0;
+  size_t k = 0;
+  while (k < index.size()) {
+    auto i = index[k];
+    if (p[i] != '<') {
+      dirty |= field >= 0 && p[i] == '&';
+      k++;
+      continue;
+    }
+    auto next = i + 1 < len ? p[i + 1] : '\0';
+    if (next == '!' || next == '?') {
+      // 注释, CDATA 或处理指令. DBLP 里基本没有, 只要能跳过就行.
+      uint64_t close = len;
+      if (next == '!' && i + 3 < len && p[i + 2] == '-' && p[i + 3] == '-') {
+        auto e = std::string_view(p + i, len - i).find("-->");
+        close = e == std::string_view::npos ? len : i + e + 2;
+      } else {
+        k++;
+        close = tag_end(&k);
+      }
+      while (k < index.size() && index[k] <= close) {
+        k++;
+      }
+      dirty |= field >= 0;
+      continue;
+    }
+    k++;
+    auto gt = tag_end(&k);
+    k++;
+    if (gt >= len) {
+      break;
+    }
+    if (next == '/') {
+      if (field >= 0 && depth == field_depth) {
+        std::string_view raw(p + field_begin, i - field_begin);
+        auto plain = !dirty && (!latin1 || is_ascii(field_begin, i));
+        on_field(field, plain ? raw : decode(raw));
+        field = -1;
+      } else if (field >= 0) {
+        dirty = true;
+      }
+      depth--;
+      if (depth == 1) {
+        on_record(begin + gt + 1);
+      }
+      continue;
+    }
+    auto empty = p[gt - 1] == '/';
+    if (empty && depth != 1) {
+      dirty |= field >= 0;
+      continue;
+    }
+    depth++;
+    if (field >= 0) {
+      dirty = true;
+      continue;
+    }
+    auto name_end = i + 1;
+    while (name_end < gt && !isspace(static_cast<unsigned char>(p[name_end])) &&
+           p[name_end] != '/') {
+      name_end++;
+    }
+    std::string_view name(p + i + 1, name_end - i - 1);
+    // 顶层元素的属性, 形如 key="...". DBLP 只用双引号.
+    for (auto a = name_end; depth == 2 && a < gt;) {
+      while (a < gt && isspace(static_cast<unsigned char>(p[a]))) {
+        a++;
+      }
+      auto eq = a;
+      while (eq < gt && p[eq] != '=') {
+        eq++;
+      }
+      auto v = eq;
+      while (v < gt && p[v] != '"') {
+        v++;
+      }
+      auto ve = v + 1;
+      while (ve < gt && p[ve] != '"') {
+        ve++;
+      }
+      if (ve >= gt) {
+        break;
+      }
+      std::string_view attr(p + a, eq - a);
+      while (!attr.empty() &&
+             isspace(static_cast<unsigned char>(attr.back()))) {
+        attr.remove_suffix(1);
+      }
+      for (size_t f = 0; f < attrs.size(); f++) {
+        if (attr == attrs[f]) {
+          std::string_view raw(p + v + 1, ve - v - 1);
+          auto plain = raw.find('&') == raw.npos &&
+                       (!latin1 || is_ascii(v + 1, ve));
+          on_field(fields.size() + f, plain ? raw : decode(raw));
+        }
+      }
+      a = ve + 1;
+    }
+    if (empty) {
+      // 自闭合的顶层元素没有字段, 只有属性.
+      depth--;
+      on_record(begin + gt + 1);
+      continue;
+    }
+    for (size_t f = 0; f < fields.size(); f++) {
+      if (name == fields[f]) {
+        field = f;
+        field_depth = depth;
+        field_begin = gt + 1;
+        dirty = false;
+        break;
+      }
+    }
+  }
+}
+
+void DblpScanner::build_index(const char *p, uint64_t len) {
+  index.clear();
+  index.reserve(len / 8);
+  high.clear();
+  high.reserve(len / 64 + 1);
+  char tail[64];
+  for (uint64_t b = 0; b < len; b += 64) {
+    auto block = p + b;
+    if (b + 64 > len) {
+      memset(tail, ' ', sizeof(tail));
+      memcpy(tail, p + b, len - b);
+      block = tail;
+    }
+    auto m = classify_block(block);
+    high.push_back(m.high);
+    auto bits = m.lt | m.gt | m.amp | m.quote;
+    while (bits != 0) {
+      index.push_back(static_cast<uint32_t>(b + __builtin_ctzll(bits)));
+      bits &= bits - 1;
+    }
+  }
+}
+
+bool DblpScanner::is_ascii(uint64_t begin, uint64_t end) const {
+  for (auto i = begin; i < end;) {
+    auto bits = high[i / 64] >> (i % 64);
+    auto n = std::min<uint64_t>(64 - i % 64, end - i);
+    if (n < 64) {
+      bits &= (uint64_t(1) << n) - 1;
+    }
+    if (bits != 0) {
+      return false;
+    }
+    i += n;
+  }
+  return true;
+}
+
+auto DblpScanner::decode(std::string_view raw) -> std::string_view {
+  buffer.clear();
+  for (size_t i = 0; i < raw.size(); i++) {
+    auto c = static_cast<unsigned char>(raw[i]);
+    if (c == '<') {
+      auto e = raw.find('>', i);
+      i = e == raw.npos ? raw.size() : e;
+    } else if (c == '&') {
+      auto e = raw.find(';', i);
+      if (e == raw.npos) {
+        buffer.push_back('&');
+        continue;
+      }
+      decode_entity(raw.substr(i + 1, e - i - 1));
+      i = e;
+    } else if (c >= 0x80 && latin1) {
+      append_utf8(c);
+    } else {
+      buffer.push_back(static_cast<char>(c));
+    }
+  }
+  return buffer;
+}
+
+void DblpScanner::decode_entity(std::string_view name) {
+  if (name.size() > 1 && name[0] == '#') {
+    auto hex = name[1] == 'x' || name[1] == 'X';
+    auto digits = std::string(name.substr(hex ? 2 : 1));
+    if (!digits.empty()) {
+      append_utf8(static_cast<uint32_t>(strtoul(digits.c_str(), nullptr,
+                                                hex ? 16 : 10)));
+    }
+    return;
+  }
+  static const std::pair<const char *, char> predefined[] = {
+      {"amp", '&'}, {"lt", '<'}, {"gt", '>'}, {"quot", '"'}, {"apos", '\''},
+  };
+  for (auto &[n, c] : predefined) {
+    if (name == n) {
+      buffer.push_back(c);
+      return;
+    }
+  }
+}
+
+void DblpScanner::append_utf8(uint32_t c) {
+  if (c < 0x80) {
+    buffer.push_back(static_cast<char>(c));
+  } else if (c < 0x800) {
+    buffer.push_back(static_cast<char>(0xC0 | (c >> 6)));
+    buffer.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+  } else if (c < 0x10000) {
+    buffer.push_back(static_cast<char>(0xE0 | (c >> 12)));
+    buffer.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+    buffer.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+  } else {
+    buffer.push_back(static_cast<char>(0xF0 | (c >> 18)));
+    buffer.push_back(static_cast<char>(0x80 | ((c >> 12) & 0x3F)));
+    buffer.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+    buffer.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+  }
+}
+
+#pragma endregion
+
+};  // namespace ndb
+
+#endif  // INC_DBLP_SCANNER_HH_
@@ -0,0 +1,220 @@
+/**
+ * @file doc_table.hh
+ * @author Selene
+ * @brief 以 DBLP 的 key 属性为键的文档表, 用于增量读取新版本的 DBLP.
+ * @version 0.2
+ * @date 2021-04-17
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef INC_DOC_TABLE_HH_
+#define INC_DOC_TABLE_HH_
+
+#include <fmt/core.h>
+#include <unistd.h>
+
+#include <array>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "author_dict.hh"
+#include "bptree.hh"
+#include "util.hh"
+
+namespace ndb {
+
+/**
+ * @brief 文档表的键, 即 DBLP key 的 Hash 值. Hash 相同时按 ID 排序,
+ * 与 DictKey 相同.
+ *
+ */
+struct DocKey {
+  DocKey() {}
+  DocKey(size_t key, int64_t id) : key(key), id(id) {}
+
+  bool operator<(const DocKey &t) const {
+    return key < t.key || (key == t.key && id < t.id);
+  }
+  bool operator<=(const DocKey &t) const { return !(t < *this); }
+  bool operator==(const DocKey &t) const {
+    return key == t.key && id == t.id;
+  }
+
+  size_t key;
+  int64_t id = -1;
+};
+
+/**
+ * @brief 一篇文档 (一条顶层元素) 在各个表中留下的内容.
+ * 每读入一条数据, 各个表的 ID 都是连续申请的, 所以记录范围就够了.
+ *
+ */
+struct DocRecord {
+  uint64_t digest = 0;    // 所有字段内容的 Hash, 用于判断是否有改动
+  int64_t seen = 0;       // 最后一次出现在第几次 read 中
+  bool removed = false;   // 新版本中已经没有这篇文档
+
+  // title, author 和倒排索引中的 ID 范围 [first, last).
+  std::array<int64_t, 3> first{};
+  std::array<int64_t, 3> last{};
+
+  // 作者在作者字典中的 ID 保存在作者文件的 [authors_first, authors_last) 中.
+  int64_t authors_first = 0;
+  int64_t authors_last = 0;
+
+  char key[64] = {};
+};
+
+class DocTable {
+ public:
+  /**
+   * @brief 初始化. 旧的数据库没有文档表时会新建一个空的.
+   *
+   * @param dname 数据库名.
+   * @param new_file 是否新建文件.
+   */
+  void init_docs(std::string dname, bool new_file);
+
+  /**
+   * @brief 按 DBLP key 查找文档.
+   *
+   * @param key DBLP key.
+   * @param r 查找结果.
+   * @return int64_t 文档的 ID, 找不到时返回 -1.
+   */
+  auto find(std::string_view key, DocRecord *r) -> int64_t;
+
+  /**
+   * @brief 插入一篇新文档.
+   *
+   * @param key DBLP key.
+   * @param r 文档.
+   * @return int64_t 文档的 ID.
+   */
+  auto insert(std::string_view key, DocRecord *r) -> int64_t;
+
+  /**
+   * @brief 改写一篇文档.
+   *
+   */
+  void save(int64_t id, DocRecord *r);
+
+  /**
+   * @brief 读取一篇文档.
+   *
+   */
+  bool recover(int64_t id, DocRecord *r);
+
+  /**
+   * @brief 保存一篇文档的作者在作者字典中的 ID, 结果写进 r.
+   *
+   */
+  void save_authors(const std::vector<author_id> &authors, DocRecord *r);
+
+  /**
+   * @brief 读取一篇文档的作者在作者字典中的 ID.
+   *
+   */
+  auto authors(const DocRecord &r) -> std::vector<author_id>;
+
+  /**
+   * @brief 文档数, 也就是下一个 ID.
+   *
+   */
+  auto size() const -> int64_t { return id; }
+
+  /**
+   * @brief 文档表用到的所有 Pager.
+   *
+   */
+  auto pagers() -> std::vector<std::shared_ptr<Pager>>;
+
+ private:
+  int64_t id = 0;
+  int64_t next_author = 0;
+  std::shared_ptr<ndb::Pager> page_manager;
+  std::shared_ptr<ndb::Pager> record_manager;
+  std::shared_ptr<ndb::Pager> author_manager;
+  std::shared_ptr<ndb::BplusTree<DocKey, 64>> bt;
+  std::hash<std::string_view> hash_fn;
+};
+
+#pragma region  // # DocTable Implementation
+
+void DocTable::init_docs(std::string dname, bool new_file) {
+  auto idx = fmt::format("database/{0}/{0}_doc_idx.bin", dname);
+  auto rec = fmt::format("database/{0}/{0}_doc_rec.bin", dname);
+  auto auth = fmt::format("database/{0}/{0}_doc_auth.bin", dname);
+  new_file = new_file || access(idx.c_str(), 0) != 0;
+  page_manager = std::make_shared<ndb::Pager>(idx, new_file);
+  record_manager = std::make_shared<ndb::Pager>(rec, new_file);
+  author_manager = std::make_shared<ndb::Pager>(auth, new_file);
+  bt = std::make_shared<ndb::BplusTree<DocKey, 64>>(page_manager);
+  DocRecord r;
+  id = record_manager->get_id(&r);
+  author_id a;
+  next_author = author_manager->get_id(&a);
+}
+
+auto DocTable::find(std::string_view key, DocRecord *r) -> int64_t {
+  auto pphash = hash_fn(key);
+  auto iter = bt->find_geq({pphash, -1});
+  // Hash 相同的 key 排在一起, 逐个比较原来的 key.
+  while (iter->id >= 0 && iter->key == pphash) {
+    if (record_manager->recover(iter->id, r) &&
+        key.substr(0, sizeof(r->key) - 1) == r->key) {
+      return iter->id;
+    }
+    iter++;
+  }
+  return -1;
+}
+
+auto DocTable::insert(std::string_view key, DocRecord *r) -> int64_t {
+  snprintf(r->key, sizeof(r->key), "%.*s", static_cast<int>(key.size()),
+           key.data());
+  bt->insert({hash_fn(key), id});
+  record_manager->save(id, r);
+  return id++;
+}
+
+void DocTable::save(int64_t id, DocRecord *r) { record_manager->save(id, r); }
+
+bool DocTable::recover(int64_t id, DocRecord *r) {
+  return record_manager->recover(id, r);
+}
+
+void DocTable::save_authors(const std::vector<author_id> &authors,
+                            DocRecord *r) {
+  r->authors_first = next_author;
+  for (auto a : authors) {
+    author_manager->save(next_author++, &a);
+  }
+  r->authors_last = next_author;
+}
+
+auto DocTable::authors(const DocRecord &r) -> std::vector<author_id> {
+  std::vector<author_id> ret;
+  for (auto i = r.authors_first; i < r.authors_last; i++) {
+    author_id a;
+    if (author_manager->recover(i, &a)) {
+      ret.push_back(a);
+    }
+  }
+  return ret;
+}
+
+auto DocTable::pagers() -> std::vector<std::shared_ptr<Pager>> {
+  return {page_manager, record_manager, author_manager};
+}
+
+#pragma endregion
+
+};  // namespace ndb
+
+#endif  // INC_DOC_TABLE_HH_
@@ -0,0 +1,461 @@
+/**
+ * @file external_sort.hh
+ * @author Selene
+ * @brief 定长记录的外部排序: 内存中并行生成有序段, 再用败者树多路归并.
+ * @version 0.2
+ * @date 2021-04-19
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef INC_EXTERNAL_SORT_HH_
+#define INC_EXTERNAL_SORT_HH_
+
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "util.hh"
+
+namespace ndb {
+
+/**
+ * @brief 败者树. 每个叶子是一路输入的当前元素, 每次取出最小的一路,
+ * 这一路前进之后只需要沿着到根的路径比较 log(k) 次.
+ * 相等的元素按输入的编号排列, 所以归并是稳定的.
+ *
+ * @tparam T 元素类型.
+ * @tparam Compare 比较函数, 与 std::sort 的相同.
+ */
+template <class T, class Compare = std::less<T>>
+class LoserTree {
+ public:
+  /**
+   * @brief 建立败者树.
+   *
+   * @param heads 每一路的当前元素, 为 nullptr 表示这一路已经空了.
+   * @param comp 比较函数.
+   */
+  explicit LoserTree(std::vector<const T *> heads, Compare comp = Compare());
+
+  /**
+   * @brief 最小的元素, 所有输入都空了时返回 nullptr.
+   *
+   */
+  auto top() const -> const T * {
+    return heads.empty() ? nullptr : heads[tree[0]];
+  }
+
+  /**
+   * @brief 最小的元素来自哪一路.
+   *
+   */
+  auto top_index() const -> size_t { return tree[0]; }
+
+  /**
+   * @brief 最小的一路前进之后, 用它的新元素替换原来的并调整.
+   *
+   * @param head 新元素, 为 nullptr 表示这一路已经空了.
+   */
+  void replace_top(const T *head);
+
+ private:
+  // a 是否应该排在 b 前面. k 是建树时使用的哨兵, 比所有元素都小.
+  bool wins(size_t a, size_t b) const;
+
+  // 叶子 s 的元素改变后, 从下往上调整.
+  void adjust(size_t s);
+
+  std::vector<const T *> heads;
+  std::vector<size_t> tree;  // tree[0] 是胜者, 其余是各个内部结点的败者
+  Compare comp;
+};
+
+/**
+ * @brief 顺序读取一个有序段文件. 一次读入一大块, 可以用一个线程预读下一块.
+ *
+ * @tparam T 元素类型.
+ */
+template <class T>
+class RunReader {
+ public:
+  RunReader(std::string file_name, uint64_t block_size, bool prefetch);
+  RunReader(const RunReader &) = delete;
+  auto operator=(const RunReader &) -> RunReader & = delete;
+  ~RunReader();
+
+  /**
+   * @brief 当前元素, 读完时返回 nullptr.
+   *
+   */
+  auto head() const -> const T * {
+    return pos < front.size() ? &front[pos] : nullptr;
+  }
+
+  /**
+   * @brief 前进到下一个元素.
+   *
+   */
+  void next();
+
+ private:
+  void read_block(std::vector<T> *block);
+
+  FILE *file;
+  uint64_t block_size;
+  bool prefetch;
+  std::vector<T> front;
+  std::vector<T> back;
+  std::future<void> pending;
+  size_t pos = 0;
+};
+
+/**
+ * @brief 外部排序. 不断 push 元素, 内存中的元素超过预算就排好序写成
+ * 一个临时的有序段; 最后 finish 把所有有序段归并, 按顺序交给 sink.
+ * 内存中的排序把数据分成 jobs 份并行排序, 再用败者树归并. 排序不保证稳定.
+ *
+ * @tparam T 元素类型, 必须可以直接按字节复制, 比如 Key, IvKey, DictKey.
+ * @tparam Compare 比较函数.
+ */
+template <class T, class Compare = std::less<T>>
+class ExternalSorter {
+  static_assert(std::is_trivially_copyable_v<T>,
+                "ExternalSorter needs trivially copyable records");
+
+ public:
+  // 一次最多归并的有序段数. 段更多时先分组归并, 以免打开太多文件.
+  static constexpr size_t MAX_FAN_IN = 128;
+
+  /**
+   * @brief ExternalSorter 的构造函数.
+   *
+   * @param prefix 临时文件名的前缀, 后面加上 _<n>.run.
+   * @param memory_budget 内存中最多保存的字节数.
+   * @param comp 比较函数.
+   * @param jobs 排序线程数.
+   * @param prefetch 归并时是否预读.
+   */
+  ExternalSorter(std::string prefix, uint64_t memory_budget,
+                 Compare comp = Compare(), int jobs = 1, bool prefetch = true);
+  ExternalSorter(const ExternalSorter &) = delete;
+  auto operator=(const ExternalSorter &) -> ExternalSorter & = delete;
+
+  /**
+   * @brief ExternalSorter 的析构函数, 删除临时文件.
+   *
+   */
+  ~ExternalSorter();
+
+  void push(const T &t);
+
+  /**
+   * @brief 按顺序把所有元素交给 sink. 之后不能再 push.
+   *
+   * @param sink 接受 const T & 的函数.
+   */
+  template <class Sink>
+  void finish(Sink &&sink);
+
+  /**
+   * @brief 已经写出的临时有序段数.
+   *
+   */
+  auto runs() const -> size_t { return run_files.size(); }
+
+ private:
+  // 并行排序 buffer, 再把各份归并交给 sink.
+  template <class Sink>
+  void sort_buffer(Sink &&sink);
+
+  // 把 buffer 排好序写成一个临时有序段.
+  void spill();
+
+  // 新建一个临时有序段, fill 把元素按顺序交给传入的函数.
+  template <class Fill>
+  auto write_run(Fill &&fill) -> std::string;
+
+  // 归并 files 中的有序段, 按顺序交给 sink.
+  template <class Sink>
+  void merge_runs(const std::vector<std::string> &files, Sink &&sink);
+
+  std::string prefix;
+  uint64_t memory_budget;
+  Compare comp;
+  int jobs;
+  bool prefetch;
+  std::vector<T> buffer;
+  std::vector<std::string> run_files;
+  size_t next_run = 0;
+};
+
+#pragma region  // # LoserTree Implementation
+
+template <class T, class Compare>
+LoserTree<T, Compare>::LoserTree(std::vector<const T *> heads, Compare comp)
+    : heads(std::move(heads)), comp(comp) {
+  auto k = this->heads.size();
+  tree.assign(std::max<size_t>(k, 1), k);
+  for (auto s = k; s-- > 0;) {
+    adjust(s);
+  }
+}
+
+template <class T, class Compare>
+void LoserTree<T, Compare>::replace_top(const T *head) {
+  heads[tree[0]] = head;
+  adjust(tree[0]);
+}
+
+template <class T, class Compare>
+bool LoserTree<T, Compare>::wins(size_t a, size_t b) const {
+  auto k = heads.size();
+  if (a == k || b == k) {
+    return a == k;
+  }
+  if (heads[a] == nullptr || heads[b] == nullptr) {
+    return heads[b] == nullptr && (heads[a] != nullptr || a < b);
+  }
+  if (comp(*heads[a], *heads[b])) {
+    return true;
+  }
+  return !comp(*heads[b], *heads[a]) && a < b;
+}
+
+template <class T, class Compare>
+void LoserTree<T, Compare>::adjust(size_t s) {
+  for (auto t = (s + heads.size()) / 2; t > 0; t /= 2) {
+    if (wins(tree[t], s)) {
+      std::swap(s, tree[t]);
+    }
+  }
+  tree[0] = s;
+}
+
+#pragma endregion
+
+#pragma region  // # RunReader Implementation
+
+template <class T>
+RunReader<T>::RunReader(std::string file_name, uint64_t block_size,
+                        bool prefetch)
+    : file(fopen(file_name.c_str(), "rb")),
+      block_size(std::max<uint64_t>(1, block_size / sizeof(T))),
+      prefetch(prefetch) {
+  if (file == nullptr) {
+    throw file_opening_error(file_name);
+  }
+  read_block(&front);
+  if (prefetch) {
+    pending = std::async(std::launch::async, [this] { read_block(&back); });
+  }
+}
+
+template <class T>
+RunReader<T>::~RunReader() {
+  if (pending.valid()) {
+    pending.wait();
+  }
+  fclose(file);
+}
+
+template <class T>
+void RunReader<T>::next() {
+  if (++pos < front.size()) {
+    return;
+  }
+  if (prefetch) {
+    pending.get();
+    std::swap(front, back);
+    if (!front.empty()) {
+      pending = std::async(std::launch::async, [this] { read_block(&back); });
+    }
+  } else {
+    read_block(&front);
+  }
+  pos = 0;
+}
+
+template <class T>
+void RunReader<T>::read_block(std::vector<T> *block) {
+  block->resize(block_size);
+  block->resize(fread(block->data(), sizeof(T), block_size, file));
+}
+
+#pragma endregion
+
+#pragma region  // # ExternalSorter Implementation
+
+template <class T, class Compare>
+ExternalSorter<T, Compare>::ExternalSorter(std::string prefix,
+                                           uint64_t memory_budget,
+                                           Compare comp, int jobs,
+                                           bool prefetch)
+    : prefix(prefix),
+      memory_budget(std::max<uint64_t>(memory_budget, sizeof(T))),
+      comp(comp),
+      jobs(std::max(1, jobs)),
+      prefetch(prefetch) {
+  buffer.reserve(this->memory_budget / sizeof(T));
+}
+
+template <class T, class Compare>
+ExternalSorter<T, Compare>::~ExternalSorter() {
+  for (auto &fn : run_files) {
+    std::remove(fn.c_str());
+  }
+}
+
+template <class T, class Compare>
+void ExternalSorter<T, Compare>::push(const T &t) {
+  buffer.push_back(t);
+  if (buffer.size() * sizeof(T) >= memory_budget) {
+    spill();
+  }
+}
+
+template <class T, class Compare>
+template <class Sink>
+void ExternalSorter<T, Compare>::sort_buffer(Sink &&sink) {
+  // 分成 jobs 份各自排序. 数据太少时多线程不划算.
+  auto parts = buffer.size() < (1 << 16) ? 1 : static_cast<size_t>(jobs);
+  std::vector<std::pair<T *, T *>> ranges;
+  for (size_t i = 0; i < parts; i++) {
+    ranges.push_back({buffer.data() + buffer.size() * i / parts,
+                      buffer.data() + buffer.size() * (i + 1) / parts});
+  }
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < parts; i++) {
+    threads.emplace_back([&, i] {
+      std::sort(ranges[i].first, ranges[i].second, comp);
+    });
+  }
+  std::sort(ranges[0].first, ranges[0].second, comp);
+  for (auto &t : threads) {
+    t.join();
+  }
+  std::vector<const T *> heads;
+  for (auto &[first, last] : ranges) {
+    heads.push_back(first != last ? first : nullptr);
+  }
+  LoserTree<T, Compare> tree(heads, comp);
+  while (auto t = tree.top()) {
+    sink(*t);
+    auto &r = ranges[tree.top_index()];
+    tree.replace_top(++r.first != r.second ? r.first : nullptr);
+  }
+}
+
+template <class T, class Compare>
+void ExternalSorter<T, Compare>::spill() {
+  if (buffer.empty()) {
+    return;
+  }
+  run_files.push_back(write_run([&](auto &&out) { sort_buffer(out); }));
+  buffer.clear();
+}
+
+template <class T, class Compare>
+template <class Fill>
+auto ExternalSorter<T, Compare>::write_run(Fill &&fill) -> std::string {
+  auto fn = fmt::format("{}_{}.run", prefix, next_run++);
+  auto file = fopen(fn.c_str(), "wb");
+  if (file == nullptr) {
+    throw file_opening_error(fn);
+  }
+  std::vector<T> block;
+  block.reserve(std::max<size_t>(1, (1 << 20) / sizeof(T)));
+  // 写不全的段归并时会丢数据, 所以每次写都要检查, 出错时删掉这个段.
+  auto ok = true;
+  auto write_block = [&] {
+    ok = fwrite(block.data(), sizeof(T), block.size(), file) == block.size() &&
+         ok;
+    block.clear();
+  };
+  try {
+    fill([&](const T &t) {
+      block.push_back(t);
+      if (block.size() == block.capacity()) {
+        write_block();
+      }
+    });
+  } catch (...) {
+    fclose(file);
+    std::remove(fn.c_str());
+    throw;
+  }
+  write_block();
+  if (fclose(file) != 0 || !ok) {
+    std::remove(fn.c_str());
+    throw file_io_error(fn);
+  }
+  return fn;
+}
+
+template <class T, class Compare>
+template <class Sink>
+void ExternalSorter<T, Compare>::finish(Sink &&sink) {
+  if (run_files.empty()) {
+    sort_buffer(sink);
+    buffer.clear();
+    return;
+  }
+  spill();
+  buffer.shrink_to_fit();
+  // 相邻的段分在一组, 归并后的段保持原来的先后, 所以结果仍然是稳定的.
+  while (run_files.size() > MAX_FAN_IN) {
+    std::vector<std::string> merged;
+    for (size_t i = 0; i < run_files.size(); i += MAX_FAN_IN) {
+      std::vector<std::string> group(
+          run_files.begin() + i,
+          run_files.begin() + std::min(i + MAX_FAN_IN, run_files.size()));
+      merged.push_back(
+          write_run([&](auto &&out) { merge_runs(group, out); }));
+      for (auto &fn : group) {
+        std::remove(fn.c_str());
+      }
+    }
+    run_files = merged;
+  }
+  merge_runs(run_files, sink);
+}
+
+template <class T, class Compare>
+template <class Sink>
+void ExternalSorter<T, Compare>::merge_runs(
+    const std::vector<std::string> &files, Sink &&sink) {
+  // 预读时每一路有两块, 合起来不超过内存预算.
+  auto block_size = std::max<uint64_t>(
+      64 << 10, memory_budget / (files.size() * (prefetch ? 2 : 1)));
+  std::vector<std::unique_ptr<RunReader<T>>> readers;
+  std::vector<const T *> heads;
+  for (auto &fn : files) {
+    readers.push_back(
+        std::make_unique<RunReader<T>>(fn, block_size, prefetch));
+    heads.push_back(readers.back()->head());
+  }
+  LoserTree<T, Compare> tree(heads, comp);
+  while (auto t = tree.top()) {
+    sink(*t);
+    auto &r = readers[tree.top_index()];
+    r->next();
+    tree.replace_top(r->head());
+  }
+}
+
+#pragma endregion
+
+};  // namespace ndb
+
+#endif  // INC_EXTERNAL_SORT_HH_
@@ -14,18 +14,30 @@
 
 #include <fmt/core.h>
 
+#include <unistd.h>
+
 #include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <filesystem>
 #include <iostream>
 #include <iterator>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
 #include "bptree.hh"
+#include "record_file.hh"
+#include "segment.hh"
+#include "snapshot.hh"
 #include "util.hh"
 
 #define ALL(x) x.begin(), x.end()
@@ -50,40 +62,139 @@ struct IvKey {
 };
 
 /**
- * @brief 倒排索引. 将每个单词的 Hash 值存入 B+ 树中.
+ * @brief 倒排索引, 由若干个段组成. 新插入的单词按 SPIMI 的方式放在内存的
+ * Hash 表里 (单词 -> ID 列表), 占用的内存超过预算就排好序写成一个
+ * 不可变的段 (Segment<IvKey>). 一次 read 结束时把这次写出的段归并成一个.
+ * 后台线程按大小分层合并段: 同一层的段达到 MERGE_FACTOR 个就合并成一个
+ * 更大的段. 查询时在所有段中查找.
+ * 段的列表保存在 _ii_segments.bin 中. 以前版本的 B+ 树 (_ii_idx.bin)
+ * 如果存在, 只读不写, 当作最老的一个段.
+ * 分片的数据库每个分片一个倒排索引, 只索引这个分片的文章,
+ * 接口中的 ID 都是分片内的 ID.
  *
  */
 class InvertedIndex {
   using string_list = std::vector<std::string>;
-  using result_set = std::set<std::pair<u_int32_t, uint32_t>>;
+  using result_set = std::set<std::pair<uint64_t, uint32_t>>;
   using result_set_list = std::vector<result_set>;
+  using segment = Segment<IvKey>;
+  using segment_ptr = std::shared_ptr<segment>;
 
  public:
+  // 分层合并时最低一层的段的元素个数.
+  static constexpr uint64_t TIER_SIZE = 1 << 20;
+  static constexpr uint64_t MERGE_FACTOR = 4;
+
   /**
    * @brief InvertedIndex 的构造函数.
    *
    */
   InvertedIndex();
 
-  void init_ii(std::string iiname, bool new_file);
+  /**
+   * @brief InvertedIndex 的析构函数, 等待后台合并结束.
+   *
+   */
+  ~InvertedIndex();
+
+  /**
+   * @brief 初始化.
+   *
+   * @param iiname 数据库名.
+   * @param new_file 是否新建文件.
+   * @param shard 分片号. 分片 0 沿用不分片时的文件名, 其余的文件名带上分片号.
+   * @param packed Record 文件是否使用压缩格式, 同 RecordFile.
+   */
+  void init_ii(std::string iiname, bool new_file, size_t shard = 0,
+               bool packed = false);
+
+  /**
+   * @brief 把内存中的单词写成一个段. 保存检查点之前必须调用.
+   *
+   */
+  void flush();
+
+  /**
+   * @brief 设置内存中 Hash 表的大小上限.
+   *
+   * @param bytes 字节数.
+   */
+  void set_memory_budget(uint64_t bytes) { memory_budget = bytes; }
+
+  /**
+   * @brief 开始一次建立索引, 之后写出的段都属于这一次.
+   *
+   */
+  void begin_build();
+
+  /**
+   * @brief 把 begin_build 之后写出的段归并成一个段.
+   *
+   */
+  void compact();
 
   /**
    * @brief 从包含若干单词的一条记录建立倒排索引.
    *
-   * @param source 待建立索引的单词列表.
+   * @param source 待建立索引的记录, 按空白切分成单词.
    * @param pos XML 文件中的位置, 作为开始.
    * @param len XML 文件从起始位置开始的长度.
    */
-  void build(string_list source, uint32_t pos, uint32_t len);
+  void build(std::string_view source, uint64_t pos, uint32_t len);
 
   /**
    * @brief 查询索引, 取这些单词索引指向的位置的交集.
    *
    * @param value_list 待查询的单词列表.
+   * @param snap 只返回在这个快照中可见的索引.
    */
-  auto find(string_list value_list)
+  auto find(string_list value_list, const Snapshot &snap)
       -> std::vector<std::pair<Record, std::string>>;
 
+  /**
+   * @brief 倒排索引用到的所有 Pager.
+   *
+   */
+  auto pagers() -> std::vector<std::shared_ptr<Pager>>;
+
+  /**
+   * @brief 已经插入的单词数, 也就是下一个 ID.
+   *
+   */
+  auto size() const -> int64_t;
+
+  /**
+   * @brief 删除 ID 在 [first, last) 中的索引. B+ 树中的键不删除,
+   * 查询时跳过已删除的 Record.
+   *
+   */
+  void erase(int64_t first, int64_t last);
+
+  /**
+   * @brief 把 ID 在 [first, last) 中的索引指向新的位置, publish 之后才可见.
+   *
+   * @return false 如果有 Record 放不进原来的块, 此时没有改写任何一条.
+   */
+  bool update(int64_t first, int64_t last, Record r);
+
+  /**
+   * @brief 发布 update 的改写, 见 RecordFile::publish.
+   *
+   */
+  void publish(uint64_t csn) { record_manager->publish(csn); }
+
+  /**
+   * @brief 把发布过的改写写进文件, 见 RecordFile::retire.
+   *
+   */
+  void retire() { record_manager->retire(); }
+
+  /**
+   * @brief Record 文件, 用于统计占用的空间.
+   *
+   */
+  auto records() -> RecordFile & { return *record_manager; }
+
   Property<std::string> dbname{"null"};
 
  private:
@@ -94,7 +205,7 @@ class InvertedIndex {
    * @param pos XML 文件中的位置, 作为开始.
    * @param len XML 文件从起始位置开始的长度.
    */
-  void insert(std::string key, uint32_t pos, uint32_t len);
+  void insert(std::string_view key, uint64_t pos, uint32_t len);
 
   /**
    * @brief 取一组 result_set 的交集.
@@ -108,15 +219,75 @@ class InvertedIndex {
    * @brief 查询单个单词, 返回查询结果.
    *
    * @param v 待查询的单个单词.
+   * @param snap 快照.
    * @return 查询结果.
    */
-  auto find_single_value(std::string v) -> result_set;
+  auto find_single_value(std::string v, const Snapshot &snap) -> result_set;
+
+  auto segment_file(uint64_t seg_id) -> std::string;
+
+  /**
+   * @brief 把段的列表写进 _ii_segments.bin. 调用时必须持有 mutex.
+   * 先写临时文件再改名, 所以列表中的段文件总是存在的.
+   *
+   */
+  void save_segments();
+
+  /**
+   * @brief 读取段的列表. 崩溃后 RecordFile 会回滚到检查点,
+   * 所以要去掉 id 超出 RecordFile 的元素, 并删掉不在列表中的段文件.
+   *
+   */
+  void load_segments();
+
+  /**
+   * @brief 找出同一层中达到 MERGE_FACTOR 个的段. 调用时必须持有 mutex.
+   *
+   */
+  auto pick_merge() -> std::vector<segment_ptr>;
+
+  /**
+   * @brief 用 merged 替换 inputs, 保存列表后删除 inputs 的文件.
+   * 调用时必须持有 mutex. 正在查询的段由 shared_ptr 保持映射, 不受影响.
+   *
+   */
+  void replace_segments(const std::vector<segment_ptr> &inputs,
+                        segment_ptr merged);
+
+  /**
+   * @brief 后台合并线程.
+   *
+   */
+  void merge_loop();
 
-  int id = 0;
+  /**
+   * @brief 停止后台合并线程.
+   *
+   */
+  void stop_merger();
+
+  std::string name;
+  size_t shard = 0;
+  std::string prefix;  // 这个分片的文件名前缀
   std::shared_ptr<ndb::Pager> page_manager;
-  std::shared_ptr<ndb::Pager> record_manager;
+  std::shared_ptr<ndb::RecordFile> record_manager;
   std::shared_ptr<ndb::BplusTree<IvKey, 64>> bt;
-  std::hash<std::string> hash_fn;
+  // 与 std::hash<std::string> 的结果相同, 但不需要构造 std::string.
+  std::hash<std::string_view> hash_fn;
+
+  // 还没有写出的单词, ID 按插入顺序递增.
+  std::unordered_map<size_t, std::vector<int64_t>> memtable;
+  uint64_t memory_used = 0;
+  uint64_t memory_budget = 64 << 20;
+
+  std::vector<segment_ptr> segments;
+  uint64_t next_segment = 0;
+  uint64_t build_start = 0;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::thread merger;
+  bool merging = false;  // 有线程正在合并, 其余的合并要等待
+  bool stopping = false;
 };
 
 #pragma region  // InvertedIndex
@@ -125,33 +296,146 @@ InvertedIndex::InvertedIndex() {
   //
 }
 
-void InvertedIndex::init_ii(std::string iiname, bool new_file) {
+InvertedIndex::~InvertedIndex() { stop_merger(); }
+
+void InvertedIndex::init_ii(std::string iiname, bool new_file, size_t shard,
+                            bool packed) {
+  stop_merger();
+  name = iiname;
+  this->shard = shard;
+  prefix = shard == 0 ? fmt::format("{0}_ii", iiname)
+                      : fmt::format("{0}_ii{1}", iiname, shard);
   auto idx = fmt::format("database/{0}/{0}_ii_idx.bin", iiname);
-  auto rec = fmt::format("database/{0}/{0}_ii_rec.bin", iiname);
-  page_manager = std::make_shared<ndb::Pager>(idx, new_file);
-  record_manager = std::make_shared<ndb::Pager>(rec, new_file);
-  bt = std::make_shared<ndb::BplusTree<IvKey, 64>>(page_manager);
-  Record s;
-  id = record_manager->get_id(&s);
+  auto rec = fmt::format("database/{0}/{1}_rec.bin", iiname, prefix);
+  page_manager = nullptr;
+  bt = nullptr;
+  // 以前版本的 B+ 树只可能在不分片的数据库中.
+  if (!new_file && shard == 0 && access(idx.c_str(), 0) == 0) {
+    page_manager = std::make_shared<ndb::Pager>(idx, false);
+    bt = std::make_shared<ndb::BplusTree<IvKey, 64>>(page_manager);
+  }
+  record_manager = std::make_shared<ndb::RecordFile>(rec, new_file, packed);
+  memtable.clear();
+  memory_used = 0;
+  segments.clear();
+  next_segment = 0;
+  if (!new_file) {
+    load_segments();
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    save_segments();
+  }
+  stopping = false;
+  merger = std::thread([this] { merge_loop(); });
 }
 
-void InvertedIndex::build(string_list source, uint32_t pos, uint32_t len) {
-  for (int i = 0; i < source.size(); i++) {
-    insert(source[i], pos, len);
+void InvertedIndex::flush() {
+  if (memtable.empty()) {
+    return;
+  }
+  // 只需要给单词排序, 每个单词的 ID 列表本来就是递增的.
+  std::vector<size_t> keys;
+  keys.reserve(memtable.size());
+  for (auto &[key, ids] : memtable) {
+    keys.push_back(key);
+  }
+  std::sort(keys.begin(), keys.end());
+  uint64_t seg_id;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    seg_id = next_segment++;
   }
+  SegmentWriter<IvKey> writer(segment_file(seg_id));
+  for (auto key : keys) {
+    for (auto id : memtable[key]) {
+      writer.push({key, id});
+    }
+  }
+  writer.finish();
+  memtable.clear();
+  memory_used = 0;
+  auto s = std::make_shared<segment>(segment_file(seg_id), seg_id);
+  std::lock_guard<std::mutex> lock(mutex);
+  segments.push_back(s);
+  save_segments();
+  cv.notify_all();
 }
 
-auto InvertedIndex::find(string_list value_list)
-    -> std::vector<std::pair<Record, std::string>> {
-  fmt::print("Search for ");
-  fmt::print(fg(fmt::terminal_color::bright_green), "{}",
-             fmt::join(value_list, " + "));
-  fmt::print(":\n");
+void InvertedIndex::begin_build() {
+  std::lock_guard<std::mutex> lock(mutex);
+  build_start = next_segment;
+}
+
+void InvertedIndex::compact() {
+  flush();
+  std::unique_lock<std::mutex> lock(mutex);
+  cv.wait(lock, [this] { return !merging; });
+  std::vector<segment_ptr> inputs;
+  for (auto &s : segments) {
+    if (s->id() >= build_start) {
+      inputs.push_back(s);
+    }
+  }
+  if (inputs.size() < 2) {
+    return;
+  }
+  merging = true;
+  auto seg_id = next_segment++;
+  lock.unlock();
+  merge_segments<IvKey>(inputs, segment_file(seg_id),
+                        [](const IvKey &) { return true; });
+  auto merged = std::make_shared<segment>(segment_file(seg_id), seg_id);
+  lock.lock();
+  replace_segments(inputs, merged);
+  merging = false;
+  cv.notify_all();
+}
 
+void InvertedIndex::build(std::string_view source, uint64_t pos,
+                          uint32_t len) {
+  size_t i = 0;
+  while (i < source.size()) {
+    while (i < source.size() && isspace(static_cast<uint8_t>(source[i]))) {
+      i++;
+    }
+    auto j = i;
+    while (j < source.size() && !isspace(static_cast<uint8_t>(source[j]))) {
+      j++;
+    }
+    if (j > i) {
+      insert(source.substr(i, j - i), pos, len);
+    }
+    i = j;
+  }
+}
+
+auto InvertedIndex::pagers() -> std::vector<std::shared_ptr<Pager>> {
+  std::vector<std::shared_ptr<Pager>> ret = {record_manager->get_pager()};
+  if (page_manager != nullptr) {
+    ret.push_back(page_manager);
+  }
+  return ret;
+}
+
+auto InvertedIndex::size() const -> int64_t { return record_manager->size(); }
+
+void InvertedIndex::erase(int64_t first, int64_t last) {
+  for (auto i = first; i < last; i++) {
+    record_manager->erase(i);
+  }
+}
+
+bool InvertedIndex::update(int64_t first, int64_t last, Record r) {
+  return record_manager->update(first, last, r);
+}
+
+auto InvertedIndex::find(string_list value_list, const Snapshot &snap)
+    -> std::vector<std::pair<Record, std::string>> {
   // 如需要搜索多个关键字, 应该取它们结果的交集.
   result_set_list result_list;
   for (auto v : value_list) {
-    result_list.push_back(find_single_value(v));
+    result_list.push_back(find_single_value(v, snap));
   }
   auto result_intersection = intersection(result_list);
 
@@ -164,15 +448,17 @@ auto InvertedIndex::find(string_list value_list)
   return results;
 }
 
-void InvertedIndex::insert(std::string key, uint32_t pos, uint32_t len) {
-  std::stringstream in(key);
-  std::string word;
-  while (in >> word) {
-    auto pphash = hash_fn(word);
-    Record r{pos, len};
-    record_manager->save(id, &r);
-    bt->insert({pphash, id});  // fixme
-    id++;
+void InvertedIndex::insert(std::string_view key, uint64_t pos, uint32_t len) {
+  auto pphash = hash_fn(key);
+  auto id = record_manager->append({pos, len});
+  auto [iter, added] = memtable.try_emplace(pphash);
+  auto &ids = iter->second;
+  auto capacity = ids.capacity();
+  ids.push_back(id);
+  // 粗略估计: 每个 Hash 表结点约 64 字节, 加上 ID 列表的容量.
+  memory_used += (added ? 64 : 0) + (ids.capacity() - capacity) * sizeof(id);
+  if (memory_used >= memory_budget) {
+    flush();
   }
 }
 
@@ -193,25 +479,171 @@ auto InvertedIndex::intersection(result_set_list result_list) -> result_set {
   return result_intersection;
 }
 
-auto InvertedIndex::find_single_value(std::string v) -> result_set {
+auto InvertedIndex::find_single_value(std::string v, const Snapshot &snap)
+    -> result_set {
   result_set result;
   auto hash_code = hash_fn(v);
-  IvKey k(hash_code - 1, -1);
-  auto iter = bt->find_geq(k);
-  while (true) {
-    if (iter->key == hash_code) {
-      Record s;
-      record_manager->recover(iter->id, &s);
+  auto add = [&](int64_t id) {
+    Record s;
+    if (snap.visible(2, global_id(shard, id)) &&
+        record_manager->recover(id, &s, snap.csn)) {
       result.insert({s.pos, s.len});
+    }
+  };
+  if (bt != nullptr) {
+    IvKey k(hash_code - 1, -1);
+    auto iter = bt->find_geq(k);
+    while (iter->key == hash_code) {
+      add(iter->id);
       iter++;
-      continue;
     }
-    break;
+  }
+  std::vector<segment_ptr> snapshot;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    snapshot = segments;
+  }
+  // 提交之前总会先 flush, 已提交的索引都在段里, 不用查内存中的 Hash 表.
+  for (auto &s : snapshot) {
+    auto [first, last] = s->equal_range(hash_code);
+    for (auto it = first; it != last; it++) {
+      add(it->id);
+    }
   }
   return result;
 }
 
-InvertedIndex invidx_manager{};
+auto InvertedIndex::segment_file(uint64_t seg_id) -> std::string {
+  return fmt::format("database/{0}/{1}_{2}.seg", name, prefix, seg_id);
+}
+
+void InvertedIndex::save_segments() {
+  auto fn = fmt::format("database/{0}/{1}_segments.bin", name, prefix);
+  auto tmp = fn + ".tmp";
+  auto file = fopen(tmp.c_str(), "wb");
+  if (file == nullptr) {
+    throw file_opening_error(tmp);
+  }
+  uint64_t count = segments.size();
+  fwrite(&next_segment, sizeof(next_segment), 1, file);
+  fwrite(&count, sizeof(count), 1, file);
+  for (auto &s : segments) {
+    auto seg_id = s->id();
+    fwrite(&seg_id, sizeof(seg_id), 1, file);
+  }
+  if (!close_synced(file) || rename(tmp.c_str(), fn.c_str()) != 0) {
+    throw file_io_error(fn);
+  }
+  sync_parent_dir(fn);
+}
+
+void InvertedIndex::load_segments() {
+  auto fn = fmt::format("database/{0}/{1}_segments.bin", name, prefix);
+  auto file = fopen(fn.c_str(), "rb");
+  std::set<std::string> live;
+  if (file != nullptr) {
+    uint64_t count = 0;
+    fread(&next_segment, sizeof(next_segment), 1, file);
+    fread(&count, sizeof(count), 1, file);
+    for (uint64_t i = 0; i < count; i++) {
+      uint64_t seg_id;
+      if (fread(&seg_id, sizeof(seg_id), 1, file) != 1) {
+        break;
+      }
+      segments.push_back(
+          std::make_shared<segment>(segment_file(seg_id), seg_id));
+      live.insert(segment_file(seg_id));
+    }
+    fclose(file);
+  }
+  // 没来得及加入列表的段 (比如合并到一半时崩溃) 直接删掉.
+  // 只看 <prefix>_<数字>.seg, 其他分片的段不归这里管.
+  for (auto &entry : std::filesystem::directory_iterator(
+           fmt::format("database/{}", name))) {
+    auto stem = entry.path().stem().string();
+    auto own = stem.size() > prefix.size() + 1 &&
+               stem.compare(0, prefix.size() + 1, prefix + "_") == 0 &&
+               std::all_of(stem.begin() + prefix.size() + 1, stem.end(),
+                           [](char c) { return isdigit(c) != 0; });
+    if (entry.path().extension() == ".seg" && own &&
+        live.count(fmt::format("database/{}", name) + "/" +
+                   entry.path().filename().string()) == 0) {
+      std::filesystem::remove(entry.path());
+    }
+  }
+  auto limit = record_manager->size();
+  for (auto &s : std::vector<segment_ptr>(segments)) {
+    if (s->max_id() < limit) {
+      continue;
+    }
+    auto seg_id = next_segment++;
+    merge_segments<IvKey>({s}, segment_file(seg_id),
+                          [limit](const IvKey &k) { return k.id < limit; });
+    replace_segments({s}, std::make_shared<segment>(segment_file(seg_id),
+                                                    seg_id));
+  }
+}
+
+auto InvertedIndex::pick_merge() -> std::vector<segment_ptr> {
+  std::map<int, std::vector<segment_ptr>> tiers;
+  for (auto &s : segments) {
+    auto tier = 0;
+    for (auto n = s->size(); n > TIER_SIZE; n /= MERGE_FACTOR) {
+      tier++;
+    }
+    tiers[tier].push_back(s);
+    if (tiers[tier].size() == MERGE_FACTOR) {
+      return tiers[tier];
+    }
+  }
+  return {};
+}
+
+void InvertedIndex::replace_segments(const std::vector<segment_ptr> &inputs,
+                                     segment_ptr merged) {
+  auto pos = std::find(segments.begin(), segments.end(), inputs[0]);
+  *pos = merged;
+  for (auto it = inputs.begin() + 1; it != inputs.end(); it++) {
+    segments.erase(std::find(segments.begin(), segments.end(), *it));
+  }
+  save_segments();
+  for (auto &s : inputs) {
+    std::filesystem::remove(s->file_name());
+  }
+}
+
+void InvertedIndex::merge_loop() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (!stopping) {
+    auto inputs = merging ? std::vector<segment_ptr>() : pick_merge();
+    if (inputs.empty()) {
+      cv.wait(lock);
+      continue;
+    }
+    merging = true;
+    auto seg_id = next_segment++;
+    lock.unlock();
+    merge_segments<IvKey>(inputs, segment_file(seg_id),
+                          [](const IvKey &) { return true; });
+    auto merged = std::make_shared<segment>(segment_file(seg_id), seg_id);
+    lock.lock();
+    replace_segments(inputs, merged);
+    merging = false;
+    cv.notify_all();
+  }
+}
+
+void InvertedIndex::stop_merger() {
+  if (!merger.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  cv.notify_all();
+  merger.join();
+}
 
 #pragma endregion
 
@@ -0,0 +1,226 @@
+/**
+ * @file key_codec.hh
+ * @author Selene
+ * @brief 保序的键编码: 把有类型的键编码成字节串, 之后只用 memcmp 比较.
+ * @version 0.2
+ * @date 2021-04-27
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef INC_KEY_CODEC_HH_
+#define INC_KEY_CODEC_HH_
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+namespace ndb {
+
+/**
+ * @brief 把字节串的前 8 个字节按大端读成整数, 不足 8 个字节的补 0.
+ * 两个缩略键不相等时, 它们的大小就是原来字节串的大小.
+ *
+ */
+inline auto key_abbrev(const void *data, size_t len) -> uint64_t {
+  uint64_t v = 0;
+  memcpy(&v, data, len < 8 ? len : 8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  v = __builtin_bswap64(v);
+#endif
+  return v;
+}
+
+/**
+ * @brief 比较两个编码后的键, 结果与 memcmp 相同 (较短的是前缀时较小).
+ * 先比较缩略键, 大多数键在前 8 个字节就能分出大小.
+ *
+ */
+inline auto key_compare(std::string_view a, std::string_view b) -> int {
+  auto x = key_abbrev(a.data(), a.size());
+  auto y = key_abbrev(b.data(), b.size());
+  if (x != y) {
+    return x < y ? -1 : 1;
+  }
+  auto n = std::min(a.size(), b.size());
+  if (n > 8) {
+    auto c = memcmp(a.data() + 8, b.data() + 8, n - 8);
+    if (c != 0) {
+      return c;
+    }
+  }
+  return a.size() == b.size() ? 0 : (a.size() < b.size() ? -1 : 1);
+}
+
+/**
+ * @brief 把文本规范成定长键的内容: 去掉首尾的空白, 在第一个 '\0' 处截断,
+ * 最多保留 max_len 个字节, 可以把 ASCII 字母折叠成小写.
+ * 规范后的文本写进清零的定长数组, 两个键用 memcmp 比较的结果
+ * 就是两段规范后的文本用 strcmp 比较的结果.
+ *
+ * @param s 文本.
+ * @param max_len 最多保留的字节数, 不含结尾的 '\0'.
+ * @param fold_case 是否不区分大小写.
+ */
+inline auto normalize_key(std::string_view s, size_t max_len,
+                          bool fold_case = false) -> std::string {
+  s = s.substr(0, std::min(s.find('\0'), s.size()));
+  auto space = [](char c) { return isspace(static_cast<unsigned char>(c)); };
+  while (!s.empty() && space(s.front())) {
+    s.remove_prefix(1);
+  }
+  while (!s.empty() && space(s.back())) {
+    s.remove_suffix(1);
+  }
+  std::string ret(s.substr(0, max_len));
+  if (fold_case) {
+    for (auto &c : ret) {
+      c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+    }
+  }
+  return ret;
+}
+
+/**
+ * @brief 保序的键编码器. 依次编码复合键的每一列, 编码结果用 memcmp
+ * 比较的顺序与按列依次比较的顺序相同.
+ * 字符串: 每个 0x00 换成 0x00 0xFF, 最后加上 0x00 0x00, 所以较短的前缀较小,
+ * 后面的列也不会和字符串混在一起. 可以把 ASCII 字母折叠成小写.
+ * 整数: 大端, 有符号数翻转符号位, 负数才会排在正数前面.
+ * 降序的列把编码后的每个字节取反.
+ *
+ */
+class KeyEncoder {
+ public:
+  /**
+   * @brief 编码一个字符串列.
+   *
+   * @param s 字符串.
+   * @param fold_case 是否不区分大小写.
+   * @param descending 是否降序.
+   */
+  auto str(std::string_view s, bool fold_case = false, bool descending = false)
+      -> KeyEncoder & {
+    auto begin = out.size();
+    for (unsigned char c : s) {
+      if (c == 0) {
+        out.push_back('\0');
+        out.push_back('\xff');
+      } else {
+        out.push_back(fold_case ? static_cast<char>(tolower(c))
+                                : static_cast<char>(c));
+      }
+    }
+    out.push_back('\0');
+    out.push_back('\0');
+    if (descending) {
+      invert(begin);
+    }
+    return *this;
+  }
+
+  /**
+   * @brief 编码一个有符号整数列.
+   *
+   */
+  auto i64(int64_t v, bool descending = false) -> KeyEncoder & {
+    return u64(static_cast<uint64_t>(v) ^ (1ULL << 63), descending);
+  }
+
+  /**
+   * @brief 编码一个无符号整数列.
+   *
+   */
+  auto u64(uint64_t v, bool descending = false) -> KeyEncoder & {
+    auto begin = out.size();
+    for (int i = 7; i >= 0; i--) {
+      out.push_back(static_cast<char>((v >> (i * 8)) & 0xff));
+    }
+    if (descending) {
+      invert(begin);
+    }
+    return *this;
+  }
+
+  /**
+   * @brief 编码的结果.
+   *
+   */
+  auto bytes() const -> const std::string & { return out; }
+
+ private:
+  void invert(size_t begin) {
+    for (auto i = begin; i < out.size(); i++) {
+      out[i] = static_cast<char>(~out[i]);
+    }
+  }
+
+  std::string out;
+};
+
+/**
+ * @brief KeyEncoder 的逆过程, 按编码时的顺序依次读出每一列.
+ * 折叠过大小写的字符串读出来是小写的.
+ *
+ */
+class KeyDecoder {
+ public:
+  explicit KeyDecoder(std::string_view bytes) : in(bytes) {}
+
+  /**
+   * @brief 读出一个字符串列.
+   *
+   */
+  auto str(bool descending = false) -> std::string {
+    std::string ret;
+    while (pos < in.size()) {
+      auto c = next(descending);
+      if (c != '\0') {
+        ret.push_back(c);
+      } else if (next(descending) == '\0') {
+        break;
+      } else {
+        ret.push_back('\0');
+      }
+    }
+    return ret;
+  }
+
+  /**
+   * @brief 读出一个有符号整数列.
+   *
+   */
+  auto i64(bool descending = false) -> int64_t {
+    return static_cast<int64_t>(u64(descending) ^ (1ULL << 63));
+  }
+
+  /**
+   * @brief 读出一个无符号整数列.
+   *
+   */
+  auto u64(bool descending = false) -> uint64_t {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) {
+      v = v << 8 | static_cast<unsigned char>(next(descending));
+    }
+    return v;
+  }
+
+ private:
+  auto next(bool descending) -> char {
+    auto c = pos < in.size() ? in[pos] : '\0';
+    pos++;
+    return descending ? static_cast<char>(~c) : c;
+  }
+
+  std::string_view in;
+  size_t pos = 0;
+};
+
+};  // namespace ndb
+
+#endif  // INC_KEY_CODEC_HH_
@@ -0,0 +1,511 @@
+/**
+ * @file kv_store.hh
+ * @author Selene
+ * @brief 通用的嵌入式键值存储, 直接建立在 B+ 树上, 不依赖 XML 和命令行.
+ * 只需要包含这一个头文件 (以及链接 fmt).
+ * @version 0.2
+ * @date 2021-04-28
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef INC_KV_STORE_HH_
+#define INC_KV_STORE_HH_
+
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "bptree.hh"
+#include "key_codec.hh"
+#include "overflow_file.hh"
+#include "util.hh"
+
+namespace ndb {
+
+/**
+ * @brief 键的编码方式. 整数和 std::string 已经实现,
+ * 其他类型 (比如复合键) 可以特化这个模板, 用 KeyEncoder 依次编码每一列.
+ *
+ */
+template <class K, class Enable = void>
+struct KeyTraits;
+
+template <class K>
+struct KeyTraits<K, std::enable_if_t<std::is_integral_v<K>>> {
+  static void encode(const K &k, KeyEncoder *enc) {
+    if constexpr (std::is_signed_v<K>) {
+      enc->i64(k);
+    } else {
+      enc->u64(k);
+    }
+  }
+  static auto decode(KeyDecoder *dec) -> K {
+    if constexpr (std::is_signed_v<K>) {
+      return static_cast<K>(dec->i64());
+    } else {
+      return static_cast<K>(dec->u64());
+    }
+  }
+};
+
+template <>
+struct KeyTraits<std::string> {
+  static void encode(const std::string &k, KeyEncoder *enc) { enc->str(k); }
+  static auto decode(KeyDecoder *dec) -> std::string { return dec->str(); }
+};
+
+/**
+ * @brief 值的存储方式. 可以按字节复制的类型直接放进定长的槽.
+ *
+ */
+template <class V, class Enable = void>
+struct ValueTraits {
+  static_assert(std::is_trivially_copyable_v<V>,
+                "KvStore values are stored as raw bytes");
+
+  using stored = V;
+  using view = const V &;
+  static constexpr bool overflow = false;
+
+  static auto store(const V &v, OverflowFile *) -> stored { return v; }
+  static auto load(const stored &s, OverflowFile *) -> view { return s; }
+};
+
+/**
+ * @brief 变长的值. 不超过 INLINE_SIZE 字节的直接放在槽里,
+ * 更长的追加到溢出文件中, 槽里只记它的位置和长度.
+ * 读出的是 string_view, 长值直接指向映射的溢出文件, 不复制.
+ *
+ */
+template <>
+struct ValueTraits<std::string> {
+  static constexpr size_t INLINE_SIZE = 48;
+
+  struct stored {
+    uint64_t len = 0;
+    uint64_t offset = 0;  // 长值在溢出文件中的偏移
+    char data[INLINE_SIZE] = {};
+  };
+  using view = std::string_view;
+  static constexpr bool overflow = true;
+
+  static auto store(const std::string &v, OverflowFile *file) -> stored {
+    stored s;
+    s.len = v.size();
+    if (v.size() <= INLINE_SIZE) {
+      memcpy(s.data, v.data(), v.size());
+    } else {
+      s.offset = file->append(v);
+    }
+    return s;
+  }
+  static auto load(const stored &s, OverflowFile *file) -> view {
+    if (s.len <= INLINE_SIZE) {
+      return {s.data, s.len};
+    }
+    return file->view(s.offset, s.len);
+  }
+};
+
+/**
+ * @brief 一批写操作, 由 KvStore::write 一起执行.
+ *
+ */
+template <class K, class V>
+class WriteBatch {
+ public:
+  void put(const K &key, const V &value) { ops.push_back({key, value, true}); }
+  void erase(const K &key) { ops.push_back({key, V(), false}); }
+  void clear() { ops.clear(); }
+  auto size() const -> size_t { return ops.size(); }
+
+ private:
+  template <class X, class Y, size_t Z>
+  friend class KvStore;
+
+  struct Op {
+    K key;
+    V value;
+    bool put;
+  };
+  std::vector<Op> ops;
+};
+
+/**
+ * @brief 有类型的键值存储.
+ * 键和值分开存放: 键用 KeyTraits 编码后放在写时复制的 B+ 树 (path.idx) 中,
+ * 树里只记值的槽号; 值放在定长槽组成的文件 (path.val) 中, 槽的大小由
+ * ValueTraits<V> 决定. V 为 std::string 时, 长值放在溢出文件 (path.ovf) 中.
+ * 改写已有的键只改写它的槽, 不动 B+ 树.
+ * B+ 树不能删除, 删除只是把槽标记为空, 这个键以后再写入时沿用原来的槽.
+ * 同一时刻只能有一个线程使用.
+ *
+ * @tparam K 键的类型, 需要有 KeyTraits<K>.
+ * @tparam V 值的类型, 可以按字节复制或者是 std::string.
+ * @tparam KEY_SIZE 编码后的键最多的字节数.
+ */
+template <class K, class V, size_t KEY_SIZE = 64>
+class KvStore {
+ public:
+  using value_view = typename ValueTraits<V>::view;
+  using visitor = std::function<bool(const K &, value_view)>;
+
+  /**
+   * @brief 打开或新建一个键值存储.
+   *
+   * @param path 文件名前缀.
+   * @param new_file 是否新建文件.
+   */
+  explicit KvStore(std::string path, bool new_file = false);
+
+  /**
+   * @brief 关闭前把缓冲区写回文件.
+   *
+   */
+  ~KvStore() { sync(); }
+
+  /**
+   * @brief 读取一个键的值.
+   *
+   * @return false 如果键不存在.
+   */
+  bool get(const K &key, V *value);
+
+  /**
+   * @brief 不复制地读取一个键的值. 传给 f 的值只在 f 中有效.
+   *
+   * @return false 如果键不存在.
+   */
+  bool view(const K &key, const std::function<void(value_view)> &f);
+
+  /**
+   * @brief 写入一个键值对, 键已经存在时覆盖原来的值.
+   *
+   */
+  void put(const K &key, const V &value);
+
+  /**
+   * @brief 删除一个键.
+   *
+   * @return false 如果键不存在.
+   */
+  bool erase(const K &key);
+
+  /**
+   * @brief 执行一批写操作. 新的键在同一个 B+ 树事务中插入, 最后只写回一次.
+   *
+   */
+  void write(const WriteBatch<K, V> &batch);
+
+  /**
+   * @brief 写入 [first, last) 中所有的键值对, 元素为 std::pair<K, V>.
+   *
+   */
+  template <class It>
+  void put_all(It first, It last);
+
+  /**
+   * @brief 读取 [first, last) 中所有键的值, 依次写到 out.
+   * 不存在的键跳过.
+   *
+   * @return 读到的个数.
+   */
+  template <class It, class Out>
+  auto get_all(It first, It last, Out out) -> size_t;
+
+  /**
+   * @brief 按键的顺序访问所有键值对.
+   *
+   * @param visit 返回 false 时停止.
+   */
+  void scan(const visitor &visit);
+
+  /**
+   * @brief 按键的顺序访问键在 [lo, hi) 中的键值对.
+   *
+   * @param visit 返回 false 时停止.
+   */
+  void scan(const K &lo, const K &hi, const visitor &visit);
+
+  /**
+   * @brief 把缓冲区写回文件.
+   *
+   */
+  void sync();
+
+ private:
+  struct Entry {
+    Entry() {}
+    explicit Entry(int64_t id) : id(id) {}
+
+    bool operator<(const Entry &t) const { return compare(t) < 0; }
+    bool operator<=(const Entry &t) const { return compare(t) <= 0; }
+    bool operator==(const Entry &t) const { return compare(t) == 0; }
+    auto compare(const Entry &t) const -> int {
+      return key_compare({key, KEY_SIZE}, {t.key, KEY_SIZE});
+    }
+
+    char key[KEY_SIZE] = {};
+    int64_t id = -1;  // 值的槽号
+  };
+  struct Slot {
+    int64_t live = 0;
+    typename ValueTraits<V>::stored value{};
+  };
+  struct EncodedOp {
+    Entry entry;
+    V value;
+    bool put;
+  };
+
+  /**
+   * @brief 编码一个键.
+   *
+   */
+  auto encode(const K &key) const -> Entry;
+
+  /**
+   * @brief 在 B+ 树中找到键的槽号.
+   *
+   * @return 不存在时返回 -1.
+   */
+  auto find(const Entry &e) -> int64_t;
+
+  /**
+   * @brief 写入一个键值对, 不提交 B+ 树的事务.
+   *
+   */
+  void put_entry(const Entry &e, const V &value);
+
+  /**
+   * @brief 删除一个编码后的键.
+   *
+   */
+  bool erase_entry(const Entry &e);
+
+  /**
+   * @brief 在一个 B+ 树事务中执行一批写操作.
+   *
+   */
+  void apply(const std::vector<EncodedOp> &ops);
+
+  std::shared_ptr<Pager> key_manager;
+  std::shared_ptr<Pager> value_manager;
+  std::unique_ptr<OverflowFile> overflow;
+  std::shared_ptr<BplusTree<Entry, 64>> bt;
+  int64_t next_slot = 0;
+  // 当前事务中新插入的键. 提交之前查询读的是旧的根, 看不到它们.
+  std::map<std::string, int64_t, std::less<>> pending;
+  bool in_batch = false;
+};
+
+#pragma region  // # KvStore Implementation
+
+template <class K, class V, size_t KEY_SIZE>
+KvStore<K, V, KEY_SIZE>::KvStore(std::string path, bool new_file)
+    : key_manager(std::make_shared<Pager>(path + ".idx", new_file)),
+      value_manager(std::make_shared<Pager>(path + ".val", new_file)) {
+  // 写时复制的树只在提交时改写文件头, 崩溃后总能回到最近一次提交的状态.
+  bt = std::make_shared<BplusTree<Entry, 64>>(key_manager, true);
+  if (ValueTraits<V>::overflow) {
+    overflow = std::make_unique<OverflowFile>(path + ".ovf", new_file);
+  }
+  Slot s;
+  next_slot = value_manager->get_id(&s);
+}
+
+template <class K, class V, size_t KEY_SIZE>
+bool KvStore<K, V, KEY_SIZE>::get(const K &key, V *value) {
+  auto id = find(encode(key));
+  Slot s;
+  if (id < 0 || !value_manager->recover(id, &s) || !s.live) {
+    return false;
+  }
+  *value = V(ValueTraits<V>::load(s.value, overflow.get()));
+  return true;
+}
+
+template <class K, class V, size_t KEY_SIZE>
+bool KvStore<K, V, KEY_SIZE>::view(const K &key,
+                                   const std::function<void(value_view)> &f) {
+  auto id = find(encode(key));
+  Slot s;
+  if (id < 0 || !value_manager->recover(id, &s) || !s.live) {
+    return false;
+  }
+  f(ValueTraits<V>::load(s.value, overflow.get()));
+  return true;
+}
+
+template <class K, class V, size_t KEY_SIZE>
+void KvStore<K, V, KEY_SIZE>::put(const K &key, const V &value) {
+  put_entry(encode(key), value);
+}
+
+template <class K, class V, size_t KEY_SIZE>
+bool KvStore<K, V, KEY_SIZE>::erase(const K &key) {
+  return erase_entry(encode(key));
+}
+
+template <class K, class V, size_t KEY_SIZE>
+bool KvStore<K, V, KEY_SIZE>::erase_entry(const Entry &e) {
+  auto id = find(e);
+  Slot s;
+  if (id < 0 || !value_manager->recover(id, &s) || !s.live) {
+    return false;
+  }
+  s.live = 0;
+  value_manager->save(id, &s);
+  return true;
+}
+
+template <class K, class V, size_t KEY_SIZE>
+void KvStore<K, V, KEY_SIZE>::write(const WriteBatch<K, V> &batch) {
+  std::vector<EncodedOp> ops;
+  for (auto &op : batch.ops) {
+    ops.push_back({encode(op.key), op.value, op.put});
+  }
+  apply(ops);
+}
+
+template <class K, class V, size_t KEY_SIZE>
+template <class It>
+void KvStore<K, V, KEY_SIZE>::put_all(It first, It last) {
+  std::vector<EncodedOp> ops;
+  for (auto it = first; it != last; it++) {
+    ops.push_back({encode(it->first), it->second, true});
+  }
+  apply(ops);
+}
+
+template <class K, class V, size_t KEY_SIZE>
+template <class It, class Out>
+auto KvStore<K, V, KEY_SIZE>::get_all(It first, It last, Out out) -> size_t {
+  size_t cnt = 0;
+  V v;
+  for (auto it = first; it != last; it++) {
+    if (get(*it, &v)) {
+      *out++ = v;
+      cnt++;
+    }
+  }
+  return cnt;
+}
+
+template <class K, class V, size_t KEY_SIZE>
+void KvStore<K, V, KEY_SIZE>::scan(const visitor &visit) {
+  Slot s;
+  for (auto iter = bt->begin(); iter->id >= 0; iter++) {
+    if (value_manager->recover(iter->id, &s) && s.live) {
+      KeyDecoder dec({iter->key, KEY_SIZE});
+      if (!visit(KeyTraits<K>::decode(&dec),
+                 ValueTraits<V>::load(s.value, overflow.get()))) {
+        return;
+      }
+    }
+  }
+}
+
+template <class K, class V, size_t KEY_SIZE>
+void KvStore<K, V, KEY_SIZE>::scan(const K &lo, const K &hi,
+                                   const visitor &visit) {
+  auto end = encode(hi);
+  Slot s;
+  for (auto iter = bt->find_geq(encode(lo)); iter->id >= 0 && *iter < end;
+       iter++) {
+    if (value_manager->recover(iter->id, &s) && s.live) {
+      KeyDecoder dec({iter->key, KEY_SIZE});
+      if (!visit(KeyTraits<K>::decode(&dec),
+                 ValueTraits<V>::load(s.value, overflow.get()))) {
+        return;
+      }
+    }
+  }
+}
+
+template <class K, class V, size_t KEY_SIZE>
+void KvStore<K, V, KEY_SIZE>::sync() {
+  // 槽里记着长值的位置, 所以先写溢出文件.
+  if (overflow != nullptr) {
+    overflow->sync();
+  }
+  value_manager->sync();
+  key_manager->sync();
+}
+
+template <class K, class V, size_t KEY_SIZE>
+auto KvStore<K, V, KEY_SIZE>::encode(const K &key) const -> Entry {
+  KeyEncoder enc;
+  KeyTraits<K>::encode(key, &enc);
+  auto &bytes = enc.bytes();
+  if (bytes.size() > KEY_SIZE) {
+    throw key_too_long(bytes.size(), KEY_SIZE);
+  }
+  Entry e;
+  memcpy(e.key, bytes.data(), bytes.size());
+  return e;
+}
+
+template <class K, class V, size_t KEY_SIZE>
+auto KvStore<K, V, KEY_SIZE>::find(const Entry &e) -> int64_t {
+  // 树的末尾是 id 为 -1 的空结点, 所以要先看 id 再比较键.
+  auto p = pending.find(std::string_view(e.key, KEY_SIZE));
+  if (p != pending.end()) {
+    return p->second;
+  }
+  auto iter = bt->find_geq(e);
+  return iter->id >= 0 && *iter == e ? iter->id : -1;
+}
+
+template <class K, class V, size_t KEY_SIZE>
+void KvStore<K, V, KEY_SIZE>::put_entry(const Entry &e, const V &value) {
+  Slot s;
+  s.live = 1;
+  s.value = ValueTraits<V>::store(value, overflow.get());
+  auto id = find(e);
+  if (id >= 0) {
+    value_manager->save(id, &s);
+    return;
+  }
+  // 先写值再插入键, 中途崩溃只会留下一个没有键指向的槽.
+  auto entry = e;
+  entry.id = next_slot++;
+  value_manager->save(entry.id, &s);
+  bt->insert(entry);
+  if (in_batch) {
+    pending.emplace(std::string(e.key, KEY_SIZE), entry.id);
+  }
+}
+
+template <class K, class V, size_t KEY_SIZE>
+void KvStore<K, V, KEY_SIZE>::apply(
+    const std::vector<EncodedOp> &ops) {
+  // 键都已经编码过, 下面不会因为键太长中途失败.
+  bt->begin_write();
+  in_batch = true;
+  for (auto &op : ops) {
+    if (op.put) {
+      put_entry(op.entry, op.value);
+    } else {
+      erase_entry(op.entry);
+    }
+  }
+  bt->commit();
+  in_batch = false;
+  pending.clear();
+  sync();
+}
+
+#pragma endregion
+
+};  // namespace ndb
+
+#endif  // INC_KV_STORE_HH_
@@ -0,0 +1,659 @@
+/**
+ * @file lsm.hh
+ * @author Selene
+ * @brief 基于 LSM 树的存储引擎: 内存表, 带块索引和 Bloom 过滤器的有序文件,
+ * 以及后台的分级合并.
+ * @version 0.2
+ * @date 2021-04-24
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef INC_LSM_HH_
+#define INC_LSM_HH_
+
+#include <fmt/core.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "external_sort.hh"
+#include "storage_engine.hh"
+#include "util.hh"
+
+namespace ndb {
+
+/**
+ * @brief 一个写好之后就不再修改的有序文件, 通过 mmap 读取.
+ * 文件中依次是 Header, count 个元素, 每块的第一个元素 (块索引),
+ * 以及 Bloom 过滤器. Bloom 过滤器记录的是每个 key 的前 BLOOM_PREFIX 个字节,
+ * 所以前缀不短于 BLOOM_PREFIX 的查询可以跳过不含这个前缀的文件.
+ *
+ * @tparam T 元素类型, 必须可以直接按字节复制.
+ */
+template <class T>
+class SortedRun {
+ public:
+  struct Header {
+    uint64_t count = 0;
+    uint64_t blocks = 0;
+    uint64_t bloom_words = 0;
+    int64_t max_id = -1;  // 所有元素中最大的 id
+  };
+  static constexpr uint64_t BLOCK_SIZE = 64;
+  static constexpr size_t BLOOM_PREFIX = 8;
+  static constexpr int BLOOM_HASHES = 6;
+
+  /**
+   * @brief 打开一个已经写好的文件.
+   *
+   * @param file_name 文件名.
+   * @param run_id 文件的编号.
+   */
+  SortedRun(std::string file_name, uint64_t run_id);
+
+  auto begin() const -> const T * {
+    return reinterpret_cast<const T *>(file.data() + sizeof(Header));
+  }
+  auto end() const -> const T * { return begin() + header.count; }
+  auto size() const -> uint64_t { return header.count; }
+  auto max_id() const -> int64_t { return header.max_id; }
+  auto id() const -> uint64_t { return run_id; }
+  auto file_name() const -> const std::string & { return name; }
+
+  /**
+   * @brief 第一个 key 不小于 prefix 的元素. 先在块索引中找到所在的块,
+   * 再在块内二分.
+   *
+   */
+  auto seek(std::string_view prefix) const -> const T *;
+
+  /**
+   * @brief 文件中可能有 key 以 prefix 开头的元素.
+   *
+   */
+  bool may_contain(std::string_view prefix) const;
+
+  /**
+   * @brief Bloom 过滤器使用的 Hash 值, 即 key 的前 BLOOM_PREFIX 个字节的 Hash.
+   *
+   */
+  static auto bloom_hash(std::string_view key) -> uint64_t {
+    return std::hash<std::string_view>()(key.substr(0, BLOOM_PREFIX));
+  }
+
+  /**
+   * @brief Hash 值 h 在 bits 位的过滤器中对应的第 i 位.
+   *
+   */
+  static auto bloom_bit(uint64_t h, int i, uint64_t bits) -> uint64_t {
+    return (h + i * ((h >> 17 | h << 47) | 1)) % bits;
+  }
+
+ private:
+  auto index() const -> const T * { return end(); }
+  auto bloom() const -> const uint64_t * {
+    return reinterpret_cast<const uint64_t *>(index() + header.blocks);
+  }
+
+  std::string name;
+  uint64_t run_id;
+  MappedFile file;
+  Header header;
+};
+
+/**
+ * @brief 顺序写出一个 SortedRun. 元素必须已经排好.
+ *
+ * @tparam T 元素类型.
+ */
+template <class T>
+class RunWriter {
+ public:
+  /**
+   * @brief 开始写一个文件.
+   *
+   * @param file_name 文件名.
+   * @param expected 预计的元素个数, 用来决定 Bloom 过滤器的大小.
+   */
+  RunWriter(std::string file_name, uint64_t expected);
+  RunWriter(const RunWriter &) = delete;
+  auto operator=(const RunWriter &) -> RunWriter & = delete;
+  ~RunWriter();
+
+  void push(const T &t);
+
+  /**
+   * @brief 写完所有元素后调用, 补上块索引, Bloom 过滤器和文件头.
+   *
+   */
+  void finish();
+
+ private:
+  std::string file_name;
+  FILE *file;
+  typename SortedRun<T>::Header header;
+  std::vector<T> buffer;
+  std::vector<T> index;
+  std::vector<uint64_t> bloom;
+};
+
+/**
+ * @brief LSM 树存储引擎. 插入先放在内存表中, 内存表满了或者提交时排好序
+ * 写成 0 层的一个文件. 0 层的文件达到 L0_RUNS 个就和 1 层合并;
+ * 第 i 层 (i >= 1) 只有一个文件, 超过 LEVEL_BASE * LEVEL_RATIO^(i-1) 个元素
+ * 就合并到下一层. 合并在后台线程中进行.
+ * 文件的列表保存在 <prefix>.lsm 中. 文件不走回滚日志, 打开时去掉 id 超出
+ * RecordFile 的元素, 和倒排索引的段一样.
+ *
+ * @tparam T 元素类型, 同 StorageEngine.
+ */
+template <class T>
+class LsmEngine : public StorageEngine<T> {
+  using run = SortedRun<T>;
+  using run_ptr = std::shared_ptr<run>;
+
+ public:
+  using visitor = typename StorageEngine<T>::visitor;
+
+  // 内存表的大小上限 (字节), 每个元素估计多用 32 字节的树结点.
+  static constexpr uint64_t MEMTABLE_SIZE = 16 << 20;
+  static constexpr uint64_t L0_RUNS = 4;
+  static constexpr uint64_t LEVEL_BASE = 1 << 16;
+  static constexpr uint64_t LEVEL_RATIO = 10;
+
+  /**
+   * @brief 打开或新建 LSM 树.
+   *
+   * @param prefix 文件名的前缀.
+   * @param new_file 是否新建文件.
+   * @param limit id 不小于 limit 的元素是检查点之后写入的, 打开时去掉.
+   */
+  LsmEngine(std::string prefix, bool new_file, int64_t limit);
+  ~LsmEngine() override;
+
+  /**
+   * @brief 插入一个元素. 事务之外的插入也先攒在内存表中,
+   * 内存表满了, 下一次 commit 或者关闭时才写出并可见.
+   *
+   */
+  void insert(const T &value) override;
+  void scan(std::string_view prefix, const visitor &visit) override;
+  void begin_write() override { in_txn = true; }
+  void commit() override;
+
+ private:
+  /**
+   * @brief 把内存表写成一个文件, 提交之前放在 staged 中.
+   *
+   */
+  void flush();
+
+  auto run_file(uint64_t id) const -> std::string;
+
+  /**
+   * @brief 保存文件的列表. 调用时必须持有 mutex.
+   *
+   */
+  void save_manifest();
+
+  /**
+   * @brief 读取文件的列表, 删掉不在列表中的文件, 并截断超出 limit 的元素.
+   *
+   */
+  void load_manifest(int64_t limit);
+
+  /**
+   * @brief 找出需要合并的文件, 以及合并到哪一层. 调用时必须持有 mutex.
+   * 返回的文件按从新到旧排列.
+   *
+   */
+  auto pick_compaction(size_t *target) -> std::vector<run_ptr>;
+
+  /**
+   * @brief 把 inputs 合并写进文件 file_name.
+   *
+   */
+  template <class Keep>
+  void merge(const std::vector<run_ptr> &inputs, std::string file_name,
+             Keep &&keep);
+
+  /**
+   * @brief 用 merged 替换 inputs, 放在第 level 层. 调用时必须持有 mutex.
+   *
+   */
+  void install(const std::vector<run_ptr> &inputs, size_t level,
+               run_ptr merged);
+
+  void compact_loop();
+  void stop_compactor();
+
+  std::string file_prefix;
+  std::multiset<T> memtable;
+  std::vector<run_ptr> staged;  // 当前事务中写出, 还没有提交的文件
+  bool in_txn = false;
+
+  // levels[0] 是 0 层, 从新到旧排列. 其余各层最多一个文件.
+  std::vector<std::vector<run_ptr>> levels;
+  uint64_t next_run = 0;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::thread compactor;
+  bool compacting = false;
+  bool stopping = false;
+};
+
+#pragma region  // # SortedRun Implementation
+
+template <class T>
+SortedRun<T>::SortedRun(std::string file_name, uint64_t run_id)
+    : name(file_name), run_id(run_id), file(file_name) {
+  if (file.size() < sizeof(Header)) {
+    throw database_opening_error(file_name);
+  }
+  memcpy(&header, file.data(), sizeof(Header));
+}
+
+template <class T>
+auto SortedRun<T>::seek(std::string_view prefix) const -> const T * {
+  T k(-1);
+  snprintf(k.key, sizeof(k.key), "%.*s", static_cast<int>(prefix.size()),
+           prefix.data());
+  // 第一个首元素不小于 k 的块, 答案在它前一块中, 或者就是它的首元素.
+  auto b = std::lower_bound(index(), index() + header.blocks, k) - index();
+  auto first = begin() + std::max<int64_t>(b - 1, 0) * BLOCK_SIZE;
+  auto last = std::min(end(), begin() + b * BLOCK_SIZE);
+  return std::lower_bound(first, last, k);
+}
+
+template <class T>
+bool SortedRun<T>::may_contain(std::string_view prefix) const {
+  if (prefix.size() < BLOOM_PREFIX || header.bloom_words == 0) {
+    return true;
+  }
+  auto h = bloom_hash(prefix);
+  auto bits = header.bloom_words * 64;
+  for (int i = 0; i < BLOOM_HASHES; i++) {
+    auto bit = bloom_bit(h, i, bits);
+    if ((bloom()[bit / 64] >> (bit % 64) & 1) == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+#pragma endregion
+
+#pragma region  // # RunWriter Implementation
+
+template <class T>
+RunWriter<T>::RunWriter(std::string file_name, uint64_t expected)
+    : file_name(file_name), file(fopen(file_name.c_str(), "wb")) {
+  if (file == nullptr) {
+    throw file_opening_error(file_name);
+  }
+  fwrite(&header, sizeof(header), 1, file);
+  buffer.reserve((1 << 20) / sizeof(T));
+  // 每个元素 10 位, 误判率约为 1%.
+  bloom.resize((expected * 10 + 63) / 64 + 1);
+}
+
+template <class T>
+RunWriter<T>::~RunWriter() {
+  if (file != nullptr) {
+    fclose(file);
+  }
+}
+
+template <class T>
+void RunWriter<T>::push(const T &t) {
+  if (header.count % SortedRun<T>::BLOCK_SIZE == 0) {
+    index.push_back(t);
+  }
+  auto h = SortedRun<T>::bloom_hash({t.key, strnlen(t.key, sizeof(t.key))});
+  for (int i = 0; i < SortedRun<T>::BLOOM_HASHES; i++) {
+    auto bit = SortedRun<T>::bloom_bit(h, i, bloom.size() * 64);
+    bloom[bit / 64] |= uint64_t(1) << (bit % 64);
+  }
+  buffer.push_back(t);
+  header.count++;
+  header.max_id = std::max<int64_t>(header.max_id, t.id);
+  if (buffer.size() == buffer.capacity()) {
+    fwrite(buffer.data(), sizeof(T), buffer.size(), file);
+    buffer.clear();
+  }
+}
+
+template <class T>
+void RunWriter<T>::finish() {
+  fwrite(buffer.data(), sizeof(T), buffer.size(), file);
+  buffer.clear();
+  header.blocks = index.size();
+  header.bloom_words = bloom.size();
+  fwrite(index.data(), sizeof(T), index.size(), file);
+  fwrite(bloom.data(), sizeof(uint64_t), bloom.size(), file);
+  fseeko(file, 0, SEEK_SET);
+  fwrite(&header, sizeof(header), 1, file);
+  // 清单引用它之前必须落盘. 目录由 save_manifest 一起落盘.
+  auto ok = close_synced(file);
+  file = nullptr;
+  if (!ok) {
+    throw file_io_error(file_name);
+  }
+}
+
+#pragma endregion
+
+#pragma region  // # LsmEngine Implementation
+
+template <class T>
+LsmEngine<T>::LsmEngine(std::string prefix, bool new_file, int64_t limit)
+    : file_prefix(prefix) {
+  levels.resize(2);
+  if (!new_file) {
+    load_manifest(limit);
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    save_manifest();
+  }
+  compactor = std::thread([this] { compact_loop(); });
+}
+
+template <class T>
+LsmEngine<T>::~LsmEngine() {
+  stop_compactor();
+  // 没有提交的事务丢弃, 事务之外攒下的插入写出.
+  if (!in_txn && !memtable.empty()) {
+    commit();
+  }
+}
+
+template <class T>
+void LsmEngine<T>::insert(const T &value) {
+  memtable.insert(value);
+  if (memtable.size() * (sizeof(T) + 32) >= MEMTABLE_SIZE) {
+    if (in_txn) {
+      flush();
+    } else {
+      commit();
+    }
+  }
+}
+
+template <class T>
+void LsmEngine<T>::flush() {
+  if (memtable.empty()) {
+    return;
+  }
+  uint64_t run_id;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    run_id = next_run++;
+  }
+  RunWriter<T> writer(run_file(run_id), memtable.size());
+  for (auto &t : memtable) {
+    writer.push(t);
+  }
+  writer.finish();
+  memtable.clear();
+  staged.push_back(std::make_shared<run>(run_file(run_id), run_id));
+}
+
+template <class T>
+void LsmEngine<T>::commit() {
+  in_txn = false;
+  flush();
+  if (staged.empty()) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  levels[0].insert(levels[0].begin(), staged.rbegin(), staged.rend());
+  staged.clear();
+  save_manifest();
+  cv.notify_all();
+}
+
+template <class T>
+void LsmEngine<T>::scan(std::string_view prefix, const visitor &visit) {
+  std::vector<run_ptr> runs;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto &level : levels) {
+      runs.insert(runs.end(), level.begin(), level.end());
+    }
+  }
+  // 每个文件中以 prefix 开头的元素是连续的一段, 把这些段归并起来.
+  std::vector<std::pair<const T *, const T *>> ranges;
+  std::vector<const T *> heads;
+  for (auto &r : runs) {
+    if (!r->may_contain(prefix)) {
+      continue;
+    }
+    auto first = r->seek(prefix);
+    auto last = std::partition_point(
+        first, r->end(), [prefix](const T &t) { return has_prefix(t, prefix); });
+    ranges.push_back({first, last});
+    heads.push_back(first != last ? first : nullptr);
+  }
+  LoserTree<T> tree(heads);
+  while (auto t = tree.top()) {
+    if (!visit(*t)) {
+      return;
+    }
+    auto &r = ranges[tree.top_index()];
+    tree.replace_top(++r.first != r.second ? r.first : nullptr);
+  }
+}
+
+template <class T>
+auto LsmEngine<T>::run_file(uint64_t id) const -> std::string {
+  return fmt::format("{}_{}.run", file_prefix, id);
+}
+
+template <class T>
+void LsmEngine<T>::save_manifest() {
+  auto fn = file_prefix + ".lsm";
+  auto tmp = fn + ".tmp";
+  auto file = fopen(tmp.c_str(), "wb");
+  if (file == nullptr) {
+    throw file_opening_error(tmp);
+  }
+  uint64_t count = levels.size();
+  fwrite(&next_run, sizeof(next_run), 1, file);
+  fwrite(&count, sizeof(count), 1, file);
+  for (auto &level : levels) {
+    count = level.size();
+    fwrite(&count, sizeof(count), 1, file);
+    for (auto &r : level) {
+      auto run_id = r->id();
+      fwrite(&run_id, sizeof(run_id), 1, file);
+    }
+  }
+  if (!close_synced(file) || rename(tmp.c_str(), fn.c_str()) != 0) {
+    throw file_io_error(fn);
+  }
+  sync_parent_dir(fn);
+}
+
+template <class T>
+void LsmEngine<T>::load_manifest(int64_t limit) {
+  auto file = fopen((file_prefix + ".lsm").c_str(), "rb");
+  std::set<std::string> live;
+  if (file != nullptr) {
+    uint64_t count = 0;
+    fread(&next_run, sizeof(next_run), 1, file);
+    fread(&count, sizeof(count), 1, file);
+    levels.resize(std::max<uint64_t>(count, 2));
+    for (uint64_t i = 0; i < count; i++) {
+      uint64_t runs = 0;
+      fread(&runs, sizeof(runs), 1, file);
+      for (uint64_t j = 0; j < runs; j++) {
+        uint64_t run_id;
+        if (fread(&run_id, sizeof(run_id), 1, file) != 1) {
+          break;
+        }
+        levels[i].push_back(std::make_shared<run>(run_file(run_id), run_id));
+        live.insert(run_file(run_id));
+      }
+    }
+    fclose(file);
+  }
+  // 没有提交的文件 (比如合并到一半时崩溃) 直接删掉.
+  auto dir = std::filesystem::path(file_prefix).parent_path();
+  auto stem = std::filesystem::path(file_prefix).filename().string() + "_";
+  for (auto &entry : std::filesystem::directory_iterator(dir)) {
+    auto fn = entry.path().filename().string();
+    if (entry.path().extension() != ".run" || fn.rfind(stem, 0) != 0) {
+      continue;
+    }
+    // 只认 <prefix>_<数字>.run, 其他前缀以此开头的索引 (比如分片) 的文件不动.
+    auto id = entry.path().stem().string().substr(stem.size());
+    if (!id.empty() &&
+        std::all_of(id.begin(), id.end(), [](char c) { return isdigit(c); }) &&
+        live.count((dir / fn).string()) == 0) {
+      std::filesystem::remove(entry.path());
+    }
+  }
+  for (size_t i = 0; i < levels.size(); i++) {
+    for (auto &r : std::vector<run_ptr>(levels[i])) {
+      if (r->max_id() < limit) {
+        continue;
+      }
+      auto run_id = next_run++;
+      merge({r}, run_file(run_id),
+            [limit](const T &t) { return t.id < limit; });
+      install({r}, i, std::make_shared<run>(run_file(run_id), run_id));
+    }
+  }
+}
+
+template <class T>
+auto LsmEngine<T>::pick_compaction(size_t *target)
+    -> std::vector<run_ptr> {
+  if (levels[0].size() >= L0_RUNS) {
+    *target = 1;
+    auto inputs = levels[0];
+    inputs.insert(inputs.end(), levels[1].begin(), levels[1].end());
+    return inputs;
+  }
+  auto limit = LEVEL_BASE;
+  for (size_t i = 1; i < levels.size(); i++, limit *= LEVEL_RATIO) {
+    if (!levels[i].empty() && levels[i][0]->size() > limit) {
+      *target = i + 1;
+      if (levels.size() == i + 1) {
+        levels.emplace_back();
+      }
+      auto inputs = levels[i];
+      inputs.insert(inputs.end(), levels[i + 1].begin(), levels[i + 1].end());
+      return inputs;
+    }
+  }
+  return {};
+}
+
+template <class T>
+template <class Keep>
+void LsmEngine<T>::merge(const std::vector<run_ptr> &inputs,
+                         std::string file_name, Keep &&keep) {
+  std::vector<std::pair<const T *, const T *>> ranges;
+  std::vector<const T *> heads;
+  uint64_t expected = 0;
+  for (auto &r : inputs) {
+    ranges.push_back({r->begin(), r->end()});
+    heads.push_back(r->size() > 0 ? r->begin() : nullptr);
+    expected += r->size();
+  }
+  // 败者树对相等的元素按输入的顺序排列, inputs 从新到旧, 所以较新的在前.
+  LoserTree<T> tree(heads);
+  RunWriter<T> writer(file_name, expected);
+  while (auto t = tree.top()) {
+    if (keep(*t)) {
+      writer.push(*t);
+    }
+    auto &r = ranges[tree.top_index()];
+    tree.replace_top(++r.first != r.second ? r.first : nullptr);
+  }
+  writer.finish();
+}
+
+template <class T>
+void LsmEngine<T>::install(const std::vector<run_ptr> &inputs, size_t level,
+                           run_ptr merged) {
+  // 截断时在原来的位置替换, 0 层中文件的新旧顺序不变.
+  auto &l = levels[level];
+  auto pos = std::find(l.begin(), l.end(), inputs[0]);
+  auto in_place = pos != l.end();
+  if (in_place) {
+    *pos = merged;
+  }
+  for (auto &other : levels) {
+    for (auto &r : inputs) {
+      other.erase(std::remove(other.begin(), other.end(), r), other.end());
+    }
+  }
+  if (!in_place) {
+    l.push_back(merged);
+  }
+  save_manifest();
+  for (auto &r : inputs) {
+    std::filesystem::remove(r->file_name());
+  }
+}
+
+template <class T>
+void LsmEngine<T>::compact_loop() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (!stopping) {
+    size_t target = 0;
+    auto inputs = compacting ? std::vector<run_ptr>() : pick_compaction(&target);
+    if (inputs.empty()) {
+      cv.wait(lock);
+      continue;
+    }
+    compacting = true;
+    auto run_id = next_run++;
+    lock.unlock();
+    merge(inputs, run_file(run_id), [](const T &) { return true; });
+    auto merged = std::make_shared<run>(run_file(run_id), run_id);
+    lock.lock();
+    install(inputs, target, merged);
+    compacting = false;
+    cv.notify_all();
+  }
+}
+
+template <class T>
+void LsmEngine<T>::stop_compactor() {
+  if (!compactor.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+    cv.notify_all();
+  }
+  compactor.join();
+}
+
+#pragma endregion
+
+};  // namespace ndb
+
+#endif  // INC_LSM_HH_
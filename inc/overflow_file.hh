@@ -0,0 +1,180 @@
+/**
+ * @file overflow_file.hh
+ * @author Selene
+ * @brief 保存放不进定长槽的大值, 每个值占文件中连续的一段.
+ * @version 0.2
+ * @date 2021-04-29
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef INC_OVERFLOW_FILE_HH_
+#define INC_OVERFLOW_FILE_HH_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "util.hh"
+
+namespace ndb {
+
+/**
+ * @brief 大值的存储文件. 值只追加在文件末尾, 用 (offset, len) 表示,
+ * 读取时直接返回映射到内存中的字节, 不复制.
+ * 打开时先预留一大段不可访问的地址空间, 文件按需映射到它的开头,
+ * 每次映射的长度至少是已映射的长度, 所以映射的次数只随文件大小对数增长.
+ * 映射只会向后扩展, 地址不变, 已经返回的 string_view 在关闭文件之前一直有效.
+ * 文件超出预留的空间时才另外预留一段更大的, 旧的留到关闭文件.
+ * 被覆盖或删除的值占的空间不回收.
+ *
+ */
+class OverflowFile {
+ public:
+  /**
+   * @brief OverflowFile 的构造函数.
+   *
+   * @param file_name 待保存或读取的文件名.
+   * @param create 是否新建文件.
+   */
+  OverflowFile(std::string file_name, bool create);
+  OverflowFile(const OverflowFile &) = delete;
+  auto operator=(const OverflowFile &) -> OverflowFile & = delete;
+  ~OverflowFile();
+
+  /**
+   * @brief 在文件末尾追加一个值.
+   *
+   * @return uint64_t 值在文件中的偏移.
+   */
+  auto append(std::string_view value) -> uint64_t;
+
+  /**
+   * @brief 读取 [offset, offset + len) 中的值, 不复制.
+   *
+   * @return 文件关闭之前一直有效. 超出文件范围时返回空串.
+   */
+  auto view(uint64_t offset, uint64_t len) -> std::string_view;
+
+  /**
+   * @brief 把写入的内容刷到磁盘.
+   *
+   */
+  void sync();
+
+  static constexpr uint64_t RESERVE = 1ULL << 36;  // 每次预留的地址空间
+  static constexpr uint64_t MIN_MAP = 1 << 20;     // 第一次映射的长度
+
+ private:
+  // 一段预留的地址空间, 开头的 mapped 个字节映射了文件的开头.
+  struct Region {
+    char *base = nullptr;
+    uint64_t reserved = 0;
+    uint64_t mapped = 0;
+  };
+
+  /**
+   * @brief 让当前的预留空间映射到至少 need 个字节. 调用时必须持有锁.
+   *
+   */
+  void map_to(uint64_t need);
+
+  std::string file_name;
+  int fd = -1;
+  uint64_t size = 0;
+  // 最后一个是当前使用的.
+  std::vector<Region> regions;
+  std::mutex mutex;
+};
+
+#pragma region  // # OverflowFile Implementation
+
+inline OverflowFile::OverflowFile(std::string file_name, bool create)
+    : file_name(file_name) {
+  auto flags = O_RDWR | O_CREAT | (create ? O_TRUNC : 0);
+  fd = open(file_name.c_str(), flags, 0644);
+  if (fd < 0) {
+    throw file_opening_error(file_name);
+  }
+  struct stat st;
+  fstat(fd, &st);
+  size = st.st_size;
+}
+
+inline OverflowFile::~OverflowFile() {
+  // 解除整段预留空间, 其中文件的映射也一起解除.
+  for (auto &r : regions) {
+    munmap(r.base, r.reserved);
+  }
+  close(fd);
+}
+
+inline auto OverflowFile::append(std::string_view value) -> uint64_t {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto offset = size;
+  size_t done = 0;
+  while (done < value.size()) {
+    auto n = pwrite(fd, value.data() + done, value.size() - done,
+                    static_cast<off_t>(offset + done));
+    if (n <= 0) {
+      throw file_io_error(file_name);
+    }
+    done += n;
+  }
+  size += value.size();
+  return offset;
+}
+
+inline auto OverflowFile::view(uint64_t offset, uint64_t len)
+    -> std::string_view {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (len == 0 || offset + len > size) {
+    return {};
+  }
+  if (regions.empty() || offset + len > regions.back().mapped) {
+    map_to(offset + len);
+  }
+  return {regions.back().base + offset, len};
+}
+
+inline void OverflowFile::map_to(uint64_t need) {
+  uint64_t page = sysconf(_SC_PAGESIZE);
+  auto round_up = [page](uint64_t n) { return (n + page - 1) / page * page; };
+  if (regions.empty() || need > regions.back().reserved) {
+    auto reserved = std::max(RESERVE, round_up(need * 2));
+    auto addr = mmap(nullptr, reserved, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED) {
+      throw file_io_error(file_name);
+    }
+    regions.push_back({static_cast<char *>(addr), reserved, 0});
+  }
+  auto &r = regions.back();
+  auto target = std::min(
+      r.reserved, round_up(std::max({need, r.mapped * 2, MIN_MAP})));
+  // 映射可以超出文件末尾, 文件追加之后超出的部分就能读到.
+  // 共享映射和 pwrite 写的是同一份页缓存, 刚追加的内容也能读到.
+  auto addr = mmap(r.base + r.mapped, target - r.mapped, PROT_READ,
+                   MAP_SHARED | MAP_FIXED, fd, static_cast<off_t>(r.mapped));
+  if (addr == MAP_FAILED) {
+    throw file_io_error(file_name);
+  }
+  r.mapped = target;
+}
+
+inline void OverflowFile::sync() { fdatasync(fd); }
+
+#pragma endregion
+
+};  // namespace ndb
+
+#endif  // INC_OVERFLOW_FILE_HH_
@@ -15,200 +15,909 @@
 #include <libxml/SAX2.h>
 #include <libxml/parser.h>
 #include <libxml/tree.h>
+#include <sys/stat.h>
 
 #include <algorithm>
-#include <map>
+#include <deque>
+#include <functional>
+#include <future>
+#include <limits>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 
 #include "database.hh"
+#include "dblp_scanner.hh"
 #include "util.hh"
 
 namespace ndb {
 
 using xstr = const xmlChar *;
-using poslen = std::pair<uint32_t, uint32_t>;
-
-// 之所以初始值是 6 是因为 <dblp> 无需考虑.
-poslen pos = {6, 0};
-
-std::vector<char> partial_key;
 
 enum class ParserState {
   AUTHOR,
   TITLE,
+  YEAR,
+  KEY,  // 顶层元素的 key 属性, 用于增量读取
   OTHER,
 };
 
-// 一个状态机, 用于表明当前需要插入数据的归属 (是属于 author 或是属于
-// title).
-ParserState state = ParserState::OTHER;
+/**
+ * @brief 一条数据中的一个 key, state 表明它的归属.
+ *
+ */
+struct XmlKey {
+  ParserState state;
+  std::string_view key;
+};
+
+/**
+ * @brief 解析出的一条数据, 即 <dblp> 下的一个顶层元素.
+ * pos 是上一条数据的结尾 (第一条则是 <dblp> 的结尾), end 是这一条的结尾.
+ *
+ */
+struct XmlRecord {
+  uint64_t pos = 0;
+  uint64_t end = 0;
+
+  // 按读到的顺序排列的 key, state 表明它的归属.
+  // 例如, 想要添加日期就在 ParserState 里加 DATE 状态, 再在 ingest_record
+  // 里处理 state 为 ParserState::DATE 的 key.
+  // key 指向解析器的 Arena 或者源文件, 只在 sink 调用期间有效.
+  std::vector<XmlKey> keys;
+};
+
+/**
+ * @brief 一段源文件的解析结果. key 的内容复制到自己的 Arena 里,
+ * 已经指向源文件的 key 则不必复制.
+ *
+ */
+struct ParsedChunk {
+  struct Entry {
+    uint64_t pos;
+    uint64_t end;
+    size_t first;
+    size_t last;
+  };
+
+  /**
+   * @brief 追加一条数据.
+   * @param r 一条数据.
+   * @param lo 源文件的开头, 落在 [lo, hi) 中的 key 不复制.
+   * @param hi 源文件的结尾.
+   */
+  void push(const XmlRecord &r, const char *lo = nullptr,
+            const char *hi = nullptr) {
+    auto first = keys.size();
+    for (auto k : r.keys) {
+      if (k.key.data() < lo || k.key.data() >= hi) {
+        k.key = arena.copy(k.key);
+      }
+      keys.push_back(k);
+    }
+    records.push_back({r.pos, r.end, first, keys.size()});
+  }
+
+  Arena arena{1 << 20};
+  std::vector<XmlKey> keys;
+  std::vector<Entry> records;
+};
+
+/**
+ * @brief 一次 SAX 解析的全部状态, 作为 user data 传给各个回调.
+ * 每个解析线程各有一份, 所以回调之间不共享全局变量.
+ *
+ */
+struct SaxContext {
+  xmlParserCtxtPtr ctxt = nullptr;
+
+  // 解析器看到的偏移加上 base 就是源文件中的偏移.
+  int64_t base = 0;
+  int layer_count = 0;
+
+  // 当前字段所在的层数. 字段里的嵌套标签 (比如标题里的 <i>) 不改变状态.
+  int field_layer = 0;
+
+  // 一个状态机, 用于表明当前需要插入数据的归属 (是属于 author 或是属于
+  // title).
+  ParserState state = ParserState::OTHER;
+
+  // 当前这条数据的所有字符串都从这里申请, 每读完一条顶层元素就清空.
+  Arena arena;
+  std::string_view partial_key;
+  XmlRecord record;
+
+  // 每读完一条顶层元素就调用一次.
+  std::function<void(XmlRecord &)> sink;
+};
+
+/**
+ * @brief 解析 XML 所用的扫描器.
+ *
+ */
+enum class Scanner {
+  LIBXML,  // LibXml 的 SAX, 作为参考实现
+  SIMD,    // dblp_scanner.hh 中的 DblpScanner
+};
+
+/**
+ * @brief read 命令的选项.
+ *
+ */
+struct ReadOptions {
+  std::string file_name = "xml/small.xml";
+
+  Scanner scanner = Scanner::LIBXML;
+
+  // 解析线程数. 默认为 1, 使用逐块读取的串行解析, 用 read -j 指定更多.
+  int jobs = 1;
+  static constexpr int MAX_JOBS = 256;
 
-// 这个是根据状态机的状态来决定选用哪个 vector.
-// 例如, 想要添加日期就在 ParserState 里加 DATE 状态, 再在下面加一行:
-// vector<string> &time_key_list = key_list[ParserState::TIME];
+  // 并行解析时每一块的大致字节数.
+  uint64_t chunk_size = 16 << 20;
 
-std::map<ParserState, std::vector<std::string>> key_list;
-std::vector<std::string> &title_key_list = key_list[ParserState::TITLE];
-std::vector<std::string> &author_key_list = key_list[ParserState::AUTHOR];
+  // 每读过这么多字节的源文件就保存一次检查点.
+  uint64_t checkpoint_interval = 64 << 20;
+
+  // 是否从上一次没有读完的 read 的检查点继续.
+  bool resume = false;
+
+  // 建立倒排索引时内存中 Hash 表的大小上限, 超过就写出一个段.
+  uint64_t ingest_mem = 64 << 20;
+  // read --ingest-mem 以 MiB 为单位的上限, 换算成字节后不会溢出.
+  static constexpr int64_t MAX_INGEST_MEM_MIB = 1 << 20;
+};
+
+int64_t t_cnt = 0;
+
+/**
+ * @brief 一次 read 中各类文档的数目. 不是增量读取时所有文档都算作新增.
+ *
+ */
+struct IngestStats {
+  int64_t added = 0;
+  int64_t changed = 0;
+  int64_t unchanged = 0;
+  int64_t removed = 0;
+} ingest_stats;
+
+// 需要提取的字段. 如果要存其他的 (比如日期) 就在 ParserState 里面添加状态,
+// 再在这里加一行.
+const std::vector<std::pair<std::string, ParserState>> field_list = {
+    {"author", ParserState::AUTHOR},
+    {"title", ParserState::TITLE},
+    {"year", ParserState::YEAR},
+};
+
+// 需要提取的顶层元素属性.
+const std::vector<std::pair<std::string, ParserState>> attr_list = {
+    {"key", ParserState::KEY},
+};
+
+/**
+ * @brief 根据元素名称得到状态机的状态.
+ * @param name 元素名称.
+ */
+static auto parser_state(xstr name) -> ParserState {
+  for (auto &[field, state] : field_list) {
+    if (strcmp((const char *)name, field.c_str()) == 0) {
+      return state;
+    }
+  }
+  return ParserState::OTHER;
+}
+
+/**
+ * @brief 把一个字段的内容切分成若干个 key, 追加到 r 中.
+ * 切分出的 key 尽量直接指向 key 本身, 只有需要改写时才从 arena 申请.
+ * @param key 字段的内容.
+ * @param state 字段的归属.
+ * @param r 当前的数据.
+ * @param arena 当前这条数据的 Arena.
+ */
+void push_keys(std::string_view key, ParserState state, XmlRecord *r,
+               Arena *arena) {
+  auto push_back_helper = [&](std::string_view k) {
+    // 这里保证插入的 key 最大长度为 KEY_LENGTH, 现在设置为 64.
+    // 以前的做法是补空格到 64 字节, 插入时再从第一个连续两个空格处截断,
+    // 这里直接算出截断后的结果.
+    // ? 是否存在更好的方法?
+    if (k.size() > 64) {
+      auto p = arena->allocate(64);
+      memcpy(p, k.data(), 64 - 3);
+      memcpy(p + 64 - 3, "...", 3);
+      k = {p, 64};
+    }
+    auto cut = k.find("  ");
+    if (cut == k.npos && k.size() < 64 && k.size() > 0 && k.back() == ' ') {
+      cut = k.size() - 1;
+    }
+    if (cut != k.npos) {
+      k = k.substr(0, cut);
+    } else if (k.size() == 64 - 1) {
+      k = arena->append(arena->copy(k), " ");
+    }
+    r->keys.push_back({state, k});
+  };
+  while (key.find(" - ") != key.npos || key.find("; ") != key.npos) {
+    bool flag = key.find(" - ") < key.find("; ");
+    auto p = key.find(flag ? " - " : "; ");
+    push_back_helper(key.substr(0, p));
+    key.remove_prefix(p + (flag ? 3 : 2));
+  }
+  push_back_helper(key);
+}
 
-int layer_count;
-int t_cnt = 0;
 /**
  * @brief SAX 分析起始时调用.
- * @param ctx XML 正文.
+ * @param ctx SaxContext.
  * @param name 元素名称.
  * @param attrs 元素参数对.
  */
 static void on_start_element(void *ctx, xstr name, xstr *attrs) {
   // 这里是读取<name>...</name> 然后看 name 是作者还是标题.
-  // 如果要存其他的 (比如日期) 就在 ParserState 里面添加状态,
-  // 然后添加一个 std::vector<std::string>, 再在这里修改代码.
-  // ? 似乎可以改成用 switch 的.
-  partial_key.clear();
-  layer_count++;
-  state = strcmp((const char *)name, "author") == 0  ? ParserState::AUTHOR
-          : strcmp((const char *)name, "title") == 0 ? ParserState::TITLE
-                                                     : ParserState::OTHER;
+  auto s = static_cast<SaxContext *>(ctx);
+  s->layer_count++;
+  if (s->state != ParserState::OTHER) {
+    return;
+  }
+  s->partial_key = {};
+  if (s->layer_count == 1) {
+    // 回调时 <dblp> 的 '>' 还没有被读取, 所以要加一.
+    s->record.pos = s->base + xmlByteConsumed(s->ctxt) + 1;
+  }
+  if (s->layer_count == 2 && attrs != nullptr) {
+    for (auto a = attrs; a[0] != nullptr && a[1] != nullptr; a += 2) {
+      for (auto &[attr, state] : attr_list) {
+        if (strcmp((const char *)a[0], attr.c_str()) == 0) {
+          s->record.keys.push_back(
+              {state, s->arena.copy((const char *)a[1])});
+        }
+      }
+    }
+  }
+  s->state = parser_state(name);
+  s->field_layer = s->layer_count;
 }
 
 /**
  * @brief SAX 分析结束时调用.
- * @param ctx XML 正文.
+ * @param ctx SaxContext.
  * @param name 元素名称.
  */
-static void on_end_element(void *ctx, xstr name) {
-  // 这里是读到最后, 把数据插入到数据库的表中.
-  // 如果想插入其他数据, 直接添加代码就可以.
-  state = strcmp((const char *)name, "author") == 0  ? ParserState::AUTHOR
-          : strcmp((const char *)name, "title") == 0 ? ParserState::TITLE
-                                                     : ParserState::OTHER;
-  layer_count--;
-  t_cnt++;
-  if (t_cnt % 100000 == 0) {
-    fmt::print("{}", t_cnt / 100000);
-  }
-  if (state != ParserState::OTHER) {
-    auto push_back_helper = [](std::string k) {
-      // 这里保证插入的 key 最大长度为 KEY_LENGTH, 现在设置为 64.
-      // ? 是否存在更好的方法?
-      if (k.size() > 64) {
-        k = k.substr(0, 64 - 3) + "...";
-      }
-      k.resize(64, ' ');
-      assert(k.size() == 64);
-      key_list[state].push_back(k);
-    };
-    std::string key;
-    key.insert(key.begin(), partial_key.begin(), partial_key.end());
-    while (key.find(" - ") != key.npos || key.find("; ") != key.npos) {
-      bool flag = key.find(" - ") < key.find("; ");
-      auto p = key.find(flag ? " - " : "; ");
-      auto temp = key.substr(0, p);
-      push_back_helper(temp);
-      key.erase(0, p + (flag ? 3 : 2));
-    }
-    push_back_helper(key);
-  }
-  if (layer_count == 1) {
-    pos.second = xmlSAX2GetColumnNumber(ctx) - 1;
-    for (auto it : author_key_list) {
-      // author_map.insert({it, pos});
-      assert(db.is_open());
-      Record k(pos.first, pos.second - pos.first);
-      it = it.substr(0, it.find("  "));
-      db.insert(k, it.c_str(), DatabaseState::AUTHOR);
-
-      std::stringstream in(it);
-      std::string word;
-      std::vector<std::string> word_list;
-      while (in >> word) {
-        word_list.push_back(word);
-      }
-      invidx_manager.build(word_list, pos.first, pos.second - pos.first);
-      topk_manager.insert(it);
-    }
-    for (auto it : title_key_list) {
-      assert(db.is_open());
-      Record k(pos.first, pos.second - pos.first);
-      it = it.substr(0, it.find("  "));
-      db.insert(k, it.c_str(), DatabaseState::TITLE);
-
-      std::stringstream in(it);
-      std::string word;
-      std::vector<std::string> word_list;
-      while (in >> word) {
-        word_list.push_back(word);
-      }
-      invidx_manager.build(word_list, pos.first, pos.second - pos.first);
+static void on_end_element(void *ctx, [[maybe_unused]] xstr name) {
+  // 这里是读到最后, 把这一条数据交给 sink.
+  auto s = static_cast<SaxContext *>(ctx);
+  s->layer_count--;
+  if (s->state != ParserState::OTHER) {
+    if (s->layer_count + 1 != s->field_layer) {
+      return;
     }
-    pos.first = pos.second;
-    author_key_list.clear();
-    title_key_list.clear();
+    push_keys(s->partial_key, s->state, &s->record, &s->arena);
+    s->state = ParserState::OTHER;
+  }
+  if (s->layer_count == 1) {
+    s->record.end = s->base + xmlByteConsumed(s->ctxt);
+    s->sink(s->record);
+    s->record.pos = s->record.end;
+    s->record.keys.clear();
+    s->arena.reset();
   }
 }
 
 /**
  * @brief 读取正文, 根据 ParserState 的状态来决定往哪个 vector 里插入数据.
- * @param ctx XML 正文.
+ * @param ctx SaxContext.
  * @param ch XML 字符串.
  * @param len XML 字符数.
  */
 static void on_characters(void *ctx, xstr ch, int len) {
-  if (state != ParserState::OTHER) {
-    std::string key((const char *)ch, len);
-    std::copy(key.begin(), key.end(), std::back_inserter(partial_key));
+  auto s = static_cast<SaxContext *>(ctx);
+  if (s->state != ParserState::OTHER) {
+    s->partial_key = s->arena.append(s->partial_key, {(const char *)ch,
+                                                      (size_t)len});
   }
 }
 
 /**
- * @brief 利用 LibXml 读取 XML 文件.
- * @param file_name 文件名.
+ * @brief 把一条数据插入到数据库的各个表中, 并在 d 中记下它用到的 ID.
+ * 如果想插入其他数据, 直接添加代码就可以.
+ * @param db 写入的数据库.
+ * @param k 这一条数据在源文件中的位置.
+ * @param first 这一条数据的第一个 key.
+ * @param last 这一条数据最后一个 key 之后.
+ * @param d 这一条数据的文档.
+ * @param shard 这一条数据写入哪个分片.
+ */
+void index_record(Database &db, Record k, const XmlKey *first,
+                  const XmlKey *last, DocRecord *d, size_t shard) {
+  d->first = db.next_ids(shard);
+  // 覆盖索引的包含列: 第一个标题和年份.
+  // 表中的 ID 不一定连续, 所以标题的 ID 要等插入之后才知道.
+  PaperInfo info;
+  for (auto it = first; it != last; it++) {
+    if (it->state == ParserState::TITLE) {
+      auto id = db.insert(k, it->key, DatabaseState::TITLE, shard);
+      db.invidx_managers[shard]->build(it->key, k.pos, k.len);
+      if (info.title_id < 0) {
+        info.title_id = id;
+        snprintf(info.title, sizeof(info.title), "%.*s",
+                 static_cast<int>(it->key.size()), it->key.data());
+      }
+    } else if (it->state == ParserState::YEAR) {
+      try {
+        info.year = static_cast<int32_t>(parse_number(
+            it->key, std::numeric_limits<int32_t>::min(),
+            std::numeric_limits<int32_t>::max()));
+      } catch (const invalid_number &) {
+        info.year = 0;  // 年份不是数字时当作没有年份
+      }
+    }
+  }
+  std::vector<author_id> authors;
+  for (auto it = first; it != last; it++) {
+    if (it->state == ParserState::AUTHOR) {
+      auto id = db.insert(k, it->key, DatabaseState::AUTHOR, shard);
+      db.insert_paper(it->key, id, info);
+      db.invidx_managers[shard]->build(it->key, k.pos, k.len);
+      auto a = db.dict_manager->intern(it->key);
+      db.topk_manager->add(a);
+      authors.push_back(a);
+    }
+  }
+  d->last = db.next_ids(shard);
+  db.graph_manager->add_paper(authors, 1);
+  db.doc_manager->save_authors(authors, d);
+}
+
+/**
+ * @brief 从各个表中删除一篇文档.
+ * @param db 文档所在的数据库.
+ * @param d 文档.
+ */
+void remove_record(Database &db, const DocRecord &d) {
+  db.remove({d.first, d.last});
+  auto authors = db.doc_manager->authors(d);
+  for (auto id : authors) {
+    db.topk_manager->remove(id);
+  }
+  db.graph_manager->add_paper(authors, -1);
+}
+
+/**
+ * @brief 内容没有变化的文档只需要把各个表中的 Record 指向新的位置.
+ * 改写到下一次提交才可见. 只改写成功了一部分时文档会被删除后重新插入,
+ * 删除和改写在同一次提交中生效, 读者看不到改了一半的文档.
+ * @param d 文档.
+ * @param k 文档在新的源文件中的位置.
+ * @return false 如果有 Record 放不进原来的块, 需要重新插入.
+ */
+bool refresh_record(Database &db, const DocRecord &d, Record k) {
+  return db.update({d.first, d.last}, k);
+}
+
+/**
+ * @brief 读入解析出的一条数据. 增量读取时按 key 属性找到原来的文档,
+ * 内容没变就只更新位置, 变了就先删除原来的再重新插入.
+ * @param db 写入的数据库.
+ * @param pos 上一条数据的结尾.
+ * @param end 这一条数据的结尾.
+ * @param first 这一条数据的第一个 key.
+ * @param last 这一条数据最后一个 key 之后.
+ */
+void ingest_record(Database &db, uint64_t pos, uint64_t end,
+                   const XmlKey *first, const XmlKey *last) {
+  assert(db.is_open());
+  t_cnt++;
+  if (t_cnt % 100000 == 0) {
+    fmt::print("{}", t_cnt / 100000);
+  }
+  Record k(pos, end - pos);
+  static std::hash<std::string_view> hash_fn;
+  std::string_view doc_key;
+  uint64_t digest = 0;
+  for (auto it = first; it != last; it++) {
+    if (it->state == ParserState::KEY) {
+      doc_key = it->key;
+    } else {
+      digest = digest * 31 + hash_fn(it->key) + static_cast<int>(it->state);
+    }
+  }
+
+  auto &ckpt = db.last_checkpoint();
+  DocRecord d;
+  int64_t doc_id = -1;
+  std::string digest_key;
+  if (doc_key.empty()) {
+    // 没有 key 属性的文档用内容的 Hash 作 key, 内容相同的几篇依次编号.
+    // 编号已经在这次 read 中出现过就换下一个.
+    for (int n = 0;; n++) {
+      digest_key = fmt::format("#{:016x}.{}", digest, n);
+      doc_id = db.doc_manager->find(digest_key, &d);
+      if (doc_id < 0 || d.removed || d.seen != ckpt.generation) {
+        break;
+      }
+    }
+    doc_key = digest_key;
+  } else if (ckpt.delta) {
+    doc_id = db.doc_manager->find(doc_key, &d);
+  }
+  if (doc_id >= 0 && !d.removed) {
+    if (d.digest == digest && refresh_record(db, d, k)) {
+      d.seen = ckpt.generation;
+      db.doc_manager->save(doc_id, &d);
+      ingest_stats.unchanged++;
+      return;
+    }
+    remove_record(db, d);
+    ingest_stats.changed++;
+  } else {
+    ingest_stats.added++;
+  }
+  index_record(db, k, first, last, &d, db.shard_of(doc_key));
+  d.digest = digest;
+  d.seen = ckpt.generation;
+  d.removed = false;
+  if (doc_id >= 0) {
+    db.doc_manager->save(doc_id, &d);
+  } else {
+    db.doc_manager->insert(doc_key, &d);
+  }
+}
+
+/**
+ * @brief 增量读取的最后一步, 删除新版本中已经没有的文档.
  *
  */
+void remove_missing_docs(Database &db) {
+  auto generation = db.last_checkpoint().generation;
+  DocRecord d;
+  for (int64_t i = 0; i < db.doc_manager->size(); i++) {
+    if (db.doc_manager->recover(i, &d) && !d.removed && d.seen < generation) {
+      remove_record(db, d);
+      d.removed = true;
+      db.doc_manager->save(i, &d);
+      ingest_stats.removed++;
+    }
+  }
+}
+
+void ingest_record(Database &db, const XmlRecord &r) {
+  auto first = r.keys.data();
+  ingest_record(db, r.pos, r.end, first, first + r.keys.size());
+}
+
+/**
+ * @brief 按顺序插入一段源文件的解析结果.
+ * @param chunk 一段源文件的解析结果.
+ */
+void ingest_chunk(Database &db, const ParsedChunk &chunk) {
+  auto keys = chunk.keys.data();
+  for (auto &r : chunk.records) {
+    ingest_record(db, r.pos, r.end, keys + r.first, keys + r.last);
+  }
+}
+
+/**
+ * @brief 建立一个 SAX 推送式解析器.
+ * @param s 解析状态, 同时作为回调的 user data.
+ * @param chars 开头的若干字节, 用于判断编码.
+ * @param size 开头的字节数.
+ */
+auto create_sax_parser(SaxContext *s, const char *chars, int size)
+    -> xmlParserCtxtPtr {
+  auto sax_hander = [&] {
+    xmlSAXHandler sax_hander;
+    memset(&sax_hander, 0, sizeof(xmlSAXHandler));
+    // 推送式解析器在 XML_SAX2_MAGIC 下只会调用 startElementNs,
+    // 所以这里不能用它, 否则 startElement 和 endElement 都不会被调用.
+    sax_hander.initialized = 1;
+    sax_hander.startElement = on_start_element;
+    sax_hander.endElement = on_end_element;
+    sax_hander.characters = on_characters;
+    return sax_hander;
+  }();
+  s->ctxt = xmlCreatePushParserCtxt(&sax_hander, s, chars, size, nullptr);
+  return s->ctxt;
+}
 
-void read_xmlfile(const char *file_name) {
+/**
+ * @brief 利用 LibXml 读取 XML 文件. 这是串行的参考实现.
+ * @param db 写入的数据库.
+ * @param file_name 文件名.
+ * @param checkpoint_interval 保存检查点的间隔 (字节).
+ * 解析出错时抛出 xml_parsing_error, 出错前的数据照常写入.
+ */
+void read_xmlfile(Database &db, const char *file_name,
+                  uint64_t checkpoint_interval) {
   FILE *file = fopen(file_name, "r");
-  layer_count = 0;
+  if (file == nullptr) {
+    throw file_opening_error(file_name);
+  }
   char chars[1024];
+  SaxContext s;
+  uint64_t last_checkpoint = 0;
+  s.sink = [&](XmlRecord &r) {
+    ingest_record(db, r);
+    if (r.end - last_checkpoint >= checkpoint_interval) {
+      db.checkpoint(r.end, t_cnt);
+      last_checkpoint = r.end;
+    }
+  };
+  auto res = fread(chars, 1, 4, file);
+  auto ctxt = create_sax_parser(&s, chars, res);
+  uint64_t fed = res;
   try {
-    if (file == nullptr) {
-      // todo:
-      // throw file_opening_error();
-    }
-    auto res = fread(chars, 1, 4, file);
-    if (res <= 0) {
-      // todo:
-      // throw file_reading_error();
-    }
-    auto sax_hander = [&] {
-      xmlSAXHandler sax_hander;
-      memset(&sax_hander, 0, sizeof(xmlSAXHandler));
-      sax_hander.initialized = XML_SAX2_MAGIC;  // 听说 XML_SAX2_MAGIC 比 0 好.
-      sax_hander.startElement = on_start_element;
-      sax_hander.endElement = on_end_element;
-      sax_hander.characters = on_characters;
-      return sax_hander;
-    }();
-    auto ctxt =
-        xmlCreatePushParserCtxt(&sax_hander, nullptr, chars, res, nullptr);
     while ((res = fread(chars, 1, sizeof(chars), file)) > 0) {
       if (xmlParseChunk(ctxt, chars, res, 0)) {
         xmlParserError(ctxt, "xmlParseChunk");
-        // todo:
-        // throw xml_parsing_error();
+        throw xml_parsing_error(s.record.pos, fed + res);
       }
+      fed += res;
     }
-    xmlParseChunk(ctxt, chars, 0, 1);
+    if (xmlParseChunk(ctxt, chars, 0, 1)) {
+      throw xml_parsing_error(s.record.pos, fed);
+    }
+  } catch (...) {
+    // 读取没有完成, 交给调用者处理, 之后可以用 read --resume 继续.
     xmlFreeParserCtxt(ctxt);
     xmlCleanupParser();
-  } catch (const std::exception &e) {
-    fmt::print("{}\n", e.what());
+    fclose(file);
+    throw;
   }
+  xmlFreeParserCtxt(ctxt);
+  xmlCleanupParser();
   fclose(file);
 }
 
+/**
+ * @brief 找到根元素 <dblp ...> 的结尾, 跳过 XML 声明, 注释和 DOCTYPE.
+ * @param data 源文件内容.
+ * @param size 源文件长度.
+ * @return 根元素开始标签之后的偏移, 找不到时返回 0.
+ */
+auto find_root_end(const char *data, uint64_t size) -> uint64_t {
+  uint64_t i = 0;
+  while (i < size) {
+    auto lt = static_cast<const char *>(memchr(data + i, '<', size - i));
+    if (lt == nullptr) {
+      return 0;
+    }
+    i = lt - data;
+    if (i + 1 < size && (data[i + 1] == '?' || data[i + 1] == '!')) {
+      i++;
+      continue;
+    }
+    auto gt = static_cast<const char *>(memchr(data + i, '>', size - i));
+    return gt == nullptr ? 0 : gt - data + 1;
+  }
+  return 0;
+}
+
+/**
+ * @brief 从 from 开始找到下一个顶层元素的边界, 即上一条数据结尾的 '>' 之后.
+ * DBLP 的顶层元素名称不会出现在数据内部, 所以看到这些名称的开始标签就说明
+ * 到了一条新数据.
+ * @param data 源文件内容.
+ * @param from 开始查找的偏移.
+ * @param to 查找的上界.
+ * @return 边界的偏移, 找不到时返回 to.
+ */
+auto next_record_boundary(const char *data, uint64_t from, uint64_t to)
+    -> uint64_t {
+  static const std::vector<std::string> record_tags = {
+      "article",       "inproceedings", "proceedings", "book",
+      "incollection",  "phdthesis",     "mastersthesis", "www",
+      "person",        "data",
+  };
+  auto i = from;
+  while (i < to) {
+    auto lt = static_cast<const char *>(memchr(data + i, '<', to - i));
+    if (lt == nullptr) {
+      return to;
+    }
+    i = lt - data + 1;
+    auto is_record = std::any_of(
+        record_tags.begin(), record_tags.end(), [&](const std::string &t) {
+          auto e = i + t.size();
+          return e < to && memcmp(data + i, t.data(), t.size()) == 0 &&
+                 (data[e] == ' ' || data[e] == '>');
+        });
+    if (!is_record) {
+      continue;
+    }
+    auto j = i - 1;
+    while (j > from && isspace(static_cast<unsigned char>(data[j - 1]))) {
+      j--;
+    }
+    if (j > from && data[j - 1] == '>') {
+      return j;
+    }
+  }
+  return to;
+}
+
+/**
+ * @brief 解析源文件中的一段, 这一段由若干条完整的顶层元素组成.
+ * 为了让编码和 DOCTYPE 与串行解析时一致, 会把 <dblp> 之前的部分接在前面.
+ * @param data 源文件内容.
+ * @param prolog_len <dblp> 开始标签结尾的偏移.
+ * @param begin 这一段的开始.
+ * @param end 这一段的结尾.
+ * @return 解析出的数据. 这一段有错误时抛出 xml_parsing_error.
+ */
+auto parse_xml_range(const char *data, uint64_t prolog_len, uint64_t begin,
+                     uint64_t end) -> ParsedChunk {
+  ParsedChunk chunk;
+  SaxContext s;
+  s.base = static_cast<int64_t>(begin) - static_cast<int64_t>(prolog_len);
+  s.sink = [&chunk](XmlRecord &r) { chunk.push(r); };
+  auto head = std::min<uint64_t>(4, prolog_len);
+  auto ctxt = create_sax_parser(&s, data, head);
+  // 和串行解析一样每次只送 1024 字节. 需要转换编码时 (比如 ISO-8859-1),
+  // 一次送得太多会让 xmlByteConsumed 算错位置.
+  auto failed = false;
+  auto feed = [ctxt, &failed](const char *p, uint64_t n) {
+    while (n > 0 && !failed) {
+      auto len = static_cast<int>(std::min<uint64_t>(n, 1024));
+      if (xmlParseChunk(ctxt, p, len, 0)) {
+        xmlParserError(ctxt, "xmlParseChunk");
+        failed = true;
+      }
+      p += len;
+      n -= len;
+    }
+  };
+  feed(data + head, prolog_len - head);
+  feed(data + begin, end - begin);
+  const char tail[] = "</dblp>";
+  if (!failed && xmlParseChunk(ctxt, tail, sizeof(tail) - 1, 1)) {
+    failed = true;
+  }
+  xmlFreeParserCtxt(ctxt);
+  if (failed) {
+    // 在主线程中从 future 取结果时抛出, 前面各段照常写入.
+    throw xml_parsing_error(begin, end);
+  }
+  return chunk;
+}
+
+/**
+ * @brief 用 DblpScanner 扫描源文件中的一段, 结果与 parse_xml_range 相同.
+ * @param data 源文件内容.
+ * @param prolog_len <dblp> 开始标签结尾的偏移.
+ * @param begin 这一段的开始.
+ * @param end 这一段的结尾.
+ * @return 解析出的数据.
+ */
+auto scan_xml_range(const char *data, uint64_t prolog_len, uint64_t begin,
+                    uint64_t end) -> ParsedChunk {
+  std::vector<std::string> fields;
+  for (auto &f : field_list) {
+    fields.push_back(f.first);
+  }
+  std::vector<std::string> attrs;
+  for (auto &a : attr_list) {
+    attrs.push_back(a.first);
+  }
+  DblpScanner scanner(fields, attrs, is_latin1({data, prolog_len}));
+  ParsedChunk chunk;
+  Arena arena;
+  XmlRecord record;
+  record.pos = begin;
+  auto lo = data + begin;
+  auto hi = data + end;
+  scanner.scan(
+      data, begin, end,
+      [&](int field, std::string_view text) {
+        // 解码过的内容在扫描器的缓冲区里, 下次解码就会被覆盖.
+        if (text.data() < lo || text.data() >= hi) {
+          text = arena.copy(text);
+        }
+        if (static_cast<size_t>(field) < field_list.size()) {
+          push_keys(text, field_list[field].second, &record, &arena);
+        } else {
+          record.keys.push_back(
+              {attr_list[field - field_list.size()].second, text});
+        }
+      },
+      [&](uint64_t record_end) {
+        record.end = record_end;
+        chunk.push(record, lo, hi);
+        record.pos = record_end;
+        record.keys.clear();
+        arena.reset();
+      });
+  return chunk;
+}
+
+/**
+ * @brief 把 <dblp> 和 </dblp> 之间的内容按顶层元素的边界切成若干段.
+ * @param data 源文件内容.
+ * @param size 源文件长度.
+ * @param start 从这个位置开始切, 必须是两条数据之间的边界.
+ * @param chunk_size 每一段的大致字节数.
+ * @param prolog_len 返回 <dblp> 开始标签结尾的偏移.
+ * @return 各段的 [开始, 结尾). 找不到 <dblp> 时为空.
+ */
+auto split_ranges(const char *data, uint64_t size, uint64_t start,
+                  uint64_t chunk_size, uint64_t *prolog_len)
+    -> std::vector<std::pair<uint64_t, uint64_t>> {
+  std::vector<std::pair<uint64_t, uint64_t>> ranges;
+  *prolog_len = find_root_end(data, size);
+  auto content_end = size;
+  const std::string root_end = "</dblp>";
+  while (content_end > *prolog_len + root_end.size() &&
+         memcmp(data + content_end - root_end.size(), root_end.data(),
+                root_end.size()) != 0) {
+    content_end--;
+  }
+  if (*prolog_len == 0 || content_end <= *prolog_len + root_end.size()) {
+    return ranges;
+  }
+  content_end -= root_end.size();
+  for (auto begin = std::max(*prolog_len, start); begin < content_end;) {
+    auto end = begin + chunk_size >= content_end
+                   ? content_end
+                   : next_record_boundary(data, begin + chunk_size,
+                                          content_end);
+    ranges.push_back({begin, end});
+    begin = end;
+  }
+  return ranges;
+}
+
+/**
+ * @brief 并行读取 XML 文件. 先按顶层元素的边界把文件切成若干段,
+ * 由多个线程分别解析, 再按原来的顺序依次插入数据库.
+ * 每条数据的 pos 和串行解析时完全相同.
+ * @param db 写入的数据库.
+ * @param file_name 文件名.
+ * @param jobs 解析线程数.
+ * @param chunk_size 每一段的大致字节数.
+ * @param scanner 解析每一段所用的扫描器.
+ * @param start 从这个位置开始读, 必须是两条数据之间的边界. 为 0 时从头读.
+ * @param checkpoint_interval 保存检查点的间隔 (字节).
+ */
+void read_xmlfile_parallel(Database &db, const char *file_name, int jobs,
+                           uint64_t chunk_size, Scanner scanner,
+                           uint64_t start, uint64_t checkpoint_interval) {
+  MappedFile file(file_name);
+  auto data = file.data();
+  uint64_t prolog_len = 0;
+  auto ranges = split_ranges(data, file.size(), start, chunk_size, &prolog_len);
+  if (ranges.empty()) {
+    return;
+  }
+
+  // libxml 要求在多线程使用前先在主线程初始化.
+  xmlInitParser();
+  auto parse_range =
+      scanner == Scanner::SIMD ? scan_xml_range : parse_xml_range;
+  std::deque<std::pair<uint64_t, std::future<ParsedChunk>>> pending;
+  auto next = ranges.begin();
+  auto launch = [&] {
+    while (next != ranges.end() &&
+           pending.size() < static_cast<size_t>(jobs) * 2) {
+      pending.push_back(
+          {next->second, std::async(std::launch::async, parse_range, data,
+                                    prolog_len, next->first, next->second)});
+      next++;
+    }
+  };
+  launch();
+  auto last_checkpoint = std::max(prolog_len, start);
+  while (!pending.empty()) {
+    auto end = pending.front().first;
+    auto chunk = pending.front().second.get();
+    pending.pop_front();
+    launch();
+    ingest_chunk(db, chunk);
+    // 每一段的结尾都是两条数据之间的边界, 可以在这里保存检查点.
+    if (end - last_checkpoint >= checkpoint_interval) {
+      db.checkpoint(end, t_cnt);
+      last_checkpoint = end;
+    }
+  }
+  xmlCleanupParser();
+}
+
+/**
+ * @brief 用 LibXml 和 DblpScanner 分别解析整个源文件, 逐条比较两者得到的
+ * 数据: 位置, 以及每个 key 的归属和内容都要相同.
+ * @param file_name 源文件名.
+ * @param chunk_size 每次比较的一段的大致字节数.
+ * @param records 返回比较过的数据条数.
+ * @return 第一条不同的数据的开始位置, 完全相同时返回 -1.
+ */
+auto compare_scanners(const char *file_name, uint64_t chunk_size,
+                      int64_t *records) -> int64_t {
+  MappedFile file(file_name);
+  auto data = file.data();
+  uint64_t prolog_len = 0;
+  auto ranges = split_ranges(data, file.size(), 0, chunk_size, &prolog_len);
+  *records = 0;
+  // 返回一段中第一条不同的数据的位置.
+  auto compare = [&](uint64_t begin, uint64_t end) -> int64_t {
+    auto a = parse_xml_range(data, prolog_len, begin, end);
+    auto b = scan_xml_range(data, prolog_len, begin, end);
+    for (size_t i = 0; i < a.records.size() || i < b.records.size(); i++) {
+      if (i >= a.records.size() || i >= b.records.size()) {
+        return i < a.records.size() ? a.records[i].pos : b.records[i].pos;
+      }
+      auto &x = a.records[i];
+      auto &y = b.records[i];
+      auto same = x.pos == y.pos && x.end == y.end &&
+                  x.last - x.first == y.last - y.first;
+      for (size_t k = 0; same && k < x.last - x.first; k++) {
+        auto &p = a.keys[x.first + k];
+        auto &q = b.keys[y.first + k];
+        same = p.state == q.state && p.key == q.key;
+      }
+      if (!same) {
+        return x.pos;
+      }
+      (*records)++;
+    }
+    return -1;
+  };
+  xmlInitParser();
+  int64_t diff = -1;
+  for (auto it = ranges.begin(); it != ranges.end() && diff < 0; it++) {
+    diff = compare(it->first, it->second);
+  }
+  xmlCleanupParser();
+  return diff;
+}
+
+/**
+ * @brief 按选项读取 XML 文件. 读取期间定期保存检查点,
+ * 中途退出后可以用 opt.resume 从最近的检查点继续.
+ * @param db 写入的数据库.
+ * @param opt read 命令的选项.
+ */
+void read_xmlfile(Database &db, const ReadOptions &opt) {
+  struct stat st;
+  if (stat(opt.file_name.c_str(), &st) != 0) {
+    throw file_opening_error(opt.file_name);
+  }
+  uint64_t start = 0;
+  if (opt.resume) {
+    auto ckpt = db.resume_point(opt.file_name, st.st_size);
+    start = ckpt.offset;
+    t_cnt = ckpt.records;
+  } else if (!db.last_checkpoint().done) {
+    throw unfinished_read(db.name());
+  } else {
+    t_cnt = 0;
+  }
+  ingest_stats = IngestStats();
+  db.set_ingest_memory(opt.ingest_mem);
+  db.begin_ingest(opt.file_name, st.st_size, t_cnt, opt.resume);
+  auto &ckpt = db.last_checkpoint();
+  if (opt.resume) {
+    // 续读时前半段的变化已经丢了, 读完后重建整个图.
+    db.graph_manager->cancel_update();
+  } else {
+    db.graph_manager->begin_update(ckpt.delta ? ckpt.generation - 1 : -1,
+                                   opt.ingest_mem);
+  }
+  // 串行解析只能从头读, 继续读取时总是用按段解析的方式.
+  if (start == 0 && opt.jobs <= 1 && opt.scanner == Scanner::LIBXML) {
+    read_xmlfile(db, opt.file_name.c_str(), opt.checkpoint_interval);
+  } else {
+    read_xmlfile_parallel(db, opt.file_name.c_str(), opt.jobs, opt.chunk_size,
+                          opt.scanner, start, opt.checkpoint_interval);
+  }
+  if (db.last_checkpoint().delta) {
+    remove_missing_docs(db);
+  }
+  db.end_ingest(t_cnt);
+  db.graph_manager->finish_update(db.doc_manager.get(), db.dict_manager.get(),
+                                  ckpt.generation, opt.ingest_mem);
+}
+
 };  // namespace ndb
 
 #endif  // INC_READ_XML_HH_
@@ -0,0 +1,718 @@
+/**
+ * @file record_file.hh
+ * @author Selene
+ * @brief 压缩保存 Record 的文件.
+ * @version 0.2
+ * @date 2021-04-10
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef INC_RECORD_FILE_HH_
+#define INC_RECORD_FILE_HH_
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "bptree.hh"
+#include "util.hh"
+
+namespace ndb {
+
+/**
+ * @brief Record 的存储文件. 第 0 页是文件头, 记录魔数, 版本和格式,
+ * 之后的数据页有两种格式, 每一页的大小相同.
+ * 块格式: 每 BLOCK_SIZE 条 Record 组成一块, 块内只存一个 64 位的基准偏移,
+ * 每条 Record 存相对于基准的 32 位差值和长度, 每条在磁盘上占 8 字节左右.
+ * 压缩格式: 每页最多放 PACKED_SIZE 条. 连续相同的
+ * Record 合成一组 (倒排索引中同一篇文章的每个单词都是同一条 Record),
+ * 每组存重复次数, 与上一组 pos 的差和长度, 都是变长整数. 一页放不下时
+ * 跳过这页剩余的 ID. 删除只在页头的位图中标记, 不需要重新编码.
+ * 读压缩页要从头解码, 所以解码后的页放在一个小的缓存中.
+ * 改写已有的 Record 时先在内存中做出新的页, 发布之前只有写者看得到,
+ * 发布之后按读者快照的提交序号决定读新页还是文件中的旧页,
+ * 旧读者都结束后才写回文件, 所以读者不会看到改写了一半的文章.
+ * 没有文件头的旧文件 (每条 Record 定长 8 字节) 无法识别, 打开时报错.
+ *
+ */
+class RecordFile {
+ public:
+  static constexpr int64_t BLOCK_SIZE = 64;
+  static constexpr int64_t PACKED_SIZE = 512;
+  static constexpr uint32_t RECORD_MAGIC = 0x43455252;  // "RREC"
+  static constexpr uint32_t FORMAT_VERSION = 1;
+  static constexpr size_t DECODED_PAGES = 16;  // 缓存的解码页数
+  // 写者读取时用的提交序号, 能看到还没有发布的改写.
+  static constexpr uint64_t LATEST = std::numeric_limits<uint64_t>::max();
+
+  /**
+   * @brief RecordFile 的构造函数.
+   *
+   * @param file_name 待保存或读取的文件名.
+   * @param create 是否新建文件.
+   * @param packed 新建 (或者打开空文件) 时是否使用压缩格式.
+   * 打开已有的文件时按文件头决定格式.
+   */
+  RecordFile(std::string file_name, bool create, bool packed = false);
+
+  /**
+   * @brief 下一条 Record 将要获得的 ID, 也就是文件中 ID 的上界.
+   *
+   * @return int64_t 下一个 ID.
+   */
+  auto size() const -> int64_t;
+
+  /**
+   * @brief 检查已有的文件是否有可识别的文件头, 不认识时抛出
+   * unsupported_format. 文件不存在或为空时不报错.
+   *
+   */
+  static void check(const std::string &file_name);
+
+  /**
+   * @brief 在文件末尾追加一条 Record.
+   * 如果 pos 放不进当前块的基准范围, 就跳过当前块剩余的位置另起一块,
+   * 所以返回的 ID 不一定是连续的.
+   *
+   * @param r 一条 Record.
+   * @return int64_t 这条 Record 的 ID.
+   */
+  auto append(const Record &r) -> int64_t;
+
+  /**
+   * @brief 把 [first, last) 中没有被删除的 Record 都改写成 r.
+   * 每一页只重新编码一次. 改写在 publish 之前只有写者看得到.
+   * 改写的页正好是末页时, 之后追加的 Record 从新的一页开始.
+   *
+   * @param first 第一个 ID.
+   * @param last 最后一个 ID 之后.
+   * @param r 新的 Record.
+   * @return true 如果改写成功.
+   * @return false 如果有一页放不下, 此时所有页都没有被修改.
+   */
+  bool update(int64_t first, int64_t last, const Record &r);
+
+  /**
+   * @brief 发布还没有发布的改写, 提交序号不小于 csn 的读者可以看到.
+   * 必须在读者能取得这个提交序号之前调用.
+   *
+   */
+  void publish(uint64_t csn);
+
+  /**
+   * @brief 把发布过的改写写进文件. 必须等看不到改写的读者都结束后调用.
+   *
+   */
+  void retire();
+
+  /**
+   * @brief 删除一条 Record. 只是把它的长度置为 0, ID 不会被重新使用.
+   *
+   * @param id Record 的 ID.
+   */
+  void erase(int64_t id);
+
+  /**
+   * @brief 读取一条 Record.
+   *
+   * @param id Record 的 ID.
+   * @param r 读取结果.
+   * @param csn 读者快照的提交序号.
+   * @return true 如果读取成功.
+   * @return false 如果 ID 超出范围或者已经被删除.
+   */
+  bool recover(int64_t id, Record *r, uint64_t csn = LATEST);
+
+  /**
+   * @brief 底层的 Pager, 用于写回缓冲区和回滚日志.
+   *
+   */
+  auto get_pager() const -> std::shared_ptr<Pager> { return pager; }
+
+  /**
+   * @brief 解码页缓存占用的内存, 按解码后的大小计算.
+   *
+   */
+  auto cached_bytes() -> uint64_t;
+
+  /**
+   * @brief 文件在磁盘上的大小.
+   *
+   */
+  auto stored_bytes() -> uint64_t;
+
+ private:
+  struct Block {
+    uint64_t base = 0;
+    uint32_t count = 0;
+    uint32_t reserved = 0;
+    std::array<uint32_t, BLOCK_SIZE> delta{};
+    std::array<uint32_t, BLOCK_SIZE> len{};
+  };
+
+  // 第 0 页.
+  struct Header {
+    uint32_t magic = RECORD_MAGIC;
+    uint32_t version = FORMAT_VERSION;
+    uint32_t packed = 0;
+    uint32_t per_page = 0;  // 每页的 ID 数
+    std::array<char, sizeof(Block) - 16> reserved{};
+  };
+  static_assert(sizeof(Header) == sizeof(Block), "pages must be the same size");
+
+  // 压缩格式的一页.
+  struct Packed {
+    uint64_t last_pos = 0;  // 最后一组的 pos
+    uint32_t count = 0;
+    uint16_t used = 0;  // data 中已用的字节数
+    uint16_t last = 0;  // 最后一组在 data 中的起点
+    std::array<uint64_t, PACKED_SIZE / 64> dead{};
+    std::array<uint8_t, sizeof(Block) - 16 - PACKED_SIZE / 8> data{};
+  };
+  static_assert(sizeof(Packed) == sizeof(Block), "pages must be the same size");
+
+  struct Group {
+    uint64_t run = 0;
+    uint64_t delta = 0;  // zigzag 编码的 pos 差
+    uint64_t len = 0;
+  };
+
+  struct Decoded {
+    int64_t page_id = -1;
+    std::vector<Record> records;
+    std::array<uint64_t, PACKED_SIZE / 64> dead{};
+  };
+
+  // 改写后还没有写回文件的一页.
+  struct Staged {
+    uint64_t csn = 0;  // 发布的提交序号, 0 表示还没有发布
+    Block block;       // 块格式的新页
+    Packed page;       // 压缩格式的新页
+    std::vector<Record> records;  // page 解码后的内容
+  };
+
+  /**
+   * @brief 尝试让 pos 放进块 b 的基准范围, 必要时调整基准.
+   *
+   * @param b 块.
+   * @param pos 新的偏移.
+   * @param skip 不参与计算的槽位 (即将被覆盖的那一条), -1 表示没有.
+   * @return true 如果可以放下.
+   */
+  static bool fit(Block *b, uint64_t pos, int64_t skip);
+
+  auto load(int64_t block_id) -> Block *;
+
+  /**
+   * @brief 在页的末尾追加一条 Record.
+   *
+   * @return false 如果放不下, 此时页没有被修改.
+   */
+  static bool pack(Packed *p, const Record &r);
+
+  /**
+   * @brief 重新编码整页.
+   *
+   * @return false 如果放不下, 此时页没有被修改.
+   */
+  static bool repack(Packed *p, const std::vector<Record> &records);
+
+  /**
+   * @brief 取得解码后的一页. 调用时必须持有 mutex.
+   *
+   */
+  auto decoded(int64_t page_id) -> const Decoded &;
+
+  /**
+   * @brief 取得一页, 末页直接用内存中的 ptail.
+   *
+   */
+  auto load_packed(int64_t page_id) -> Packed *;
+
+  /**
+   * @brief 页被修改后丢掉它的解码结果.
+   *
+   */
+  void invalidate(int64_t page_id);
+
+  /**
+   * @brief 提交序号为 csn 的读者是否看得到改写过的页 s.
+   *
+   */
+  static bool visible(const Staged &s, uint64_t csn);
+
+  static auto encode_group(const Group &g, uint8_t *out) -> size_t;
+  static auto decode_group(const uint8_t *in, size_t *pos) -> Group;
+  static auto group_size(const Group &g) -> size_t;
+  static auto put_varint(uint64_t v, uint8_t *out) -> size_t;
+  static auto get_varint(const uint8_t *in, size_t *pos) -> uint64_t;
+  static auto zigzag(int64_t v) -> uint64_t;
+  static auto unzigzag(uint64_t v) -> int64_t;
+
+  std::shared_ptr<Pager> pager;
+  bool packed = false;
+  int64_t per_page = BLOCK_SIZE;
+  Block tail;
+  int64_t tail_id = 1;
+  Block cache;
+  int64_t cache_id = -1;
+  Packed ptail;
+  Packed pcache;
+  int64_t pcache_id = -1;
+  std::array<Decoded, DECODED_PAGES> pages;
+  std::map<int64_t, Staged> staged;
+  // 查询和写入可能在不同的线程中, 缓存和末页都由它保护.
+  std::mutex mutex;
+};
+
+#pragma region  // # RecordFile Implementation
+
+RecordFile::RecordFile(std::string file_name, bool create, bool packed)
+    : pager(std::make_shared<Pager>(file_name, create)) {
+  Header head;
+  auto pages = pager->get_id(&head);
+  if (pages == 0) {
+    head.packed = packed ? 1 : 0;
+    head.per_page = packed ? PACKED_SIZE : BLOCK_SIZE;
+    pager->save(0, &head);
+    pages = 1;
+  } else {
+    pager->recover(0, &head);
+    if (head.magic != RECORD_MAGIC || head.version != FORMAT_VERSION ||
+        head.per_page != (head.packed != 0 ? PACKED_SIZE : BLOCK_SIZE)) {
+      throw unsupported_format(file_name);
+    }
+  }
+  this->packed = head.packed != 0;
+  per_page = head.per_page;
+  tail_id = std::max<int64_t>(pages - 1, 1);
+  if (pages > 1) {
+    if (this->packed) {
+      pager->recover(tail_id, &ptail);
+    } else {
+      pager->recover(tail_id, &tail);
+    }
+  }
+}
+
+void RecordFile::check(const std::string &file_name) {
+  Header head;
+  auto file = fopen(file_name.c_str(), "rb");
+  if (file == nullptr) {
+    return;
+  }
+  auto n = fread(&head, sizeof(head), 1, file);
+  auto empty = n == 0 && ftell(file) == 0;
+  fclose(file);
+  if (!empty && (n != 1 || head.magic != RECORD_MAGIC ||
+                 head.version != FORMAT_VERSION)) {
+    throw unsupported_format(file_name);
+  }
+}
+
+auto RecordFile::size() const -> int64_t {
+  return (tail_id - 1) * per_page + (packed ? ptail.count : tail.count);
+}
+
+auto RecordFile::append(const Record &r) -> int64_t {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (packed) {
+    auto from = ptail.last;
+    if (ptail.count == PACKED_SIZE || !pack(&ptail, r)) {
+      tail_id += ptail.count > 0 ? 1 : 0;
+      ptail = Packed();
+      pack(&ptail, r);
+    }
+    invalidate(tail_id);
+    if (ptail.count == 1) {
+      pager->save(tail_id, &ptail);
+    } else {
+      // 只有页头和最后一两组变了.
+      pager->save(tail_id, &ptail, 0, offsetof(Packed, dead));
+      pager->save(tail_id, &ptail, offsetof(Packed, data) + from,
+                  ptail.used - from);
+    }
+    return (tail_id - 1) * PACKED_SIZE + ptail.count - 1;
+  }
+  auto base = tail.base;
+  if (tail.count == BLOCK_SIZE ||
+      (tail.count > 0 && !fit(&tail, r.pos, -1))) {
+    tail_id += tail.count > 0 ? 1 : 0;
+    tail = Block();
+  }
+  auto whole = tail.count == 0 || tail.base != base;
+  if (tail.count == 0) {
+    tail.base = r.pos;
+  }
+  auto slot = tail.count++;
+  tail.delta[slot] = static_cast<uint32_t>(r.pos - tail.base);
+  tail.len[slot] = r.len;
+  if (whole) {
+    // 新的块, 或者换了基准, 所有差值都变了.
+    pager->save(tail_id, &tail);
+  } else {
+    pager->save(tail_id, &tail, 0, offsetof(Block, delta));
+    pager->save(tail_id, &tail, offsetof(Block, delta) + slot * 4, 4);
+    pager->save(tail_id, &tail, offsetof(Block, len) + slot * 4, 4);
+  }
+  return (tail_id - 1) * BLOCK_SIZE + slot;
+}
+
+bool RecordFile::update(int64_t first, int64_t last, const Record &r) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (first == last) {
+    return true;
+  }
+  if (first < 0 || last > size() || first > last) {
+    return false;
+  }
+  // 先在副本上做出所有的新页, 都放得下才换进 staged.
+  std::map<int64_t, Staged> next;
+  for (auto page_id = 1 + first / per_page; page_id <= 1 + (last - 1) / per_page;
+       page_id++) {
+    auto it = staged.find(page_id);
+    auto from = std::max(first, (page_id - 1) * per_page) % per_page;
+    auto to = std::min(last - (page_id - 1) * per_page, per_page);
+    Staged s;
+    if (packed) {
+      if (it != staged.end()) {
+        s.page = it->second.page;
+        s.records = it->second.records;
+      } else {
+        s.records = decoded(page_id).records;
+        s.page = *load_packed(page_id);
+      }
+      for (auto slot = from; slot < to; slot++) {
+        if (slot < static_cast<int64_t>(s.records.size()) &&
+            (s.page.dead[slot / 64] >> (slot % 64) & 1) == 0 &&
+            s.records[slot].len != 0) {
+          s.records[slot] = r;
+        }
+      }
+      if (!repack(&s.page, s.records)) {
+        return false;
+      }
+    } else {
+      if (it != staged.end()) {
+        s.block = it->second.block;
+      } else {
+        s.block = page_id == tail_id ? tail : *load(page_id);
+      }
+      auto &b = s.block;
+      for (auto slot = from; slot < to; slot++) {
+        if (slot >= b.count || b.len[slot] == 0) {
+          continue;
+        }
+        if (!fit(&b, r.pos, slot)) {
+          return false;
+        }
+        b.delta[slot] = static_cast<uint32_t>(r.pos - b.base);
+        b.len[slot] = r.len;
+      }
+    }
+    next[page_id] = std::move(s);
+  }
+  for (auto &[page_id, s] : next) {
+    staged[page_id] = std::move(s);
+  }
+  if (staged.count(tail_id) > 0) {
+    // 末页的新内容要到 retire 才写回, 之后的追加换到新的一页上.
+    tail_id++;
+    ptail = Packed();
+    tail = Block();
+    if (packed) {
+      pager->save(tail_id, &ptail);
+    } else {
+      pager->save(tail_id, &tail);
+    }
+  }
+  return true;
+}
+
+void RecordFile::publish(uint64_t csn) {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto &[page_id, s] : staged) {
+    if (s.csn == 0) {
+      s.csn = csn;
+    }
+  }
+}
+
+void RecordFile::retire() {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto &[page_id, s] : staged) {
+    if (packed) {
+      pager->save(page_id, &s.page);
+    } else {
+      pager->save(page_id, &s.block);
+    }
+    invalidate(page_id);
+    if (pcache_id == page_id) {
+      pcache_id = -1;
+    }
+    if (cache_id == page_id) {
+      cache_id = -1;
+    }
+  }
+  staged.clear();
+}
+
+void RecordFile::erase(int64_t id) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (id < 0 || id >= size()) {
+    return;
+  }
+  if (packed) {
+    auto page_id = 1 + id / PACKED_SIZE;
+    auto slot = id % PACKED_SIZE;
+    auto p = load_packed(page_id);
+    auto bit = 1ULL << (slot % 64);
+    if (slot >= p->count || (p->dead[slot / 64] & bit) != 0) {
+      return;
+    }
+    p->dead[slot / 64] |= bit;
+    auto it = staged.find(page_id);
+    if (it != staged.end()) {
+      it->second.page.dead[slot / 64] |= bit;
+    }
+    invalidate(page_id);
+    pager->save(page_id, p, offsetof(Packed, dead) + slot / 64 * 8, 8);
+    return;
+  }
+  auto block_id = 1 + id / BLOCK_SIZE;
+  auto slot = id % BLOCK_SIZE;
+  auto b = block_id == tail_id ? &tail : load(block_id);
+  if (slot >= b->count || b->len[slot] == 0) {
+    return;
+  }
+  b->delta[slot] = 0;
+  b->len[slot] = 0;
+  auto it = staged.find(block_id);
+  if (it != staged.end()) {
+    it->second.block.delta[slot] = 0;
+    it->second.block.len[slot] = 0;
+  }
+  pager->save(block_id, b, offsetof(Block, delta) + slot * 4, 4);
+  pager->save(block_id, b, offsetof(Block, len) + slot * 4, 4);
+}
+
+bool RecordFile::recover(int64_t id, Record *r, uint64_t csn) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (id < 0 || id >= size()) {
+    return false;
+  }
+  auto it = staged.find(1 + id / per_page);
+  auto fresh = it != staged.end() && visible(it->second, csn);
+  if (packed) {
+    auto slot = id % PACKED_SIZE;
+    auto &records =
+        fresh ? it->second.records : decoded(1 + id / PACKED_SIZE).records;
+    auto &dead = fresh ? it->second.page.dead
+                       : decoded(1 + id / PACKED_SIZE).dead;
+    if (slot >= static_cast<int64_t>(records.size()) ||
+        (dead[slot / 64] >> (slot % 64) & 1) != 0 || records[slot].len == 0) {
+      return false;
+    }
+    *r = records[slot];
+    return true;
+  }
+  auto block_id = 1 + id / BLOCK_SIZE;
+  auto slot = id % BLOCK_SIZE;
+  auto b = fresh                 ? &it->second.block
+           : block_id == tail_id ? &tail
+                                 : load(block_id);
+  if (slot >= b->count || b->len[slot] == 0) {
+    return false;
+  }
+  r->pos = b->base + b->delta[slot];
+  r->len = b->len[slot];
+  return true;
+}
+
+auto RecordFile::cached_bytes() -> uint64_t {
+  std::lock_guard<std::mutex> lock(mutex);
+  uint64_t ret = 0;
+  for (auto &d : pages) {
+    ret += d.records.capacity() * sizeof(Record) + sizeof(d.dead);
+  }
+  return ret;
+}
+
+auto RecordFile::stored_bytes() -> uint64_t {
+  Header h;
+  return pager->get_id(&h) * sizeof(Header);
+}
+
+bool RecordFile::fit(Block *b, uint64_t pos, int64_t skip) {
+  auto lo = pos;
+  auto hi = pos;
+  for (int64_t i = 0; i < b->count; i++) {
+    if (i == skip || b->len[i] == 0) {
+      continue;
+    }
+    lo = std::min<uint64_t>(lo, b->base + b->delta[i]);
+    hi = std::max<uint64_t>(hi, b->base + b->delta[i]);
+  }
+  if (hi - lo > std::numeric_limits<uint32_t>::max()) {
+    return false;
+  }
+  if (lo != b->base) {
+    for (int64_t i = 0; i < b->count; i++) {
+      b->delta[i] = b->len[i] == 0 ? 0 : b->base + b->delta[i] - lo;
+    }
+    b->base = lo;
+  }
+  return true;
+}
+
+auto RecordFile::load(int64_t block_id) -> Block * {
+  if (cache_id != block_id) {
+    pager->recover(block_id, &cache);
+    cache_id = block_id;
+  }
+  return &cache;
+}
+
+bool RecordFile::pack(Packed *p, const Record &r) {
+  if (p->count > 0) {
+    size_t pos = p->last;
+    auto g = decode_group(p->data.data(), &pos);
+    if (r.pos == p->last_pos && r.len == g.len) {
+      // 和上一条相同, 只增加最后一组的重复次数.
+      g.run++;
+      if (p->last + group_size(g) > p->data.size()) {
+        return false;
+      }
+      p->used = p->last + encode_group(g, &p->data[p->last]);
+      p->count++;
+      return true;
+    }
+  }
+  Group g{1, zigzag(static_cast<int64_t>(r.pos - p->last_pos)), r.len};
+  if (p->used + group_size(g) > p->data.size()) {
+    return false;
+  }
+  p->last = p->used;
+  p->used += encode_group(g, &p->data[p->used]);
+  p->last_pos = r.pos;
+  p->count++;
+  return true;
+}
+
+bool RecordFile::repack(Packed *p, const std::vector<Record> &records) {
+  Packed q;
+  q.dead = p->dead;
+  for (auto &r : records) {
+    if (!pack(&q, r)) {
+      return false;
+    }
+  }
+  *p = q;
+  return true;
+}
+
+auto RecordFile::decoded(int64_t page_id) -> const Decoded & {
+  auto &d = pages[page_id % DECODED_PAGES];
+  if (d.page_id != page_id) {
+    auto p = load_packed(page_id);
+    d.records.clear();
+    uint64_t cur = 0;
+    size_t pos = 0;
+    while (pos < p->used) {
+      auto g = decode_group(p->data.data(), &pos);
+      cur += unzigzag(g.delta);
+      d.records.insert(d.records.end(), g.run,
+                       Record(cur, static_cast<uint32_t>(g.len)));
+    }
+    d.dead = p->dead;
+    d.page_id = page_id;
+  }
+  return d;
+}
+
+auto RecordFile::load_packed(int64_t page_id) -> Packed * {
+  if (page_id == tail_id) {
+    return &ptail;
+  }
+  if (pcache_id != page_id) {
+    pager->recover(page_id, &pcache);
+    pcache_id = page_id;
+  }
+  return &pcache;
+}
+
+bool RecordFile::visible(const Staged &s, uint64_t csn) {
+  return s.csn == 0 ? csn == LATEST : csn >= s.csn;
+}
+
+void RecordFile::invalidate(int64_t page_id) {
+  auto &d = pages[page_id % DECODED_PAGES];
+  if (d.page_id == page_id) {
+    d.page_id = -1;
+  }
+}
+
+auto RecordFile::encode_group(const Group &g, uint8_t *out) -> size_t {
+  auto n = put_varint(g.run, out);
+  n += put_varint(g.delta, out + n);
+  n += put_varint(g.len, out + n);
+  return n;
+}
+
+auto RecordFile::decode_group(const uint8_t *in, size_t *pos) -> Group {
+  Group g;
+  g.run = get_varint(in, pos);
+  g.delta = get_varint(in, pos);
+  g.len = get_varint(in, pos);
+  return g;
+}
+
+auto RecordFile::group_size(const Group &g) -> size_t {
+  uint8_t buf[32];
+  return encode_group(g, buf);
+}
+
+auto RecordFile::put_varint(uint64_t v, uint8_t *out) -> size_t {
+  size_t n = 0;
+  while (v >= 0x80) {
+    out[n++] = static_cast<uint8_t>(v | 0x80);
+    v >>= 7;
+  }
+  out[n++] = static_cast<uint8_t>(v);
+  return n;
+}
+
+auto RecordFile::get_varint(const uint8_t *in, size_t *pos) -> uint64_t {
+  uint64_t v = 0;
+  for (int shift = 0;; shift += 7) {
+    auto b = in[(*pos)++];
+    v |= static_cast<uint64_t>(b & 0x7f) << shift;
+    if ((b & 0x80) == 0) {
+      return v;
+    }
+  }
+}
+
+auto RecordFile::zigzag(int64_t v) -> uint64_t {
+  return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+}
+
+auto RecordFile::unzigzag(uint64_t v) -> int64_t {
+  return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+}
+
+#pragma endregion
+
+};  // namespace ndb
+
+#endif  // INC_RECORD_FILE_HH_
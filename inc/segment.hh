@@ -0,0 +1,214 @@
+/**
+ * @file segment.hh
+ * @author Selene
+ * @brief 磁盘上不可变的有序段, 以及段的合并.
+ * @version 0.2
+ * @date 2021-04-18
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef INC_SEGMENT_HH_
+#define INC_SEGMENT_HH_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "external_sort.hh"
+#include "util.hh"
+
+namespace ndb {
+
+/**
+ * @brief 段中元素的顺序: 先按 key, key 相同时按 id.
+ * T 需要有 key 和 id 两个成员, 比如 IvKey.
+ *
+ */
+template <class T>
+bool segment_order(const T &a, const T &b) {
+  return a.key < b.key || (a.key == b.key && a.id < b.id);
+}
+
+/**
+ * @brief 一个写好之后就不再修改的有序数组, 通过 mmap 读取.
+ * 文件开头是 Header, 后面紧跟着 count 个 T.
+ *
+ * @tparam T 元素类型, 必须可以直接按字节复制.
+ */
+template <class T>
+class Segment {
+ public:
+  struct Header {
+    uint64_t count = 0;
+    int64_t max_id = -1;  // 所有元素中最大的 id
+  };
+
+  /**
+   * @brief 打开一个已经写好的段.
+   *
+   * @param file_name 文件名.
+   * @param seg_id 段的编号.
+   */
+  Segment(std::string file_name, uint64_t seg_id);
+
+  auto begin() const -> const T * {
+    return reinterpret_cast<const T *>(file.data() + sizeof(Header));
+  }
+  auto end() const -> const T * { return begin() + header.count; }
+  auto size() const -> uint64_t { return header.count; }
+  auto max_id() const -> int64_t { return header.max_id; }
+  auto id() const -> uint64_t { return seg_id; }
+  auto file_name() const -> const std::string & { return name; }
+
+  /**
+   * @brief 找出 key 等于 key 的所有元素.
+   *
+   * @return 这些元素的范围 [first, last).
+   */
+  template <class K>
+  auto equal_range(const K &key) const -> std::pair<const T *, const T *>;
+
+ private:
+  std::string name;
+  uint64_t seg_id;
+  MappedFile file;
+  Header header;
+};
+
+/**
+ * @brief 顺序写出一个段. 元素必须已经按 segment_order 排好.
+ *
+ * @tparam T 元素类型.
+ */
+template <class T>
+class SegmentWriter {
+ public:
+  explicit SegmentWriter(std::string file_name);
+  SegmentWriter(const SegmentWriter &) = delete;
+  auto operator=(const SegmentWriter &) -> SegmentWriter & = delete;
+  ~SegmentWriter();
+
+  void push(const T &t);
+
+  /**
+   * @brief 写完所有元素后调用, 补上文件头.
+   *
+   */
+  void finish();
+
+ private:
+  std::string file_name;
+  FILE *file;
+  typename Segment<T>::Header header;
+  std::vector<T> buffer;
+};
+
+/**
+ * @brief 把若干个段合并成一个新的段.
+ *
+ * @param inputs 待合并的段.
+ * @param file_name 新段的文件名.
+ * @param keep 只保留 keep(t) 为真的元素.
+ */
+template <class T, class Keep>
+void merge_segments(const std::vector<std::shared_ptr<Segment<T>>> &inputs,
+                    std::string file_name, Keep &&keep);
+
+#pragma region  // # Segment Implementation
+
+template <class T>
+Segment<T>::Segment(std::string file_name, uint64_t seg_id)
+    : name(file_name), seg_id(seg_id), file(file_name) {
+  if (file.size() < sizeof(Header)) {
+    throw database_opening_error(file_name);
+  }
+  memcpy(&header, file.data(), sizeof(Header));
+}
+
+template <class T>
+template <class K>
+auto Segment<T>::equal_range(const K &key) const
+    -> std::pair<const T *, const T *> {
+  auto first = std::lower_bound(
+      begin(), end(), key, [](const T &t, const K &k) { return t.key < k; });
+  auto last = first;
+  while (last != end() && last->key == key) {
+    last++;
+  }
+  return {first, last};
+}
+
+template <class T>
+SegmentWriter<T>::SegmentWriter(std::string file_name)
+    : file_name(file_name), file(fopen(file_name.c_str(), "wb")) {
+  if (file == nullptr) {
+    throw file_opening_error(file_name);
+  }
+  fwrite(&header, sizeof(header), 1, file);
+  buffer.reserve((1 << 20) / sizeof(T));
+}
+
+template <class T>
+SegmentWriter<T>::~SegmentWriter() {
+  if (file != nullptr) {
+    fclose(file);
+  }
+}
+
+template <class T>
+void SegmentWriter<T>::push(const T &t) {
+  buffer.push_back(t);
+  header.count++;
+  header.max_id = std::max<int64_t>(header.max_id, t.id);
+  if (buffer.size() == buffer.capacity()) {
+    fwrite(buffer.data(), sizeof(T), buffer.size(), file);
+    buffer.clear();
+  }
+}
+
+template <class T>
+void SegmentWriter<T>::finish() {
+  fwrite(buffer.data(), sizeof(T), buffer.size(), file);
+  buffer.clear();
+  fseeko(file, 0, SEEK_SET);
+  fwrite(&header, sizeof(header), 1, file);
+  // 段的列表引用它之前必须落盘. 目录由 save_segments 一起落盘.
+  auto ok = close_synced(file);
+  file = nullptr;
+  if (!ok) {
+    throw file_io_error(file_name);
+  }
+}
+
+template <class T, class Keep>
+void merge_segments(const std::vector<std::shared_ptr<Segment<T>>> &inputs,
+                    std::string file_name, Keep &&keep) {
+  std::vector<std::pair<const T *, const T *>> ranges;
+  std::vector<const T *> heads;
+  for (auto &s : inputs) {
+    ranges.push_back({s->begin(), s->end()});
+    heads.push_back(s->size() > 0 ? s->begin() : nullptr);
+  }
+  LoserTree<T, bool (*)(const T &, const T &)> tree(heads, segment_order<T>);
+  SegmentWriter<T> writer(file_name);
+  while (auto t = tree.top()) {
+    if (keep(*t)) {
+      writer.push(*t);
+    }
+    auto &r = ranges[tree.top_index()];
+    tree.replace_top(++r.first != r.second ? r.first : nullptr);
+  }
+  writer.finish();
+}
+
+#pragma endregion
+
+};  // namespace ndb
+
+#endif  // INC_SEGMENT_HH_
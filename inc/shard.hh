@@ -0,0 +1,272 @@
+/**
+ * @file shard.hh
+ * @author Selene
+ * @brief 分片的索引: 每个分片一个存储引擎, 并行写入, 查询时分散到所有分片再合并.
+ * @version 0.2
+ * @date 2021-04-25
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef INC_SHARD_HH_
+#define INC_SHARD_HH_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "external_sort.hh"
+#include "storage_engine.hh"
+
+namespace ndb {
+
+/**
+ * @brief 由若干个分片组成的有序索引. 插入时由调用者指定分片.
+ * 分片多于一个时, 每个分片有一个写线程, insert 只是把元素放进这个分片的队列,
+ * commit 等所有队列写完再提交. 查询时并行扫描所有分片, 再按顺序归并.
+ * 只有一个分片时直接调用存储引擎, 和不分片时完全一样.
+ *
+ * @tparam T 元素类型, 同 StorageEngine.
+ */
+template <class T>
+class ShardedIndex {
+ public:
+  using visitor = typename StorageEngine<T>::visitor;
+
+  // 写线程每次从队列中取出的元素个数.
+  static constexpr size_t BATCH_SIZE = 1024;
+
+  explicit ShardedIndex(std::vector<std::shared_ptr<StorageEngine<T>>> shards);
+  ShardedIndex(const ShardedIndex &) = delete;
+  auto operator=(const ShardedIndex &) -> ShardedIndex & = delete;
+  ~ShardedIndex();
+
+  auto size() const -> size_t { return shards.size(); }
+
+  void insert(size_t shard, const T &value);
+
+  /**
+   * @brief 按顺序访问所有分片中 key 以 prefix 开头的元素.
+   *
+   * @param limit 每个分片最多取出的元素个数.
+   */
+  void scan(std::string_view prefix, const visitor &visit,
+            size_t limit = SIZE_MAX);
+
+  void begin_write();
+
+  /**
+   * @brief 等所有分片的队列写完, 然后提交每个分片.
+   *
+   */
+  void commit();
+
+  auto pagers() -> std::vector<std::shared_ptr<Pager>>;
+
+  /**
+   * @brief 按顺序打印前 64 个元素.
+   *
+   */
+  void print();
+
+  void warm_up();
+
+ private:
+  struct Queue {
+    std::vector<T> pending;  // 还没有交给写线程的元素
+    std::vector<T> ready;    // 等待写线程取走的元素
+    bool busy = false;       // 写线程正在写
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::thread writer;
+  };
+
+  /**
+   * @brief 把 pending 交给写线程, 必要时等上一批被取走.
+   *
+   */
+  void hand_off(size_t shard);
+
+  void write_loop(size_t shard);
+
+  std::vector<std::shared_ptr<StorageEngine<T>>> shards;
+  std::vector<std::unique_ptr<Queue>> queues;
+  std::atomic<bool> stopping = false;
+};
+
+#pragma region  // # ShardedIndex Implementation
+
+template <class T>
+ShardedIndex<T>::ShardedIndex(
+    std::vector<std::shared_ptr<StorageEngine<T>>> shards)
+    : shards(std::move(shards)) {
+  if (this->shards.size() <= 1) {
+    return;
+  }
+  for (size_t i = 0; i < this->shards.size(); i++) {
+    queues.push_back(std::make_unique<Queue>());
+    queues[i]->pending.reserve(BATCH_SIZE);
+    queues[i]->writer = std::thread([this, i] { write_loop(i); });
+  }
+}
+
+template <class T>
+ShardedIndex<T>::~ShardedIndex() {
+  stopping = true;
+  for (auto &q : queues) {
+    std::lock_guard<std::mutex> lock(q->mutex);
+    q->cv.notify_all();
+  }
+  for (auto &q : queues) {
+    q->writer.join();
+  }
+}
+
+template <class T>
+void ShardedIndex<T>::insert(size_t shard, const T &value) {
+  if (queues.empty()) {
+    shards[0]->insert(value);
+    return;
+  }
+  auto &q = *queues[shard];
+  q.pending.push_back(value);
+  if (q.pending.size() == BATCH_SIZE) {
+    hand_off(shard);
+  }
+}
+
+template <class T>
+void ShardedIndex<T>::hand_off(size_t shard) {
+  auto &q = *queues[shard];
+  std::unique_lock<std::mutex> lock(q.mutex);
+  q.cv.wait(lock, [&q] { return q.ready.empty(); });
+  std::swap(q.pending, q.ready);
+  q.cv.notify_all();
+}
+
+template <class T>
+void ShardedIndex<T>::write_loop(size_t shard) {
+  auto &q = *queues[shard];
+  std::vector<T> batch;
+  std::unique_lock<std::mutex> lock(q.mutex);
+  while (true) {
+    q.cv.wait(lock, [&] { return stopping || !q.ready.empty(); });
+    if (q.ready.empty()) {
+      return;
+    }
+    std::swap(batch, q.ready);
+    q.busy = true;
+    q.cv.notify_all();
+    lock.unlock();
+    for (auto &t : batch) {
+      shards[shard]->insert(t);
+    }
+    batch.clear();
+    lock.lock();
+    q.busy = false;
+    q.cv.notify_all();
+  }
+}
+
+template <class T>
+void ShardedIndex<T>::begin_write() {
+  for (auto &s : shards) {
+    s->begin_write();
+  }
+}
+
+template <class T>
+void ShardedIndex<T>::commit() {
+  for (size_t i = 0; i < queues.size(); i++) {
+    hand_off(i);
+  }
+  for (auto &q : queues) {
+    std::unique_lock<std::mutex> lock(q->mutex);
+    q->cv.wait(lock, [&q] { return q->ready.empty() && !q->busy; });
+  }
+  for (auto &s : shards) {
+    s->commit();
+  }
+}
+
+template <class T>
+void ShardedIndex<T>::scan(std::string_view prefix, const visitor &visit,
+                           size_t limit) {
+  if (shards.size() == 1) {
+    shards[0]->scan(prefix, visit);
+    return;
+  }
+  std::vector<std::future<std::vector<T>>> parts;
+  for (auto &s : shards) {
+    parts.push_back(std::async(std::launch::async, [&s, prefix, limit] {
+      std::vector<T> ret;
+      s->scan(prefix, [&ret, limit](const T &t) {
+        ret.push_back(t);
+        return ret.size() < limit;
+      });
+      return ret;
+    }));
+  }
+  std::vector<std::vector<T>> results;
+  std::vector<const T *> heads;
+  for (auto &p : parts) {
+    results.push_back(p.get());
+  }
+  for (auto &r : results) {
+    heads.push_back(r.empty() ? nullptr : r.data());
+  }
+  LoserTree<T> tree(heads);
+  while (auto t = tree.top()) {
+    if (!visit(*t)) {
+      return;
+    }
+    auto &r = results[tree.top_index()];
+    auto next = t + 1;
+    tree.replace_top(next != r.data() + r.size() ? next : nullptr);
+  }
+}
+
+template <class T>
+auto ShardedIndex<T>::pagers() -> std::vector<std::shared_ptr<Pager>> {
+  std::vector<std::shared_ptr<Pager>> ret;
+  for (auto &s : shards) {
+    for (auto &p : s->pagers()) {
+      ret.push_back(p);
+    }
+  }
+  return ret;
+}
+
+template <class T>
+void ShardedIndex<T>::print() {
+  if (shards.size() == 1) {
+    shards[0]->print();
+    return;
+  }
+  // 最多打印 64 个, 每个分片取 65 个就足够判断是否还有更多.
+  print_scan<T>([this](std::string_view prefix, const visitor &visit) {
+    scan(prefix, visit, 65);
+  });
+}
+
+template <class T>
+void ShardedIndex<T>::warm_up() {
+  for (auto &s : shards) {
+    s->warm_up();
+  }
+}
+
+#pragma endregion
+
+};  // namespace ndb
+
+#endif  // INC_SHARD_HH_
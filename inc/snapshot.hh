@@ -0,0 +1,187 @@
+/**
+ * @file snapshot.hh
+ * @author Selene
+ * @brief 多版本的可见性: 查询在快照上进行, 一篇文章要么全部可见, 要么都不可见.
+ * @version 0.2
+ * @date 2021-04-23
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef INC_SNAPSHOT_HH_
+#define INC_SNAPSHOT_HH_
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "bptree.hh"
+
+namespace ndb {
+
+// 分片的数据库中各个表的 ID 由分片号和分片内的 ID 拼成, 低 SHARD_SHIFT 位是
+// 分片内的 ID. 只有一个分片时两者相同.
+constexpr int SHARD_SHIFT = 48;
+
+inline auto global_id(size_t shard, int64_t id) -> int64_t {
+  return static_cast<int64_t>(shard) << SHARD_SHIFT | id;
+}
+
+inline auto shard_of_id(int64_t id) -> size_t {
+  return static_cast<size_t>(id >> SHARD_SHIFT);
+}
+
+inline auto local_id(int64_t id) -> int64_t {
+  return id & ((int64_t(1) << SHARD_SHIFT) - 1);
+}
+
+/**
+ * @brief 一篇文章在各个表中的 ID 范围 [first, last),
+ * 下标和 DocRecord::first 一致: title, author, 倒排索引.
+ * 一篇文章的所有 ID 都在同一个分片中.
+ *
+ */
+struct IdRange {
+  std::array<int64_t, 3> first{};
+  std::array<int64_t, 3> last{};
+};
+
+/**
+ * @brief 一个已经提交的版本上的只读视图. 各个分片的表中 ID 不小于 limits 的是
+ * 之后才插入的, 在 removed 中的是这个版本之前已经删除, 但还没有真正从文件中
+ * 抹掉的. 快照存在期间, 之后提交的删除不会写进文件.
+ *
+ */
+struct Snapshot {
+  /**
+   * @brief 第 table 个表中 ID 为 id 的元素在这个快照中是否可见.
+   *
+   */
+  bool visible(size_t table, int64_t id) const {
+    auto shard = shard_of_id(id);
+    if (shard >= limits.size() || local_id(id) >= limits[shard][table]) {
+      return false;
+    }
+    for (auto &r : removed) {
+      if (r.first[table] <= id && id < r.last[table]) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  uint64_t csn = 0;
+  std::vector<std::array<int64_t, 3>> limits;  // 每个分片一项
+  std::vector<IdRange> removed;
+  std::shared_ptr<void> pin;
+};
+
+/**
+ * @brief 版本管理. 写者的插入和删除都先不可见, publish 时一起提交,
+ * 得到一个新的提交序号 (CSN). 读者用 snapshot 取得最新提交的版本.
+ * 被删除的范围要等所有更早的读者结束后才交给写者真正删除.
+ *
+ */
+class VersionSet {
+ public:
+  /**
+   * @brief 打开数据库时调用, 文件中已有的数据都视为已经提交.
+   *
+   * @param limits 每个分片中各个表的下一个 ID.
+   */
+  void reset(std::vector<std::array<int64_t, 3>> limits);
+
+  /**
+   * @brief 取得最新提交的版本的快照.
+   *
+   */
+  auto snapshot() -> Snapshot;
+
+  /**
+   * @brief 删除一篇文章. 在下一次 publish 之前, 所有快照中它都仍然可见.
+   *
+   */
+  void remove(const IdRange &r);
+
+  /**
+   * @brief 提交 limits 之前插入的数据和此前的删除. 等比这次提交更早的读者
+   * 都结束后返回, 返回的范围此时可以从文件中删除.
+   *
+   * @param limits 每个分片中各个表的下一个 ID.
+   * @return 可以真正删除的范围.
+   */
+  auto publish(std::vector<std::array<int64_t, 3>> limits)
+      -> std::vector<IdRange>;
+
+  /**
+   * @brief 删除完 publish 返回的范围之后调用.
+   *
+   */
+  void retire();
+
+  auto csn() const -> uint64_t { return epoch.load(); }
+
+ private:
+  std::mutex mutex;
+  std::atomic<uint64_t> epoch{0};
+  std::vector<std::array<int64_t, 3>> limits;
+  std::vector<IdRange> pending;    // 还没有提交的删除
+  std::vector<IdRange> committed;  // 已经提交, 还没有从文件中删除
+  ReaderTable readers;
+};
+
+#pragma region  // # VersionSet Implementation
+
+void VersionSet::reset(std::vector<std::array<int64_t, 3>> limits) {
+  std::lock_guard<std::mutex> lock(mutex);
+  this->limits = limits;
+  pending.clear();
+  committed.clear();
+}
+
+auto VersionSet::snapshot() -> Snapshot {
+  Snapshot s;
+  // 先登记再读版本, 登记的纪元不会比读到的版本新.
+  s.pin = readers.pin(epoch);
+  std::lock_guard<std::mutex> lock(mutex);
+  s.csn = epoch.load();
+  s.limits = limits;
+  s.removed = committed;
+  return s;
+}
+
+void VersionSet::remove(const IdRange &r) {
+  std::lock_guard<std::mutex> lock(mutex);
+  pending.push_back(r);
+}
+
+auto VersionSet::publish(std::vector<std::array<int64_t, 3>> limits)
+    -> std::vector<IdRange> {
+  uint64_t e;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    this->limits = limits;
+    committed.insert(committed.end(), pending.begin(), pending.end());
+    pending.clear();
+    e = ++epoch;
+  }
+  // 之前登记的读者可能还在看被删除的数据.
+  readers.wait(e);
+  std::lock_guard<std::mutex> lock(mutex);
+  return committed;
+}
+
+void VersionSet::retire() {
+  std::lock_guard<std::mutex> lock(mutex);
+  committed.clear();
+}
+
+#pragma endregion
+
+};  // namespace ndb
+
+#endif  // INC_SNAPSHOT_HH_
@@ -0,0 +1,185 @@
+/**
+ * @file storage_engine.hh
+ * @author Selene
+ * @brief 有序索引的存储引擎接口, 以及基于 B+ 树的实现.
+ * @version 0.2
+ * @date 2021-04-24
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef INC_STORAGE_ENGINE_HH_
+#define INC_STORAGE_ENGINE_HH_
+
+#include <fmt/color.h>
+#include <fmt/core.h>
+
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "bptree.hh"
+#include "util.hh"
+
+namespace ndb {
+
+/**
+ * @brief 存储引擎的种类, 建立数据库时选择.
+ *
+ */
+enum class Engine : int32_t {
+  BTREE,  // 写时复制的 B+ 树, 查询快
+  LSM,    // LSM 树, 写入快
+};
+
+/**
+ * @brief 元素的 key 是否以 prefix 开头.
+ * T 需要有字符数组 key 和 id 两个成员, 比如 Key.
+ *
+ */
+template <class T>
+bool has_prefix(const T &t, std::string_view prefix) {
+  return prefix.size() < sizeof(t.key) &&
+         strncmp(t.key, prefix.data(), prefix.size()) == 0;
+}
+
+/**
+ * @brief 打印 scan 按顺序访问到的前 64 个元素, select 命令使用.
+ *
+ * @param scan 以前缀和 visitor 为参数的扫描函数.
+ */
+template <class T, class Scan>
+void print_scan(Scan &&scan) {
+  int64_t count = 1;
+  scan("", [&count](const T &t) {
+    if (count > 64) {
+      fmt::print("...\n");
+      fmt::print("There is more than 64 records, ");
+      fmt::print("please use `find` command.\n");
+      return false;
+    }
+    auto num = fmt::format("[{}] ", count++);
+    fmt::print(fg(fmt::terminal_color::bright_blue), "{:>5}", num);
+    fmt::print("{}\n", t.key);
+    return true;
+  });
+}
+
+/**
+ * @brief 有序索引的存储引擎. 元素按 T::operator< 排列, key 相同的元素可以
+ * 有多个. 插入在 begin_write 和 commit 之间进行, commit 之后查询才能看到.
+ *
+ * @tparam T 元素类型.
+ */
+template <class T>
+class StorageEngine {
+ public:
+  using visitor = std::function<bool(const T &)>;
+
+  virtual ~StorageEngine() = default;
+
+  virtual void insert(const T &value) = 0;
+
+  /**
+   * @brief 按顺序访问 key 以 prefix 开头的所有元素.
+   *
+   * @param prefix 前缀, 为空时访问所有元素.
+   * @param visit 返回 false 时停止.
+   */
+  virtual void scan(std::string_view prefix, const visitor &visit) = 0;
+
+  /**
+   * @brief 开始一个写事务, 之后的插入在 commit 时一起提交.
+   *
+   */
+  virtual void begin_write() = 0;
+
+  virtual void commit() = 0;
+
+  /**
+   * @brief 需要写回缓冲区和记录回滚日志的 Pager.
+   *
+   */
+  virtual auto pagers() -> std::vector<std::shared_ptr<Pager>> { return {}; }
+
+  /**
+   * @brief 按顺序打印前 64 个元素.
+   *
+   */
+  virtual void print();
+
+  /**
+   * @brief 把索引的上面几层读进缓存, 打开数据库后在后台调用.
+   *
+   */
+  virtual void warm_up() {}
+};
+
+/**
+ * @brief 用 B+ 树实现的存储引擎.
+ *
+ */
+template <class T>
+class BtreeEngine : public StorageEngine<T> {
+ public:
+  using visitor = typename StorageEngine<T>::visitor;
+
+  // 预热时读入的层数. 阶为 64 时三层大约是四千个结点.
+  static constexpr int WARM_LEVELS = 3;
+
+  /**
+   * @brief 打开或新建 B+ 树.
+   *
+   * @param file_name 文件名.
+   * @param new_file 是否新建文件.
+   */
+  BtreeEngine(std::string file_name, bool new_file)
+      : pager(std::make_shared<Pager>(file_name, new_file)),
+        bt(std::make_shared<BplusTree<T, 64>>(pager, true)) {}
+
+  void insert(const T &value) override { bt->insert(value); }
+  void scan(std::string_view prefix, const visitor &visit) override;
+  void begin_write() override { bt->begin_write(); }
+  void commit() override { bt->commit(); }
+  auto pagers() -> std::vector<std::shared_ptr<Pager>> override {
+    return {pager};
+  }
+  void print() override { bt->print(); }
+  void warm_up() override { bt->warm_up(WARM_LEVELS); }
+
+ private:
+  std::shared_ptr<Pager> pager;
+  std::shared_ptr<BplusTree<T, 64>> bt;
+};
+
+#pragma region  // # StorageEngine Implementation
+
+template <class T>
+void StorageEngine<T>::print() {
+  print_scan<T>([this](std::string_view prefix, const visitor &visit) {
+    scan(prefix, visit);
+  });
+}
+
+template <class T>
+void BtreeEngine<T>::scan(std::string_view prefix, const visitor &visit) {
+  T k(-1);
+  snprintf(k.key, sizeof(k.key), "%.*s", static_cast<int>(prefix.size()),
+           prefix.data());
+  for (auto iter = bt->find_geq(k); iter->id >= 0 && has_prefix(*iter, prefix);
+       iter++) {
+    if (!visit(*iter)) {
+      return;
+    }
+  }
+}
+
+#pragma endregion
+
+};  // namespace ndb
+
+#endif  // INC_STORAGE_ENGINE_HH_
@@ -16,46 +16,32 @@
 
 #include <algorithm>
 #include <functional>
+#include <future>
 #include <iostream>
 #include <iterator>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 
+#include "author_dict.hh"
 #include "bptree.hh"
 #include "util.hh"
 
 namespace ndb {
 
 /**
- * @brief Top K 问题所需的键.
- *
- */
-struct TkKey {
-  TkKey() {}
-  TkKey(size_t key, int64_t id) : key(key), id(id) {}
-
-  bool operator<(const TkKey &t) const { return key < t.key; }
-  bool operator<=(const TkKey &t) const { return key <= t.key; }
-  bool operator==(const TkKey &t) const { return key == t.key; }
-
-  size_t key;
-  int64_t id = -1;
-};
-
-/**
- * @brief Top K 问题所需的值.
+ * @brief Top K 问题所需的值, 即一个作者的文章数.
  *
  */
 struct TkRecord {
   TkRecord() {}
-  TkRecord(uint32_t c, const char *n) : count(c) {
-    snprintf(tkname, sizeof(tkname), "%s", n);
-  }
+  TkRecord(uint32_t c, author_id a) : count(c), author(a) {}
 
   bool operator<(const TkRecord &t) const { return count < t.count; }
   bool operator<=(const TkRecord &t) const { return count <= t.count; }
@@ -65,9 +51,15 @@ struct TkRecord {
   bool operator!=(const TkRecord &t) const { return count != t.count; }
 
   uint32_t count = 0;
-  char tkname[64];
+  author_id author = 0;
 };
 
+/**
+ * @brief 每个作者的文章数, 按作者字典中的 ID 保存.
+ * 分成 shards 个文件时, 作者 a 保存在第 a % shards 个文件的第 a / shards 处,
+ * make_topk 在每个文件上并行求前 N 名, 再合并.
+ *
+ */
 class TopK {
  public:
   /**
@@ -75,15 +67,29 @@ class TopK {
    *
    * @param tname 文件名
    * @param new_file 是否新建文件
+   * @param shards 文件个数
    */
-  void init_topk(std::string tname, bool new_file);
+  void init_topk(std::string tname, bool new_file, size_t shards = 1);
 
   /**
-   * @brief 插入一个键.
+   * @brief 把作者的计数加一. publish 之前不会写进文件.
    *
-   * @param word
+   * @param a 作者的 ID.
    */
-  void insert(std::string word);
+  void add(author_id a);
+
+  /**
+   * @brief 把作者的计数减一. publish 之前不会写进文件.
+   *
+   * @param a 作者的 ID.
+   */
+  void remove(author_id a);
+
+  /**
+   * @brief 把 add 和 remove 的修改一起写进文件, 查询不会看到一半的修改.
+   *
+   */
+  void publish();
 
   /**
    * @brief 解决问题.
@@ -94,72 +100,131 @@ class TopK {
   void make_topk(int16_t N);
 
   /**
-   * @brief
+   * @brief 打印前 K 名.
    *
    * @param K
+   * @param dict 用来查作者名的作者字典.
+   */
+  void print(int16_t K, AuthorDict &dict);
+
+  /**
+   * @brief TopK 用到的所有 Pager.
+   *
+   */
+  auto pagers() -> std::vector<std::shared_ptr<Pager>>;
+
+  /**
+   * @brief 已经记录的作者数, 也就是下一个 ID.
+   *
    */
-  void print(int16_t K);
+  auto size() const -> int64_t { return id; }
 
  private:
-  int id = 0;
-  std::shared_ptr<ndb::Pager> page_manager;
-  std::shared_ptr<ndb::Pager> record_manager;
-  std::shared_ptr<ndb::BplusTree<TkKey, 64>> bt;
-  std::hash<std::string> hash_fn;
+  /**
+   * @brief 在一个文件中求前 N 名.
+   *
+   */
+  auto shard_topk(size_t shard, int16_t N) -> std::vector<TkRecord>;
+
+  int64_t id = 0;
+  std::vector<std::shared_ptr<ndb::Pager>> record_managers;
   std::vector<TkRecord> vec;
+  std::map<author_id, int64_t> pending;  // 还没有写进文件的修改
+  std::mutex mutex;
 };
 
-TopK topk_manager{};
+void TopK::init_topk(std::string tname, bool new_file, size_t shards) {
+  record_managers.clear();
+  id = 0;
+  for (size_t i = 0; i < shards; i++) {
+    auto rec = i == 0
+                   ? fmt::format("database/{0}/{0}_topk_rec.bin", tname)
+                   : fmt::format("database/{0}/{0}_topk_rec_{1}.bin", tname, i);
+    record_managers.push_back(std::make_shared<ndb::Pager>(rec, new_file));
+    uint32_t count;
+    // 这个文件中最后一个作者的 ID 加一.
+    if (auto n = record_managers[i]->get_id(&count); n > 0) {
+      id = std::max<int64_t>(id, (n - 1) * shards + i + 1);
+    }
+  }
+  pending.clear();
+}
+
+auto TopK::pagers() -> std::vector<std::shared_ptr<Pager>> {
+  return record_managers;
+}
+
+void TopK::add(author_id a) { pending[a]++; }
+
+void TopK::remove(author_id a) { pending[a]--; }
 
-void TopK::init_topk(std::string tname, bool new_file) {
-  auto idx = fmt::format("database/{0}/{0}_topk_idx.bin", tname);
-  auto rec = fmt::format("database/{0}/{0}_topk_rec.bin", tname);
-  page_manager = std::make_shared<ndb::Pager>(idx, new_file);
-  record_manager = std::make_shared<ndb::Pager>(rec, new_file);
-  bt = std::make_shared<ndb::BplusTree<TkKey, 64>>(page_manager);
-  Record s;
-  id = record_manager->get_id(&s);
+void TopK::publish() {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto shards = record_managers.size();
+  for (auto [a, delta] : pending) {
+    auto &pager = record_managers[a % shards];
+    uint32_t count = 0;
+    if (a >= id || !pager->recover(a / shards, &count)) {
+      count = 0;
+    }
+    count = static_cast<uint32_t>(std::max<int64_t>(count + delta, 0));
+    pager->save(a / shards, &count);
+    id = std::max<int64_t>(id, a + 1);
+  }
+  pending.clear();
 }
 
-void TopK::insert(std::string word) {
-  auto pphash = hash_fn(word);
-  int cnt = 1;
-  auto iter = bt->find({pphash, -1});
-  TkRecord r;
-  record_manager->recover(iter->id, &r);
-  if (word != r.tkname) {
-    bt->insert({pphash, id});  // fixme:...
-    TkRecord r(1, word.c_str());
-    record_manager->save(id, &r);
-    id++;
-  } else {
-    r.count = r.count + 1;
-    //// printf("%s = %d\n", word.c_str(), r.count);
-    record_manager->save(iter->id, &r);
+auto TopK::shard_topk(size_t shard, int16_t N) -> std::vector<TkRecord> {
+  // 小根堆里保存当前最大的 N 个.
+  auto shards = record_managers.size();
+  std::vector<TkRecord> heap;
+  for (int64_t i = shard; i < id; i += shards) {
+    uint32_t count;
+    if (!record_managers[shard]->recover(i / shards, &count)) {
+      continue;
+    }
+    heap.push_back({count, static_cast<author_id>(i)});
+    std::push_heap(heap.begin(), heap.end(), std::greater<TkRecord>());
+    if (heap.size() > static_cast<size_t>(N)) {
+      std::pop_heap(heap.begin(), heap.end(), std::greater<TkRecord>());
+      heap.pop_back();
+    }
   }
+  return heap;
 }
 
 void TopK::make_topk(int16_t N) {
-  TkRecord t;
-  for (int i = 0; i < record_manager->get_id(&t); i++) {
-    TkRecord r;
-    record_manager->recover(i, &r);
-    vec.push_back(r);
-    std::make_heap(vec.begin(), vec.end(), std::greater<TkRecord>());
-    while (vec.size() > N) {
-      std::make_heap(vec.begin(), vec.end(), std::greater<TkRecord>());
-      std::pop_heap(vec.begin(), vec.end());
-      vec.pop_back();
+  std::lock_guard<std::mutex> lock(mutex);
+  if (record_managers.size() == 1) {
+    vec = shard_topk(0, N);
+    return;
+  }
+  std::vector<std::future<std::vector<TkRecord>>> parts;
+  for (size_t i = 0; i < record_managers.size(); i++) {
+    parts.push_back(
+        std::async(std::launch::async, [this, i, N] { return shard_topk(i, N); }));
+  }
+  // 每个作者只在一个文件中, 各个文件的前 N 名合起来的前 N 名就是全局的前 N 名.
+  vec.clear();
+  for (auto &p : parts) {
+    for (auto &t : p.get()) {
+      vec.push_back(t);
+      std::push_heap(vec.begin(), vec.end(), std::greater<TkRecord>());
+      if (vec.size() > static_cast<size_t>(N)) {
+        std::pop_heap(vec.begin(), vec.end(), std::greater<TkRecord>());
+        vec.pop_back();
+      }
     }
   }
 }
 
-void TopK::print(int16_t K) {
+void TopK::print(int16_t K, AuthorDict &dict) {
   sort(vec.begin(), vec.end(), std::greater<TkRecord>());
-  for (auto i = 0; i < K; i++) {
+  auto n = std::min(vec.size(), static_cast<size_t>(std::max<int16_t>(K, 0)));
+  for (size_t i = 0; i < n; i++) {
     auto num = fmt::format("[{}] ", i + 1);
     fmt::print(fg(fmt::terminal_color::bright_blue), "{:>5}", num);
-    fmt::print("{} ({})\n", vec[i].tkname, vec[i].count);
+    fmt::print("{} ({})\n", dict.name(vec[i].author), vec[i].count);
   }
 }
 
@@ -12,21 +12,44 @@
 #ifndef INC_UTIL_HH_
 #define INC_UTIL_HH_
 
+#include <fcntl.h>
 #include <fmt/core.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <array>
+#include <cassert>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <ctime>
 #include <exception>
+#include <filesystem>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
 namespace ndb {
 
+/**
+ * @brief 一条数据在 XML 源文件中的位置. 源文件可能超过 4 GiB, 所以 pos 是 64 位的,
+ * 落盘时由 RecordFile 负责压缩.
+ *
+ */
 struct Record {
   Record() {}
-  Record(uint32_t pos, uint32_t len) : pos(pos), len(len) {}
+  Record(uint64_t pos, uint32_t len) : pos(pos), len(len) {}
 
-  uint32_t pos = 0;
+  uint64_t pos = 0;
   uint32_t len = 0;
 };
 
@@ -80,11 +103,52 @@ class ArrayProperty {
   std::array<T, S> val;
 };
 
-void print_msg() {
+/**
+ * 第一次使用时才初始化的成员. 初始化函数由 reset 设置, 只会调用一次;
+ * 多个线程同时第一次使用时, 其余线程等它初始化完.
+ * 用 -> 或 get() 访问, 和指针的用法一样.
+ */
+template <class T>
+class Lazy {
+ public:
+  using init_func = std::function<void(T &)>;
+
+  /**
+   * @brief 设置初始化函数, 下一次使用时调用. 不能和 get 同时调用.
+   *
+   */
+  void reset(init_func f) {
+    val.reset();
+    init = std::move(f);
+    once = std::make_unique<std::once_flag>();
+  }
+
+  /**
+   * @brief 取得对象, 第一次调用时先初始化. 初始化抛出异常时下次再试,
+   * 初始化到一半的对象不会留下来.
+   *
+   */
+  auto get() -> T & {
+    std::call_once(*once, [this] {
+      auto t = std::make_unique<T>();
+      init(*t);
+      val = std::move(t);
+    });
+    return *val;
+  }
+  auto operator->() -> T * { return &get(); }
+
+ private:
+  std::unique_ptr<T> val;
+  init_func init = [](T &) {};
+  std::unique_ptr<std::once_flag> once = std::make_unique<std::once_flag>();
+};
+
+inline void print_msg() {
   fmt::print("tssndb version 1.5.0\n");
   fmt::print("i.e. too simple sometimes naive database\n");
 }
-void print_prompt() { fmt::print("MDB >>> "); }
+inline void print_prompt() { fmt::print("MDB >>> "); }
 
 /**
  * @brief 参数数目有误.
@@ -126,6 +190,23 @@ struct database_opening_error : public std::exception {
   std::string file_name;
 };
 
+/**
+ * @brief 源文件打开有错误.
+ *
+ */
+struct file_opening_error : public std::exception {
+  explicit file_opening_error(std::string fn) : file_name(fn) {}
+  std::string msg() const throw() {
+    auto str = fmt::format("Cannot open file {}.", file_name);
+    return str;
+  }
+  std::string how() const throw() {
+    auto str = fmt::format("Please check the path.");
+    return str;
+  }
+  std::string file_name;
+};
+
 /**
  * @brief 没有打开的数据库.
  *
@@ -175,6 +256,23 @@ struct another_database_opening : public std::exception {
   std::string db_name;
 };
 
+/**
+ * @brief 名为 [] 的数据库没有打开.
+ *
+ */
+struct database_closed : public std::exception {
+  explicit database_closed(std::string db) : db_name(db) {}
+  std::string msg() const throw() {
+    auto str = fmt::format("Database {} is not open.", db_name);
+    return str;
+  }
+  std::string how() const throw() {
+    auto str = fmt::format("Please open it first.");
+    return str;
+  }
+  std::string db_name;
+};
+
 /**
  * @brief 试图查询一个空串.
  *
@@ -191,6 +289,348 @@ struct empty_inquiry : public std::exception {
   }
 };
 
+/**
+ * @brief 数据库中有一次没有读完的 read.
+ *
+ */
+struct unfinished_read : public std::exception {
+  explicit unfinished_read(std::string db) : db_name(db) {}
+  std::string msg() const throw() {
+    auto str = fmt::format("Database {} has an unfinished read.", db_name);
+    return str;
+  }
+  std::string how() const throw() {
+    auto str = fmt::format("Use `read --resume` to continue it.");
+    return str;
+  }
+  std::string db_name;
+};
+
+/**
+ * @brief 解析源文件时出错.
+ *
+ */
+struct xml_parsing_error : public std::exception {
+  xml_parsing_error(uint64_t begin, uint64_t end) : begin(begin), end(end) {}
+  std::string msg() const throw() {
+    auto str = fmt::format("Cannot parse bytes [{}, {}) of the source file.",
+                           begin, end);
+    return str;
+  }
+  std::string how() const throw() {
+    auto str = fmt::format("Please check the source file near this position.");
+    return str;
+  }
+  uint64_t begin;
+  uint64_t end;
+};
+
+/**
+ * @brief 无法从检查点继续读取.
+ *
+ */
+struct cannot_resume : public std::exception {
+  explicit cannot_resume(std::string reason) : reason(reason) {}
+  std::string msg() const throw() {
+    auto str = fmt::format("Cannot resume: {}.", reason);
+    return str;
+  }
+  std::string how() const throw() {
+    auto str = fmt::format("Please create a new database and read again.");
+    return str;
+  }
+  std::string reason;
+};
+
+/**
+ * @brief 作者字典中没有这个作者.
+ *
+ */
+struct author_not_found : public std::exception {
+  explicit author_not_found(std::string name) : name(name) {}
+  std::string msg() const throw() {
+    auto str = fmt::format("Author {} not found.", name);
+    return str;
+  }
+  std::string how() const throw() {
+    auto str = fmt::format("Use `find author` to look up the full name.");
+    return str;
+  }
+  std::string name;
+};
+
+/**
+ * @brief 命令的参数不是范围内的整数.
+ *
+ */
+struct invalid_number : public std::exception {
+  invalid_number(std::string arg, int64_t lo, int64_t hi)
+      : arg(arg), lo(lo), hi(hi) {}
+  std::string msg() const throw() {
+    auto str = fmt::format("{} is not a valid number.", arg);
+    return str;
+  }
+  std::string how() const throw() {
+    auto str = fmt::format("Please use an integer from {} to {}.", lo, hi);
+    return str;
+  }
+  std::string arg;
+  int64_t lo;
+  int64_t hi;
+};
+
+/**
+ * @brief 不认识的存储引擎.
+ *
+ */
+struct unknown_engine : public std::exception {
+  explicit unknown_engine(std::string name) : name(name) {}
+  std::string msg() const throw() {
+    auto str = fmt::format("Unknown engine {}.", name);
+    return str;
+  }
+  std::string how() const throw() {
+    auto str = fmt::format("Please use btree or lsm.");
+    return str;
+  }
+  std::string name;
+};
+
+/**
+ * @brief 把整个字符串解析为 [lo, hi] 中的整数, 否则抛出 invalid_number.
+ *
+ */
+inline auto parse_number(std::string_view arg, int64_t lo, int64_t hi)
+    -> int64_t {
+  int64_t n = 0;
+  auto [end, ec] = std::from_chars(arg.data(), arg.data() + arg.size(), n);
+  if (ec != std::errc() || end != arg.data() + arg.size() || n < lo ||
+      n > hi) {
+    throw invalid_number(std::string(arg), lo, hi);
+  }
+  return n;
+}
+
+/**
+ * @brief 64 位的 FNV-1a Hash. 结果写进文件或者决定数据放在哪里时用它,
+ * 不用 std::hash, 后者的结果随标准库的实现而变.
+ *
+ */
+inline auto fnv1a(std::string_view s) -> uint64_t {
+  uint64_t h = 0xcbf29ce484222325;
+  for (auto c : s) {
+    h = (h ^ static_cast<uint8_t>(c)) * 0x100000001b3;
+  }
+  return h;
+}
+
+/**
+ * @brief 编码后的键超过了索引中键的长度.
+ *
+ */
+struct key_too_long : public std::exception {
+  key_too_long(size_t len, size_t limit) : len(len), limit(limit) {}
+  std::string msg() const throw() {
+    auto str = fmt::format("Encoded key has {} bytes, but the limit is {}.",
+                           len, limit);
+    return str;
+  }
+  std::string how() const throw() {
+    auto str = fmt::format("Use a shorter key or a larger key size.");
+    return str;
+  }
+  size_t len;
+  size_t limit;
+};
+
+/**
+ * @brief 读写文件时出错.
+ *
+ */
+struct file_io_error : public std::exception {
+  explicit file_io_error(std::string fn) : file_name(fn) {}
+  std::string msg() const throw() {
+    auto str = fmt::format("Cannot read or write file {}.", file_name);
+    return str;
+  }
+  std::string how() const throw() {
+    auto str = fmt::format("Please check the disk space and permissions.");
+    return str;
+  }
+  std::string file_name;
+};
+
+/**
+ * @brief 把 file 写回并落盘, 然后关闭它. 文件被改名或者被别的文件引用之前
+ * 要先这样关闭, 否则崩溃后引用可能指向内容不全的文件.
+ * @return false 如果任何一步失败, 这时 file 也已经关闭.
+ */
+inline auto close_synced(FILE *file) -> bool {
+  auto ok = fflush(file) == 0 && fsync(fileno(file)) == 0;
+  return fclose(file) == 0 && ok;
+}
+
+/**
+ * @brief 让 file_name 所在目录中的新建和改名落盘.
+ * @param file_name 目录中的一个文件.
+ */
+inline void sync_parent_dir(const std::string &file_name) {
+  auto dir = std::filesystem::path(file_name).parent_path();
+  if (dir.empty()) {
+    dir = ".";
+  }
+  auto fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+  auto ok = fd >= 0 && fsync(fd) == 0;
+  if (fd >= 0) {
+    ::close(fd);
+  }
+  if (!ok) {
+    throw file_io_error(dir.string());
+  }
+}
+
+/**
+ * @brief 文件是旧版本写的, 格式不认识.
+ *
+ */
+struct unsupported_format : public std::exception {
+  explicit unsupported_format(std::string fn) : file_name(fn) {}
+  std::string msg() const throw() {
+    auto str = fmt::format("File {} was written by an older version.",
+                           file_name);
+    return str;
+  }
+  std::string how() const throw() {
+    auto str = fmt::format("Please create the database again and re-read it.");
+    return str;
+  }
+  std::string file_name;
+};
+
+/**
+ * @brief 以只读方式映射到内存中的文件.
+ *
+ */
+class MappedFile {
+ public:
+  explicit MappedFile(std::string file_name) {
+    fd = open(file_name.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw file_opening_error(file_name);
+    }
+    struct stat st;
+    fstat(fd, &st);
+    len = st.st_size;
+    if (len > 0) {
+      addr = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (addr == MAP_FAILED) {
+        close(fd);
+        throw file_opening_error(file_name);
+      }
+      madvise(addr, len, MADV_SEQUENTIAL);
+    }
+  }
+  MappedFile(const MappedFile &) = delete;
+  auto operator=(const MappedFile &) -> MappedFile & = delete;
+  ~MappedFile() {
+    if (addr != nullptr) {
+      munmap(addr, len);
+    }
+    close(fd);
+  }
+
+  auto data() const -> const char * { return static_cast<const char *>(addr); }
+  auto size() const -> uint64_t { return len; }
+
+ private:
+  int fd = -1;
+  void *addr = nullptr;
+  uint64_t len = 0;
+};
+
+/**
+ * @brief 简单的线性分配器, 只能整体清空. 用于生命周期相同的一批字符串,
+ * 比如解析时同一条数据里的各个字段.
+ * 清空后已经申请的内存块会被重复使用, 所以稳定之后不再向系统申请内存.
+ *
+ */
+class Arena {
+ public:
+  explicit Arena(size_t block_size = 64 << 10) : block_size(block_size) {}
+
+  /**
+   * @brief 申请 n 字节.
+   *
+   */
+  auto allocate(size_t n) -> char * {
+    if (blocks.empty() || used + n > blocks[current].second) {
+      grow(n);
+    }
+    auto p = blocks[current].first.get() + used;
+    used += n;
+    return p;
+  }
+
+  /**
+   * @brief 把 s 复制一份到 Arena 中.
+   *
+   */
+  auto copy(std::string_view s) -> std::string_view {
+    auto p = allocate(s.size());
+    memcpy(p, s.data(), s.size());
+    return {p, s.size()};
+  }
+
+  /**
+   * @brief 把 more 接在 last 后面. 如果 last 是最近一次申请的内存并且
+   * 后面还有空间, 就直接原地接上, 否则复制到新的位置.
+   *
+   */
+  auto append(std::string_view last, std::string_view more)
+      -> std::string_view {
+    if (!blocks.empty() && last.data() != nullptr &&
+        last.data() + last.size() == blocks[current].first.get() + used &&
+        used + more.size() <= blocks[current].second) {
+      memcpy(blocks[current].first.get() + used, more.data(), more.size());
+      used += more.size();
+      return {last.data(), last.size() + more.size()};
+    }
+    auto p = allocate(last.size() + more.size());
+    memcpy(p, last.data(), last.size());
+    memcpy(p + last.size(), more.data(), more.size());
+    return {p, last.size() + more.size()};
+  }
+
+  /**
+   * @brief 清空, 之前申请的内存全部失效.
+   *
+   */
+  void reset() {
+    current = 0;
+    used = 0;
+  }
+
+ private:
+  void grow(size_t n) {
+    while (!blocks.empty() && current + 1 < blocks.size()) {
+      current++;
+      used = 0;
+      if (blocks[current].second >= n) {
+        return;
+      }
+    }
+    auto size = std::max(block_size, n);
+    blocks.push_back({std::make_unique<char[]>(size), size});
+    current = blocks.size() - 1;
+    used = 0;
+  }
+
+  size_t block_size;
+  std::vector<std::pair<std::unique_ptr<char[]>, size_t>> blocks;
+  size_t current = 0;
+  size_t used = 0;
+};
+
 /**
  * @brief 用于测试时计时的类.
  * ? 好像 C++20 有自带的.
@@ -252,7 +692,9 @@ class Clock {
   } state = State::TOCKED;
   clock_t start = clock();
   clock_t end = clock();
-} clk;
+};
+
+inline Clock clk;
 
 };  // namespace ndb
 